@@ -0,0 +1,110 @@
+"""Event loop latency while coroutines classify long documents.
+
+Prints one JSON object per line. For each way of calling the identifier from
+a coroutine, the number of documents classified per second by N concurrent
+coroutines, and the lag percentiles of a ticker that sleeps for 1 ms in a
+loop on the same event loop: the time by which each of its wake-ups is late.
+
+    python benchmark/event_loop.py [--seconds 2] [--concurrency 8] [--doc-kb 64]
+"""
+import argparse
+import asyncio
+import json
+import os
+import time
+from pathlib import Path
+
+from langid_pyc import LanguageIdentifier
+from langid_pyc.default import DEFAULT_MODEL_PATH
+
+
+CORPUS_PATH = Path(__file__).parent.parent / "test" / "data" / "corpus.txt"
+TICK_S = 0.001
+
+
+async def ticker(lags, stop):
+    while not stop.is_set():
+        t0 = time.perf_counter_ns()
+        await asyncio.sleep(TICK_S)
+        lags.append(time.perf_counter_ns() - t0 - int(TICK_S * 1e9))
+
+
+async def load(call, docs, concurrency, seconds):
+    lags = []
+    stop = asyncio.Event()
+    classified = 0
+
+    async def worker(i):
+        nonlocal classified
+        end = time.perf_counter() + seconds
+        while time.perf_counter() < end:
+            await call(docs[i % len(docs)])
+            classified += 1
+            i += concurrency
+
+    tick = asyncio.ensure_future(ticker(lags, stop))
+    # the ticker gets to sleep once before the load starts
+    await asyncio.sleep(0)
+    await asyncio.gather(*(worker(i) for i in range(concurrency)))
+    stop.set()
+    await tick
+    return classified, sorted(lags)
+
+
+def percentile(sorted_samples, q):
+    return sorted_samples[min(int(q * len(sorted_samples)), len(sorted_samples) - 1)]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--seconds", type=float, default=2.0)
+    parser.add_argument("--concurrency", type=int, default=os.cpu_count() or 1)
+    parser.add_argument("--doc-kb", type=int, default=64)
+    args = parser.parse_args()
+
+    identifier = LanguageIdentifier.from_modelpath(DEFAULT_MODEL_PATH)
+    lines = CORPUS_PATH.read_text(encoding="utf-8").splitlines()
+    docs = []
+    for first in range(len(lines)):
+        doc = ""
+        i = first
+        while len(doc) < args.doc_kb * 1024:
+            doc += lines[i % len(lines)] + " "
+            i += 1
+        docs.append(doc)
+
+    async def idle(text):
+        # the lag of the ticker alone
+        await asyncio.sleep(TICK_S)
+
+    async def blocking(text):
+        return identifier.classify(text)
+
+    async def to_thread(text):
+        return await asyncio.to_thread(identifier.classify, text)
+
+    for name, call in (
+        ("idle", idle),
+        ("classify", blocking),
+        ("to_thread", to_thread),
+        ("classify_async", identifier.classify_async),
+    ):
+        classified, lags = asyncio.run(load(call, docs, args.concurrency, args.seconds))
+        print(
+            json.dumps(
+                {
+                    "benchmark": name,
+                    "concurrency": args.concurrency,
+                    "doc_kb": args.doc_kb,
+                    "docs_per_s": 0 if name == "idle" else classified / args.seconds,
+                    "ticks": len(lags),
+                    "lag_p50_us": percentile(lags, 0.5) / 1e3,
+                    "lag_p99_us": percentile(lags, 0.99) / 1e3,
+                    "lag_max_us": lags[-1] / 1e3,
+                }
+            )
+        )
+
+
+if __name__ == "__main__":
+    main()
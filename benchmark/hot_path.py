@@ -0,0 +1,96 @@
+"""Allocations and latency of single-text classify and rank calls.
+
+Prints one JSON object per line. For each method, the number of memory
+blocks that each result holds on to (the tuples, floats and strings built
+for it), then the latency percentiles of calls made by 1 to N threads at
+once, each classifying its own short texts in a loop.
+
+    python benchmark/hot_path.py [--seconds 2] [--threads 1 4 8]
+"""
+import argparse
+import json
+import os
+import sys
+import threading
+import time
+from pathlib import Path
+
+from langid_pyc import LanguageIdentifier
+from langid_pyc.default import DEFAULT_MODEL_PATH
+
+
+CORPUS_PATH = Path(__file__).parent.parent / "test" / "data" / "corpus.txt"
+RETAINED_CALLS = 10000
+
+
+def blocks_per_call(call, texts):
+    # results are kept alive, so the blocks they hold are still counted
+    results = []
+    before = sys.getallocatedblocks()
+    for i in range(RETAINED_CALLS):
+        results.append(call(texts[i % len(texts)]))
+    return (sys.getallocatedblocks() - before) / RETAINED_CALLS
+
+
+def latencies(call, texts, num_threads, seconds):
+    samples = [[] for _ in range(num_threads)]
+    start = threading.Barrier(num_threads)
+
+    def worker(thread):
+        out = samples[thread]
+        start.wait()
+        end = time.perf_counter() + seconds
+        i = thread
+        while time.perf_counter() < end:
+            t0 = time.perf_counter_ns()
+            call(texts[i % len(texts)])
+            out.append(time.perf_counter_ns() - t0)
+            i += 1
+
+    threads = [threading.Thread(target=worker, args=(t,)) for t in range(num_threads)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    return sorted(sample for thread_samples in samples for sample in thread_samples)
+
+
+def percentile(sorted_samples, q):
+    return sorted_samples[min(int(q * len(sorted_samples)), len(sorted_samples) - 1)]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--seconds", type=float, default=2.0)
+    parser.add_argument("--threads", type=int, nargs="+", default=[1, 4, os.cpu_count() or 1])
+    args = parser.parse_args()
+
+    identifier = LanguageIdentifier.from_modelpath(DEFAULT_MODEL_PATH)
+    texts = [text[:200] for text in CORPUS_PATH.read_text(encoding="utf-8").splitlines()]
+
+    for name, call in (
+        ("classify", identifier.classify),
+        ("rank", identifier.rank),
+        ("rank_top3", lambda text: identifier.rank(text, 3)),
+    ):
+        print(json.dumps({"benchmark": name, "blocks_per_call": blocks_per_call(call, texts)}))
+        for num_threads in sorted(set(args.threads)):
+            samples = latencies(call, texts, num_threads, args.seconds)
+            print(
+                json.dumps(
+                    {
+                        "benchmark": name,
+                        "threads": num_threads,
+                        "calls": len(samples),
+                        "calls_per_s": len(samples) / args.seconds,
+                        "p50_us": percentile(samples, 0.5) / 1e3,
+                        "p99_us": percentile(samples, 0.99) / 1e3,
+                        "p999_us": percentile(samples, 0.999) / 1e3,
+                        "max_us": samples[-1] / 1e3,
+                    }
+                )
+            )
+
+
+if __name__ == "__main__":
+    main()
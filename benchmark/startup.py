@@ -0,0 +1,72 @@
+"""Cold start of the default identifier.
+
+Prints one JSON object per line. Each scenario runs in fresh interpreters
+and reports the median over the runs of: `import langid_pyc`, the first
+`classify` after importing it, `preload()` on its own, and the first
+`classify` after `preload(background=True)` and some other start-up work
+of the application, simulated by sleeping.
+
+    python benchmark/startup.py [--runs 10] [--work-ms 50]
+"""
+import argparse
+import json
+import statistics
+import subprocess
+import sys
+
+
+SCENARIOS = {
+    "import": (
+        "t0 = time.perf_counter()\n"
+        "import langid_pyc\n"
+        "elapsed = time.perf_counter() - t0\n"
+    ),
+    "first_classify": (
+        "import langid_pyc\n"
+        "t0 = time.perf_counter()\n"
+        "langid_pyc.classify('this is english text')\n"
+        "elapsed = time.perf_counter() - t0\n"
+    ),
+    "preload": (
+        "import langid_pyc\n"
+        "t0 = time.perf_counter()\n"
+        "langid_pyc.preload()\n"
+        "elapsed = time.perf_counter() - t0\n"
+    ),
+    "first_classify_after_background_preload": (
+        "import langid_pyc\n"
+        "langid_pyc.preload(background=True)\n"
+        "time.sleep({work_ms} / 1e3)\n"
+        "t0 = time.perf_counter()\n"
+        "langid_pyc.classify('this is english text')\n"
+        "elapsed = time.perf_counter() - t0\n"
+    ),
+}
+
+
+def run(code, runs):
+    samples = []
+    for _ in range(runs):
+        output = subprocess.run(
+            [sys.executable, "-c", "import time\n" + code + "print(elapsed)"],
+            check=True,
+            capture_output=True,
+            text=True,
+        ).stdout
+        samples.append(float(output))
+    return statistics.median(samples)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--runs", type=int, default=10)
+    parser.add_argument("--work-ms", type=float, default=50.0)
+    args = parser.parse_args()
+
+    for name, code in SCENARIOS.items():
+        elapsed = run(code.format(work_ms=args.work_ms), args.runs)
+        print(json.dumps({"benchmark": name, "runs": args.runs, "median_ms": elapsed * 1e3}))
+
+
+if __name__ == "__main__":
+    main()
@@ -1,15 +1,42 @@
-from langid_pyc.identifier import LanguageIdentifier
+from langid_pyc.identifier import CascadeIdentifier, LanguageIdentifier
 from langid_pyc.default import (
     classify,
+    classify_arrow,
+    classify_async,
+    classify_batch,
+    classify_batch_async,
+    classify_column,
+    model_classes,
     nb_classes,
+    preload,
     rank,
+    rank_async,
+    rank_batch,
+    rank_batch_async,
+    segment,
     set_languages,
+    stream_begin,
+    swap_model,
 )
 
 __all__ = (
+    "CascadeIdentifier",
     "LanguageIdentifier",
     "classify",
+    "classify_arrow",
+    "classify_async",
+    "classify_batch",
+    "classify_batch_async",
+    "classify_column",
+    "model_classes",
     "nb_classes",
+    "preload",
     "rank",
+    "rank_async",
+    "rank_batch",
+    "rank_batch_async",
+    "segment",
     "set_languages",
+    "stream_begin",
+    "swap_model",
 )
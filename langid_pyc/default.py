@@ -1,25 +1,192 @@
-from langid_pyc.identifier import LanguageIdentifier
+import threading
+from langid_pyc.identifier import (
+    HAS_DEFAULT_MODEL,
+    ColumnResult,
+    LanguageIdentifier,
+    Segment,
+    Stream,
+)
 from pathlib import Path
-from typing import List, Optional, Tuple
+from typing import Any, List, Optional, Sequence, Tuple, Union
 
 
-DEFAULT_MODEL_PATH = Path(__file__).parent / "ldpy3.pmodel"
-DEFAULT_IDENTIFIER = LanguageIdentifier.from_modelpath(DEFAULT_MODEL_PATH)
+DEFAULT_MODEL_PATH = Path(__file__).parent / "ldpy3.fmodel"
+
+# built on first use, or ahead of it by `preload`, so that importing the
+# package does not read the model
+_default_identifier: Optional[LanguageIdentifier] = None
+_load_error: Optional[BaseException] = None
+_loader: Optional[threading.Thread] = None
+_loader_lock = threading.Lock()
+
+
+def _load_default_identifier(prefault: bool) -> None:
+    global _default_identifier, _load_error
+    try:
+        # a model linked into the extension is loaded without touching the file system
+        identifier = (
+            LanguageIdentifier.from_default_model()
+            if HAS_DEFAULT_MODEL
+            else LanguageIdentifier.from_modelpath(DEFAULT_MODEL_PATH)
+        )
+        if prefault:
+            identifier.prefault()
+        _default_identifier = identifier
+    except BaseException as error:
+        _load_error = error
+
+
+def _start_loading(prefault: bool) -> threading.Thread:
+    global _load_error, _loader
+    with _loader_lock:
+        # start again after a failed load, share the one in progress otherwise
+        if _default_identifier is None and (_loader is None or not _loader.is_alive()):
+            _load_error = None
+            _loader = threading.Thread(
+                target=_load_default_identifier,
+                args=(prefault,),
+                name="langid_pyc-preload",
+                daemon=True,
+            )
+            _loader.start()
+        return _loader
+
+
+def preload(background: bool = False) -> None:
+    """Load the default model and read it in now instead of on first use.
+    With `background`, return at once and load it on another thread, which
+    runs without the GIL meanwhile; the first call needing the model then
+    waits only for the rest of the load."""
+    loader = _start_loading(prefault=True)
+    if not background:
+        loader.join()
+
+
+def get_default_identifier() -> LanguageIdentifier:
+    identifier = _default_identifier
+    if identifier is None:
+        _start_loading(prefault=False).join()
+        identifier = _default_identifier
+        if identifier is None:
+            raise RuntimeError("Failed to load the default model") from _load_error
+    return identifier
+
+
+def __getattr__(name: str) -> Any:
+    # `DEFAULT_IDENTIFIER` stays importable, loading the model when it is
+    if name == "DEFAULT_IDENTIFIER":
+        return get_default_identifier()
+    raise AttributeError("module {!r} has no attribute {!r}".format(__name__, name))
 
 
 def classify(text: str) -> Tuple[str, float]:
-    return DEFAULT_IDENTIFIER.classify(text)
+    return get_default_identifier().classify(text)
+
+
+def rank(
+    text: str, k: Optional[int] = None, min_confidence: float = 0.0
+) -> List[Tuple[str, float]]:
+    return get_default_identifier().rank(text, k, min_confidence)
+
+
+async def classify_async(text: str) -> Tuple[str, float]:
+    return await get_default_identifier().classify_async(text)
+
+
+async def rank_async(
+    text: str, k: Optional[int] = None, min_confidence: float = 0.0
+) -> List[Tuple[str, float]]:
+    return await get_default_identifier().rank_async(text, k, min_confidence)
+
 
+async def classify_batch_async(
+    texts: Sequence[str], num_threads: int = 0, blocked: bool = False
+) -> List[Tuple[str, float]]:
+    return await get_default_identifier().classify_batch_async(
+        texts, num_threads, blocked
+    )
 
-def rank(text: str) -> List[Tuple[str, float]]:
-    return DEFAULT_IDENTIFIER.rank(text)
+
+async def rank_batch_async(
+    texts: Sequence[str], num_threads: int = 0, blocked: bool = False
+) -> List[List[Tuple[str, float]]]:
+    return await get_default_identifier().rank_batch_async(texts, num_threads, blocked)
+
+
+def segment(
+    text: Union[str, bytes], window: int, stride: int, merge: bool = False
+) -> List[Segment]:
+    return get_default_identifier().segment(text, window, stride, merge)
+
+
+def classify_batch(
+    texts: Sequence[str], num_threads: int = 0, blocked: bool = False
+) -> List[Tuple[str, float]]:
+    return get_default_identifier().classify_batch(texts, num_threads, blocked)
+
+
+def rank_batch(
+    texts: Sequence[str], num_threads: int = 0, blocked: bool = False
+) -> List[List[Tuple[str, float]]]:
+    return get_default_identifier().rank_batch(texts, num_threads, blocked)
+
+
+def classify_column(
+    data: Any,
+    offsets: Any,
+    languages: Optional[Any] = None,
+    confidences: Optional[Any] = None,
+    probabilities: Optional[Any] = None,
+    with_probabilities: bool = False,
+    num_threads: int = 0,
+    blocked: bool = False,
+) -> ColumnResult:
+    return get_default_identifier().classify_column(
+        data,
+        offsets,
+        languages,
+        confidences,
+        probabilities,
+        with_probabilities,
+        num_threads,
+        blocked,
+    )
+
+
+def classify_arrow(
+    array: Any,
+    with_probabilities: bool = False,
+    num_threads: int = 0,
+    blocked: bool = False,
+) -> ColumnResult:
+    return get_default_identifier().classify_arrow(
+        array, with_probabilities, num_threads, blocked
+    )
+
+
+def stream_begin(
+    min_bytes: int = 0,
+    check_interval: int = 0,
+    min_confidence: Optional[float] = None,
+    min_margin: Optional[float] = None,
+) -> Stream:
+    return get_default_identifier().stream_begin(
+        min_bytes, check_interval, min_confidence, min_margin
+    )
 
 
 def set_languages(langs: Optional[List[str]] = None) -> None:
-    global DEFAULT_IDENTIFIER
-    DEFAULT_IDENTIFIER.set_languages(langs)
+    get_default_identifier().set_languages(langs)
     return
 
 
+def swap_model(path: Optional[Path] = None) -> None:
+    get_default_identifier().swap_model(path)
+
+
 def nb_classes() -> List[str]:
-    return DEFAULT_IDENTIFIER.nb_classes
+    return get_default_identifier().nb_classes
+
+
+def model_classes() -> List[str]:
+    return get_default_identifier().model_classes
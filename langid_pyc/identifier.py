@@ -1,6 +1,14 @@
-from _langid import LangId as _LangId
+import asyncio
+from _langid import HAS_DEFAULT_MODEL, Cascade as _Cascade, LangId as _LangId, Stream
 from pathlib import Path
-from typing import List, Optional, Tuple
+from typing import Any, Dict, List, Optional, Sequence, Tuple, Union
+
+
+# int16 language indices, float32 confidences and, optionally, float32 probabilities
+ColumnResult = Tuple[Any, Any, Optional[Any]]
+
+# start, end, language and confidence of a span of a text
+Segment = Tuple[int, int, str, float]
 
 
 class LanguageIdentifier:
@@ -8,18 +16,265 @@ class LanguageIdentifier:
         self._backend = backend
 
     @classmethod
-    def from_modelpath(cls, path: Path) -> "LanguageIdentifier":
-        return cls(backend=_LangId(str(path)))
+    def from_default_model(
+        cls, cache_size: int = 0, state_posteriors: bool = False
+    ) -> "LanguageIdentifier":
+        """Model linked into the extension, see `HAS_DEFAULT_MODEL`"""
+        return cls(
+            backend=_LangId(
+                None, cache_size=cache_size, state_posteriors=state_posteriors
+            )
+        )
+
+    @classmethod
+    def from_modelpath(
+        cls, path: Path, cache_size: int = 0, state_posteriors: bool = False
+    ) -> "LanguageIdentifier":
+        return cls(
+            backend=_LangId(
+                str(path), cache_size=cache_size, state_posteriors=state_posteriors
+            )
+        )
 
     def classify(self, text: str) -> Tuple[str, float]:
         return self._backend.classify(text)
 
-    def rank(self, text: str) -> List[Tuple[str, float]]:
-        return self._backend.rank(text)
+    def rank(
+        self, text: str, k: Optional[int] = None, min_confidence: float = 0.0
+    ) -> List[Tuple[str, float]]:
+        return self._backend.rank(text, k, min_confidence)
+
+    async def classify_async(self, text: str) -> Tuple[str, float]:
+        """`classify` on a worker thread of the extension, leaving the event
+        loop free meanwhile"""
+        future = asyncio.get_running_loop().create_future()
+        self._backend.classify_async(future, text)
+        return await future
+
+    async def rank_async(
+        self, text: str, k: Optional[int] = None, min_confidence: float = 0.0
+    ) -> List[Tuple[str, float]]:
+        """`rank` on a worker thread of the extension, leaving the event loop
+        free meanwhile"""
+        future = asyncio.get_running_loop().create_future()
+        self._backend.rank_async(future, text, k, min_confidence)
+        return await future
+
+    async def classify_batch_async(
+        self, texts: Sequence[str], num_threads: int = 0, blocked: bool = False
+    ) -> List[Tuple[str, float]]:
+        """`classify_batch` started from a worker thread of the extension,
+        leaving the event loop free meanwhile"""
+        future = asyncio.get_running_loop().create_future()
+        self._backend.classify_batch_async(
+            future, texts, num_threads=num_threads, blocked=blocked
+        )
+        return await future
+
+    async def rank_batch_async(
+        self, texts: Sequence[str], num_threads: int = 0, blocked: bool = False
+    ) -> List[List[Tuple[str, float]]]:
+        """`rank_batch` started from a worker thread of the extension,
+        leaving the event loop free meanwhile"""
+        future = asyncio.get_running_loop().create_future()
+        self._backend.rank_batch_async(
+            future, texts, num_threads=num_threads, blocked=blocked
+        )
+        return await future
+
+    def segment(
+        self, text: Union[str, bytes], window: int, stride: int, merge: bool = False
+    ) -> List[Segment]:
+        """Language and confidence of every window `text[start:end]` of
+        `window` characters, bytes for bytes-like texts, one starting every
+        `stride` and one more ending at the end of the text, as `(start, end,
+        language, confidence)`. Same as classifying each window, within
+        rounding, but the text is tokenized once and overlapping windows
+        share the scoring of their overlap. With `merge`, runs of
+        overlapping or adjacent windows of the same language become a single
+        span, with the lowest confidence of its windows."""
+        segments = self._backend.segment(text, window, stride)
+        if not merge:
+            return segments
+
+        spans: List[Segment] = []
+        for start, end, language, confidence in segments:
+            if spans and spans[-1][2] == language and start <= spans[-1][1]:
+                span_start, _, _, span_confidence = spans[-1]
+                spans[-1] = (
+                    span_start,
+                    end,
+                    language,
+                    min(span_confidence, confidence),
+                )
+            else:
+                spans.append((start, end, language, confidence))
+        return spans
+
+    def classify_batch(
+        self, texts: Sequence[str], num_threads: int = 0, blocked: bool = False
+    ) -> List[Tuple[str, float]]:
+        """`classify` of every text on a pool of native threads, in input
+        order. `blocked=True` is experimental and slower so far, see the
+        README"""
+        return self._backend.classify_batch(
+            texts, num_threads=num_threads, blocked=blocked
+        )
+
+    def rank_batch(
+        self, texts: Sequence[str], num_threads: int = 0, blocked: bool = False
+    ) -> List[List[Tuple[str, float]]]:
+        """`rank` of every text on a pool of native threads, in input order.
+        `blocked=True` is experimental and slower so far, see the README"""
+        return self._backend.rank_batch(texts, num_threads=num_threads, blocked=blocked)
+
+    def classify_column(
+        self,
+        data: Any,
+        offsets: Any,
+        languages: Optional[Any] = None,
+        confidences: Optional[Any] = None,
+        probabilities: Optional[Any] = None,
+        with_probabilities: bool = False,
+        num_threads: int = 0,
+        blocked: bool = False,
+    ) -> ColumnResult:
+        """Classify the UTF-8 texts `data[offsets[i]:offsets[i + 1]]` of a
+        buffer without a Python object per text. `offsets` is a buffer of
+        int32 or int64. Results are written to the int16 `languages`, indices
+        into `model_classes`, the float32 `confidences` and, if given or with
+        `with_probabilities`, the float32 `probabilities` of every language
+        of `model_classes` for each text. Arrays not given are allocated with
+        numpy."""
+        with memoryview(offsets) as view:
+            num_texts = max(view.nbytes // view.itemsize - 1, 0)
+        if languages is None or confidences is None or (
+            with_probabilities and probabilities is None
+        ):
+            import numpy as np
+
+            if languages is None:
+                languages = np.empty(num_texts, dtype=np.int16)
+            if confidences is None:
+                confidences = np.empty(num_texts, dtype=np.float32)
+            if with_probabilities and probabilities is None:
+                probabilities = np.empty(
+                    (num_texts, len(self._backend.nb_classes)), dtype=np.float32
+                )
+
+        self._backend.classify_column(
+            data,
+            offsets,
+            languages,
+            confidences,
+            probabilities,
+            num_threads=num_threads,
+            blocked=blocked,
+        )
+        return languages, confidences, probabilities
+
+    def classify_arrow(
+        self,
+        array: Any,
+        with_probabilities: bool = False,
+        num_threads: int = 0,
+        blocked: bool = False,
+    ) -> ColumnResult:
+        """`classify_column` over the buffers of a pyarrow string or
+        large_string Array or ChunkedArray. Null entries get language -1 and
+        confidence 0."""
+        import numpy as np
+        import pyarrow as pa
+
+        num_texts = len(array)
+        languages = np.empty(num_texts, dtype=np.int16)
+        confidences = np.empty(num_texts, dtype=np.float32)
+        probabilities = (
+            np.empty((num_texts, len(self._backend.nb_classes)), dtype=np.float32)
+            if with_probabilities
+            else None
+        )
+
+        start = 0
+        for chunk in getattr(array, "chunks", [array]):
+            if pa.types.is_string(chunk.type):
+                offset_type = np.int32
+            elif pa.types.is_large_string(chunk.type):
+                offset_type = np.int64
+            else:
+                raise TypeError(f"Expected a string array, got {chunk.type}.")
+
+            end = start + len(chunk)
+            if end > start:
+                _, offsets, data = chunk.buffers()
+                rows = slice(start, end)
+                self.classify_column(
+                    data if data is not None else b"",
+                    # offsets of a slice start at its offset in the buffers
+                    np.frombuffer(offsets, dtype=offset_type)[
+                        chunk.offset : chunk.offset + len(chunk) + 1
+                    ],
+                    languages[rows],
+                    confidences[rows],
+                    None if probabilities is None else probabilities[rows],
+                    num_threads=num_threads,
+                    blocked=blocked,
+                )
+                if chunk.null_count > 0:
+                    nulls = chunk.is_null().to_numpy(zero_copy_only=False)
+                    languages[rows][nulls] = -1
+                    confidences[rows][nulls] = 0
+                    if probabilities is not None:
+                        probabilities[rows][nulls] = 0
+            start = end
+
+        return languages, confidences, probabilities
+
+    def stream_begin(
+        self,
+        min_bytes: int = 0,
+        check_interval: int = 0,
+        min_confidence: Optional[float] = None,
+        min_margin: Optional[float] = None,
+    ) -> Stream:
+        return self._backend.stream_begin(
+            min_bytes, check_interval, min_confidence, min_margin
+        )
+
+    def enable_stats(self, enabled: bool = True) -> None:
+        self._backend.set_stats_enabled(enabled)
+
+    def stats(self) -> Dict[str, Any]:
+        return self._backend.stats()
+
+    def reset_stats(self) -> None:
+        self._backend.reset_stats()
+
+    def cache_info(self) -> Dict[str, int]:
+        return self._backend.cache_info()
+
+    def prefault(self) -> None:
+        """Read in the model file now rather than page by page while the
+        first texts are classified"""
+        self._backend.prefault()
+
+    def swap_model(self, path: Optional[Path] = None) -> None:
+        """Classify with the model at `path`, or the one linked into the
+        extension without it, from now on. The model is loaded and set up
+        while other threads keep classifying with the current one, with the
+        same languages and settings, and calls already running finish on the
+        current one, which is freed after them."""
+        self._backend.swap_model(None if path is None else str(path))
 
     def set_languages(self, langs: Optional[List[str]] = None) -> None:
         return self._backend.set_languages(langs)
 
+    @property
+    def model_classes(self) -> List[str]:
+        """Every language of the model, whether set or not, in the order of
+        the language indices and probabilities of `classify_column`"""
+        return list(self._backend.nb_classes)
+
     @property
     def nb_classes(self) -> List[str]:
         return [
@@ -29,3 +284,59 @@ class LanguageIdentifier:
             )
             if mask
         ]
+
+
+class CascadeIdentifier:
+    """Classify with `first`, a cheap identifier, and only with `second`,
+    the accurate one, when `first` is unsure: its top language is below
+    `min_confidence` and leads the next one by less than `min_margin` (None
+    disables either), or is not set on `second`. Languages are always those
+    of `second`, the models may have different ones. `first` must be able to
+    tell when a text is in none of its languages, as a model pruned to fewer
+    features but all of the languages of `second` can, otherwise it is sure
+    of the wrong language."""
+
+    def __init__(
+        self,
+        first: LanguageIdentifier,
+        second: LanguageIdentifier,
+        min_confidence: Optional[float] = 0.99,
+        min_margin: Optional[float] = None,
+    ) -> None:
+        self.first = first
+        self.second = second
+        self._backend = _Cascade(
+            first._backend, second._backend, min_confidence, min_margin
+        )
+
+    def classify(self, text: str) -> Tuple[str, float]:
+        return self._backend.classify(text)
+
+    def set_languages(self, langs: Optional[List[str]] = None) -> None:
+        """Set `langs` on `second`, and on `first` if it has all of them:
+        restricted to only some, it would be sure of them for texts in the
+        others"""
+        self.second.set_languages(langs)
+        first_classes = set(self.first.model_classes)
+        self.first.set_languages(
+            langs if langs is not None and first_classes.issuperset(langs) else None
+        )
+
+    def stats(self) -> Dict[str, Any]:
+        """Calls resolved by each identifier, and the fraction of all calls
+        resolved by `first`"""
+        resolved = self._backend.stats()
+        calls = resolved["first"] + resolved["second"]
+        return {
+            "calls": calls,
+            "first": resolved["first"],
+            "second": resolved["second"],
+            "first_fraction": resolved["first"] / calls if calls else 0.0,
+        }
+
+    def reset_stats(self) -> None:
+        self._backend.reset_stats()
+
+    @property
+    def nb_classes(self) -> List[str]:
+        return self.second.nb_classes
@@ -16,9 +16,38 @@ Glossary:
 
 import argparse
 import langid.langid as langid
+import numpy as np
+import struct
 import sys
 
 
+# flat model layout, see lib/flatmodel.h
+FLAT_MODEL_MAGIC = b"LANGIDFM"
+FLAT_MODEL_VERSION = 1
+FLAT_MODEL_ALIGNMENT = 64
+FLAT_MODEL_HEADER = struct.Struct("<8s8I")
+FLAT_MODEL_SECTION = struct.Struct("<IIQQ")
+
+FLAT_MODEL_TK_NEXTMOVE = 1
+FLAT_MODEL_TK_OUTPUT_C = 2
+FLAT_MODEL_TK_OUTPUT_S = 3
+FLAT_MODEL_TK_OUTPUT = 4
+FLAT_MODEL_NB_PC = 5
+FLAT_MODEL_NB_PTC = 6
+FLAT_MODEL_NB_CLASSES = 7
+FLAT_MODEL_NB_PTC_SCALE = 8
+FLAT_MODEL_TK_BYTE_CLASS = 9
+FLAT_MODEL_TK_TRANSITIONS = 10
+
+# encodings of the nb_ptc section (NbPtcEncoding in lib/liblangid.h): numpy dtype and integer range
+NB_PTC_ENCODINGS = {
+    "f64": (0, "<f8", None),
+    "f32": (1, "<f4", None),
+    "i16": (2, "<i2", 32767),
+    "i8": (3, "<i1", 127),
+}
+
+
 def pack_tk_output(identifier):
     """
     `identifier.tk_output` is a mapping from state to list of feats completed by entering that state
@@ -54,37 +83,117 @@ def pack_tk_output(identifier):
     return tk_output_c, tk_output_s, tk_output
 
 
-if __name__ == "__main__":
-    parser = argparse.ArgumentParser()
-    parser.add_argument(
-        "--output", 
-        "-o", 
-        default=sys.stdout.buffer, 
-        help="write exported model to",
-        type=argparse.FileType('wb'),
-    )
-    parser.add_argument("model", help="read model from")
-    args = parser.parse_args()
+def pack_flat_model(num_feats, num_langs, num_states, sections):
+    """
+    Lay `sections`, a list of (section id, bytes[, encoding]) tuples, out in the flat model format:
+    a header, a table of sections and then the section data, each section starting
+    at a multiple of FLAT_MODEL_ALIGNMENT bytes so that it can be used in place from a mapping.
+    """
+    def align(offset):
+        return (offset + FLAT_MODEL_ALIGNMENT - 1) // FLAT_MODEL_ALIGNMENT * FLAT_MODEL_ALIGNMENT
 
-    identifier = langid.LanguageIdentifier.from_modelpath(args.model)
+    offset = align(FLAT_MODEL_HEADER.size + len(sections) * FLAT_MODEL_SECTION.size)
+    table = []
+    for section_id, data, *encoding in sections:
+        table.append(FLAT_MODEL_SECTION.pack(section_id, encoding[0] if encoding else 0, offset, len(data)))
+        offset = align(offset + len(data))
 
-    print("NB_PTC", type(identifier.nb_ptc), identifier.nb_ptc.shape, identifier.nb_ptc.dtype)
-    print("NB_PC", type(identifier.nb_pc), identifier.nb_pc.shape, identifier.nb_pc.dtype)
-    print("NB_NUMFEATS", type(identifier.nb_numfeats), identifier.nb_numfeats)
-    print("NB_CLASSES", type(identifier.nb_classes), len(identifier.nb_classes))
-    print("TK_NEXTMOVE", type(identifier.tk_nextmove), len(identifier.tk_nextmove), identifier.tk_nextmove.typecode,
-          identifier.tk_nextmove.itemsize)
-    print("TK_OUTPUT", type(identifier.tk_output), len(identifier.tk_output))
+    out = bytearray(FLAT_MODEL_HEADER.pack(
+        FLAT_MODEL_MAGIC, FLAT_MODEL_VERSION, num_feats, num_langs, num_states, len(sections), 0, 0, 0,
+    ))
+    for entry in table:
+        out += entry
+    for _, data, *_ in sections:
+        out += bytes(align(len(out)) - len(out))
+        out += data
+    return bytes(out)
+
+
+def quantize_nb_ptc(nb_ptc, encoding):
+    """
+    Encode `nb_ptc` as one of NB_PTC_ENCODINGS. Integer encodings store `round(nb_ptc / scale)`
+    with one scale per language (== column), chosen so that the largest magnitude of the column
+    maps onto the largest integer of the encoding.
+    Returns the encoded table and the scales (None for floating point encodings).
+    """
+    _, dtype, qmax = NB_PTC_ENCODINGS[encoding]
+    if qmax is None:
+        return nb_ptc.astype(dtype), None
 
+    scale = np.abs(nb_ptc).max(axis=0).astype("<f8") / qmax
+    scale[scale == 0] = 1.0
+    quantized = np.clip(np.rint(nb_ptc / scale), -qmax, qmax).astype(dtype)
+    return quantized, scale
+
+
+def compact_tk_nextmove(tk_nextmove, num_states):
+    """
+    Split the DFA transitions into byte equivalence classes: bytes whose column of
+    transitions is the same for every state share a class.
+    Returns the class of each byte, the [num_states][num_classes] transitions and the size of a state.
+    """
+    nextmove = np.asarray(tk_nextmove, dtype="<u4").reshape(num_states, 256)
+    columns, byte_class = np.unique(nextmove, axis=1, return_inverse=True)
+    state_size = 2 if num_states <= 0x10000 else 4
+    transitions = np.ascontiguousarray(columns, dtype="<u{}".format(state_size))
+    return byte_class.reshape(-1).astype("u1"), transitions, state_size
+
+
+def uint32_array(values):
+    return np.asarray(values, dtype="<u4").tobytes()
+
+
+def flat_model_to_c(flat_model, model_path):
+    """
+    Render a flat model as a C source defining the `default_model` array of lib/defaultmodel.h,
+    aligned like a mapping of the file so that the library can use it in place.
+    The bytes are written as string literals, which compilers parse an order of magnitude
+    faster than as many integer initializers. The array has no room for the terminating NUL.
+    """
+    escapes = [
+        "\\" + chr(b) if chr(b) in '"\\?' else chr(b) if 32 <= b < 127 else "\\{:03o}".format(b)
+        for b in range(256)
+    ]
+    lines = [
+        "/* Generated by ldpy_to_protobuf.py --format c from {}, do not edit */".format(model_path),
+        '#include "defaultmodel.h"',
+        '#include "flatmodel.h"',
+        "",
+        "_Alignas(FLAT_MODEL_ALIGNMENT) const unsigned char default_model[{}] =".format(len(flat_model)),
+    ]
+    for i in range(0, len(flat_model), 64):
+        lines.append('"' + "".join(escapes[b] for b in flat_model[i : i + 64]) + '"')
+    lines[-1] += ";"
+    lines.append("const size_t default_model_len = {};".format(len(flat_model)))
+    return ("\n".join(lines) + "\n").encode()
+
+
+def pack_model(identifier, model_format="protobuf", nb_ptc_encoding="f64"):
+    """
+    Pack a `langid.langid.LanguageIdentifier` as a protobuf (.pmodel) or flat (.fmodel) model.
+    """
     num_feats, num_langs = identifier.nb_ptc.shape
-    # '>> 8' == 'divide by 256', and 256 is the utf-8 alphabet size (number of unique values for 8 bit == 2 ** 8)
     num_states = len(identifier.tk_nextmove) >> 8
-    print("NUM_STATES", num_states)
-
-    nb_ptc_size = num_feats * num_langs
 
     tk_output_c, tk_output_s, tk_output = pack_tk_output(identifier)
 
+    if model_format == "flat":
+        nb_ptc, nb_ptc_scale = quantize_nb_ptc(identifier.nb_ptc, nb_ptc_encoding)
+        byte_class, transitions, state_size = compact_tk_nextmove(identifier.tk_nextmove, num_states)
+        sections = [
+            (FLAT_MODEL_TK_BYTE_CLASS, byte_class.tobytes()),
+            (FLAT_MODEL_TK_TRANSITIONS, transitions.tobytes(), state_size),
+            (FLAT_MODEL_TK_OUTPUT_C, uint32_array(tk_output_c)),
+            (FLAT_MODEL_TK_OUTPUT_S, uint32_array(tk_output_s)),
+            (FLAT_MODEL_TK_OUTPUT, uint32_array(tk_output)),
+            (FLAT_MODEL_NB_PC, identifier.nb_pc.astype("<f8").tobytes()),
+            (FLAT_MODEL_NB_PTC, nb_ptc.tobytes(), NB_PTC_ENCODINGS[nb_ptc_encoding][0]),
+            (FLAT_MODEL_NB_CLASSES, b"".join("{}".format(c).encode() + b"\0" for c in identifier.nb_classes)),
+        ]
+        if nb_ptc_scale is not None:
+            sections.append((FLAT_MODEL_NB_PTC_SCALE, nb_ptc_scale.tobytes()))
+        return pack_flat_model(num_feats, num_langs, num_states, sections)
+
     import langid_pb2
     lid = langid_pb2.LanguageIdentifier()
 
@@ -106,4 +215,48 @@ if __name__ == "__main__":
     # pack the class labels
     lid.nb_classes.extend('{}'.format(c) for c in identifier.nb_classes)
 
-    args.output.write(lid.SerializeToString())
+    return lid.SerializeToString()
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument(
+        "--output", 
+        "-o", 
+        default=sys.stdout.buffer, 
+        help="write exported model to",
+        type=argparse.FileType('wb'),
+    )
+    parser.add_argument(
+        "--format",
+        "-f",
+        default="protobuf",
+        choices=("protobuf", "flat", "c"),
+        help="protobuf (.pmodel), flat, mmap-able (.fmodel) or C source of a flat model (lib/defaultmodel.c) "
+        "output format",
+    )
+    parser.add_argument(
+        "--nb-ptc-encoding",
+        default="f64",
+        choices=tuple(NB_PTC_ENCODINGS),
+        help="precision of the nb_ptc table, reduced precisions are only supported by the flat format",
+    )
+    parser.add_argument("model", help="read model from")
+    args = parser.parse_args()
+    if args.format == "protobuf" and args.nb_ptc_encoding != "f64":
+        parser.error("--nb-ptc-encoding requires --format flat or c")
+
+    identifier = langid.LanguageIdentifier.from_modelpath(args.model)
+
+    print("NB_PTC", type(identifier.nb_ptc), identifier.nb_ptc.shape, identifier.nb_ptc.dtype)
+    print("NB_PC", type(identifier.nb_pc), identifier.nb_pc.shape, identifier.nb_pc.dtype)
+    print("NB_NUMFEATS", type(identifier.nb_numfeats), identifier.nb_numfeats)
+    print("NB_CLASSES", type(identifier.nb_classes), len(identifier.nb_classes))
+    print("TK_NEXTMOVE", type(identifier.tk_nextmove), len(identifier.tk_nextmove), identifier.tk_nextmove.typecode,
+          identifier.tk_nextmove.itemsize)
+    print("TK_OUTPUT", type(identifier.tk_output), len(identifier.tk_output))
+    # '>> 8' == 'divide by 256', and 256 is the utf-8 alphabet size (number of unique values for 8 bit == 2 ** 8)
+    print("NUM_STATES", len(identifier.tk_nextmove) >> 8)
+
+    model = pack_model(identifier, "flat" if args.format == "c" else args.format, args.nb_ptc_encoding)
+    args.output.write(model if args.format != "c" else flat_model_to_c(model, args.model))
@@ -9,35 +9,181 @@
  */
 #define PY_SSIZE_T_CLEAN
 #include "liblangid.h"
+#include "threadpool.h"
 #include <Python.h>
 
+// A loaded model and what the binding builds for it. Every call holds a
+// reference while it classifies with the GIL released, so that swap_model can
+// publish another model meanwhile: the calls started before it finish on the
+// old model, which the last of them destroys. The reference count, like the
+// free list of contexts, is only touched while holding the GIL.
 typedef struct {
-    PyObject_HEAD LanguageIdentifier* identifier;
-    PyObject* nb_classes;      // Python list of strings
+    Py_ssize_t refcount;
+    LanguageIdentifier* identifier;
+    PyObject* nb_classes; // Python list of strings
+    PyObject* languages;  // tuple of the same interned strings, by index in nb_classes, for results
+
+    // Free list of scratch contexts, so that every call can take one and then
+    // classify with the GIL released.
+    LanguageIdentifierContext** contexts;
+    Py_ssize_t num_contexts;
+    Py_ssize_t contexts_capacity;
+} LangIdModel;
+
+typedef struct {
+    PyObject_HEAD LangIdModel* model;
     PyObject* nb_classes_mask; // Python list of booleans
+    unsigned long languages_version; // bumped by set_languages, see swap_model
 } LangIdObject;
 
+// Document being classified chunk by chunk, created by LangId.stream_begin
+typedef struct {
+    PyObject_HEAD LangIdModel* model; // the model the stream started on, kept until it is freed
+    LanguageIdentifierStream* stream;
+    int busy; // set while feeding with the GIL released
+} StreamObject;
+
+// The cascade of the current models of two identifiers, which it keeps alive. Reference counted like them, and
+// replaced by the next call once either identifier swaps its model.
+typedef struct {
+    Py_ssize_t refcount;
+    LanguageIdentifierCascade* cascade;
+    LangIdModel* first;
+    LangIdModel* second;
+} CascadeModels;
+
+// Two identifiers classifying in turn, created by Cascade(first, second, ...)
+typedef struct {
+    PyObject_HEAD LangIdObject* first;
+    LangIdObject* second;
+    double min_confidence;
+    double min_margin;
+    CascadeModels* models;
+    unsigned long long resolved[2]; // calls resolved by each identifier
+} CascadeObject;
+
+typedef enum { ASYNC_CLASSIFY, ASYNC_RANK, ASYNC_CLASSIFY_BATCH, ASYNC_RANK_BATCH } AsyncKind;
+
+// A call run on the worker pool of the library for an asyncio future, created
+// by the *_async methods. The worker classifies without the GIL, then takes it
+// to build the result and hand it to the loop of the future.
+typedef struct {
+    AsyncKind kind;
+    LangIdModel* model;
+    LanguageIdentifierContext* ctx; // classify and rank only
+    PyObject* future;
+    PyObject* call_soon_threadsafe; // of the loop of the future
+    PyObject* texts;                // the text or tuple of texts, alive until the call is done
+
+    const char* text;
+    unsigned int text_len;
+    const char** batch_texts;
+    unsigned int* batch_text_lens;
+    Py_ssize_t num_texts;
+
+    unsigned int k;
+    double min_confidence;
+    unsigned int num_threads;
+    int blocked;
+
+    LanguageConfidence* out; // one per text for batches, and num_langs per text for rank_batch
+    unsigned int num_out;
+    int status;
+} AsyncCall;
+
+#ifdef LANGID_DEFAULT_MODEL
+#define HAS_DEFAULT_MODEL 1
+#else
+#define HAS_DEFAULT_MODEL 0
+#endif
+
 static void LangId_dealloc(LangIdObject* self);
 static PyObject* LangId_new(PyTypeObject* type, PyObject* args, PyObject* kwds);
 static int LangId_init(LangIdObject* self, PyObject* args, PyObject* kwds);
 static PyObject* LangId_get_nb_classes(LangIdObject* self, void* closure);
 static PyObject* LangId_get_nb_classes_mask(LangIdObject* self, void* closure);
+static PyObject* LangId_get_kernels(LangIdObject* self, void* closure);
 static PyObject* LangId_classify(LangIdObject* self, PyObject* args);
-static PyObject* LangId_rank(LangIdObject* self, PyObject* args);
+static PyObject* LangId_rank(LangIdObject* self, PyObject* args, PyObject* kwds);
+static PyObject* LangId_segment(LangIdObject* self, PyObject* args, PyObject* kwds);
 static PyObject* LangId_set_languages(LangIdObject* self, PyObject* args);
+static PyObject* LangId_classify_batch(LangIdObject* self, PyObject* args, PyObject* kwds);
+static PyObject* LangId_rank_batch(LangIdObject* self, PyObject* args, PyObject* kwds);
+static PyObject* LangId_classify_column(LangIdObject* self, PyObject* args, PyObject* kwds);
+static PyObject* LangId_stream_begin(LangIdObject* self, PyObject* args, PyObject* kwds);
+static PyObject* LangId_set_stats_enabled(LangIdObject* self, PyObject* args);
+static PyObject* LangId_stats(LangIdObject* self, PyObject* args);
+static PyObject* LangId_reset_stats(LangIdObject* self, PyObject* args);
+static PyObject* LangId_cache_info(LangIdObject* self, PyObject* args);
+static PyObject* LangId_prefault(LangIdObject* self, PyObject* args);
+static PyObject* LangId_swap_model(LangIdObject* self, PyObject* args, PyObject* kwds);
+static PyObject* LangId_classify_async(LangIdObject* self, PyObject* args);
+static PyObject* LangId_rank_async(LangIdObject* self, PyObject* args, PyObject* kwds);
+static PyObject* LangId_classify_batch_async(LangIdObject* self, PyObject* args, PyObject* kwds);
+static PyObject* LangId_rank_batch_async(LangIdObject* self, PyObject* args, PyObject* kwds);
+static PyObject* resolve_future(PyObject* module, PyObject* args);
+
+static void Stream_dealloc(StreamObject* self);
+static PyObject* Stream_feed(StreamObject* self, PyObject* args);
+static PyObject* Stream_result(StreamObject* self, PyObject* args);
+static PyObject* Stream_get_num_bytes(StreamObject* self, void* closure);
+static PyObject* Stream_get_done(StreamObject* self, void* closure);
+
+static PyObject* Cascade_new(PyTypeObject* type, PyObject* args, PyObject* kwds);
+static void Cascade_dealloc(CascadeObject* self);
+static PyObject* Cascade_classify(CascadeObject* self, PyObject* args);
+static PyObject* Cascade_stats(CascadeObject* self, PyObject* args);
+static PyObject* Cascade_reset_stats(CascadeObject* self, PyObject* args);
 
 // TODO: add module level methods (or maybe in python code and not here?)
 static PyMethodDef LangIdObject_methods[] = {
     {"classify", (PyCFunction)LangId_classify, METH_VARARGS,
      "Identify the language and confidence of a piece of text."},
-    {"rank", (PyCFunction)LangId_rank, METH_VARARGS, "Rank the confidences of the languages for a given text."},
+    {"rank", (PyCFunction)(void (*)(void))LangId_rank, METH_VARARGS | METH_KEYWORDS,
+     "Rank the confidences of the languages for a given text, optionally only the k first ones of at least "
+     "min_confidence."},
+    {"segment", (PyCFunction)(void (*)(void))LangId_segment, METH_VARARGS | METH_KEYWORDS,
+     "Identify the language and confidence of every window of window characters (bytes for bytes-like texts) "
+     "starting each stride characters, as (start, end, language, confidence) tuples."},
     {"set_languages", (PyCFunction)LangId_set_languages, METH_VARARGS, "Set languages to classify from."},
+    {"classify_batch", (PyCFunction)(void (*)(void))LangId_classify_batch, METH_VARARGS | METH_KEYWORDS,
+     "Identify the language and confidence of each text of a sequence using a pool of threads, optionally "
+     "scoring the texts of each thread in blocks."},
+    {"rank_batch", (PyCFunction)(void (*)(void))LangId_rank_batch, METH_VARARGS | METH_KEYWORDS,
+     "Rank the confidences of the languages for each text of a sequence using a pool of threads, optionally "
+     "scoring the texts of each thread in blocks."},
+    {"classify_async", (PyCFunction)LangId_classify_async, METH_VARARGS,
+     "classify on the worker pool of the library, setting the result of an asyncio future through its loop."},
+    {"rank_async", (PyCFunction)(void (*)(void))LangId_rank_async, METH_VARARGS | METH_KEYWORDS,
+     "rank on the worker pool of the library, setting the result of an asyncio future through its loop."},
+    {"classify_batch_async", (PyCFunction)(void (*)(void))LangId_classify_batch_async, METH_VARARGS | METH_KEYWORDS,
+     "classify_batch on the worker pool of the library, setting the result of an asyncio future through its loop."},
+    {"rank_batch_async", (PyCFunction)(void (*)(void))LangId_rank_batch_async, METH_VARARGS | METH_KEYWORDS,
+     "rank_batch on the worker pool of the library, setting the result of an asyncio future through its loop."},
+    {"classify_column", (PyCFunction)(void (*)(void))LangId_classify_column, METH_VARARGS | METH_KEYWORDS,
+     "Identify the language and confidence of each text of a column given as UTF-8 data and offsets buffers, "
+     "writing the index of the language, the confidence and optionally the probabilities of every language "
+     "into int16, float32 and float32 buffers."},
+    {"stream_begin", (PyCFunction)(void (*)(void))LangId_stream_begin, METH_VARARGS | METH_KEYWORDS,
+     "Start classifying a document fed in chunks, optionally stopping once its prefix is conclusive."},
+    {"set_stats_enabled", (PyCFunction)LangId_set_stats_enabled, METH_VARARGS,
+     "Turn the counting of classified documents on or off."},
+    {"stats", (PyCFunction)LangId_stats, METH_NOARGS, "Counters of the documents classified while enabled."},
+    {"reset_stats", (PyCFunction)LangId_reset_stats, METH_NOARGS, "Zero the counters."},
+    {"cache_info", (PyCFunction)LangId_cache_info, METH_NOARGS,
+     "Hits, misses, current and maximum size of the result cache."},
+    {"prefault", (PyCFunction)LangId_prefault, METH_NOARGS,
+     "Read in the pages of the model file instead of on the first classifications."},
+    {"swap_model", (PyCFunction)(void (*)(void))LangId_swap_model, METH_VARARGS | METH_KEYWORDS,
+     "Load another model, or the one linked into the library without a path, and classify with it from then on, "
+     "keeping the languages and settings of the current one. Calls already running finish on the current one."},
     {NULL} // Sentinel
 };
 
 static PyGetSetDef LangId_getseters[] = {
     {"nb_classes", (getter)LangId_get_nb_classes, NULL, "List of nb_classes", NULL},
     {"nb_classes_mask", (getter)LangId_get_nb_classes_mask, NULL, "Mask of supported languages", NULL},
+    {"kernels", (getter)LangId_get_kernels, NULL, "Name of the vector kernels used for this cpu", NULL},
     {NULL} // Sentinel
 };
 
@@ -54,6 +200,54 @@ static PyTypeObject LangIdType = {
     .tp_getset = LangId_getseters,
 };
 
+static PyMethodDef Stream_methods[] = {
+    {"feed", (PyCFunction)Stream_feed, METH_VARARGS,
+     "Feed the next chunk of the document, returns True once the stop policy is met."},
+    {"result", (PyCFunction)Stream_result, METH_NOARGS, "Language and confidence of the document fed so far."},
+    {NULL} // Sentinel
+};
+
+static PyGetSetDef Stream_getseters[] = {
+    {"num_bytes", (getter)Stream_get_num_bytes, NULL, "Number of bytes fed so far", NULL},
+    {"done", (getter)Stream_get_done, NULL, "Whether the stop policy is met", NULL},
+    {NULL} // Sentinel
+};
+
+static PyTypeObject StreamType = {
+    .ob_base = PyVarObject_HEAD_INIT(NULL, 0).tp_name = "_langid.Stream",
+    .tp_doc = PyDoc_STR("Document classified chunk by chunk"),
+    .tp_basicsize = sizeof(StreamObject),
+    .tp_itemsize = 0,
+    .tp_dealloc = (destructor)Stream_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_methods = Stream_methods,
+    .tp_getset = Stream_getseters,
+};
+
+static PyMethodDef Cascade_methods[] = {
+    {"classify", (PyCFunction)Cascade_classify, METH_VARARGS,
+     "Identify the language and confidence of a piece of text with the first identifier, or with the second one "
+     "unless the first is sure enough."},
+    {"stats", (PyCFunction)Cascade_stats, METH_NOARGS, "Number of calls resolved by each identifier."},
+    {"reset_stats", (PyCFunction)Cascade_reset_stats, METH_NOARGS, "Zero the counts."},
+    {NULL} // Sentinel
+};
+
+static PyTypeObject CascadeType = {
+    .ob_base = PyVarObject_HEAD_INIT(NULL, 0).tp_name = "_langid.Cascade",
+    .tp_doc = PyDoc_STR("Cheap language identifier backed by a more accurate one"),
+    .tp_basicsize = sizeof(CascadeObject),
+    .tp_itemsize = 0,
+    .tp_new = Cascade_new,
+    .tp_dealloc = (destructor)Cascade_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_methods = Cascade_methods,
+};
+
+static PyMethodDef resolve_future_def = {"_resolve_future", resolve_future, METH_VARARGS,
+                                         "Set the result or the exception of a future unless it is done."};
+static PyObject* resolve_future_fn;
+
 static struct PyModuleDef langidmodule = {
     .m_base = PyModuleDef_HEAD_INIT,
     .m_name = "_langid",
@@ -63,7 +257,7 @@ static struct PyModuleDef langidmodule = {
 
 PyMODINIT_FUNC PyInit__langid(void) {
     PyObject* m;
-    if (PyType_Ready(&LangIdType) < 0)
+    if (PyType_Ready(&LangIdType) < 0 || PyType_Ready(&StreamType) < 0 || PyType_Ready(&CascadeType) < 0)
         return NULL;
 
     m = PyModule_Create(&langidmodule);
@@ -77,6 +271,32 @@ PyMODINIT_FUNC PyInit__langid(void) {
         return NULL;
     }
 
+    Py_INCREF(&StreamType);
+    if (PyModule_AddObject(m, "Stream", (PyObject*)&StreamType) < 0) {
+        Py_DECREF(&StreamType);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    Py_INCREF(&CascadeType);
+    if (PyModule_AddObject(m, "Cascade", (PyObject*)&CascadeType) < 0) {
+        Py_DECREF(&CascadeType);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    // kept for the workers, which pass it to call_soon_threadsafe
+    if ((resolve_future_fn = PyCFunction_NewEx(&resolve_future_def, NULL, NULL)) == NULL) {
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    // whether LangId() without a model path can use a model linked into the library
+    if (PyModule_AddObject(m, "HAS_DEFAULT_MODEL", PyBool_FromLong(HAS_DEFAULT_MODEL)) < 0) {
+        Py_DECREF(m);
+        return NULL;
+    }
+
     return m;
 }
 
@@ -84,17 +304,11 @@ static PyObject* LangId_new(PyTypeObject* type, PyObject* args, PyObject* kwds)
     LangIdObject* self;
     self = (LangIdObject*)type->tp_alloc(type, 0);
     if (self != NULL) {
-        self->identifier = NULL;
-
-        self->nb_classes = PyList_New(0);
-        if (self->nb_classes == NULL) {
-            Py_DECREF(self);
-            return NULL;
-        }
+        self->model = NULL;
+        self->languages_version = 0;
 
         self->nb_classes_mask = PyList_New(0);
         if (self->nb_classes_mask == NULL) {
-            Py_DECREF(self->nb_classes);
             Py_DECREF(self);
             return NULL;
         }
@@ -102,56 +316,248 @@ static PyObject* LangId_new(PyTypeObject* type, PyObject* args, PyObject* kwds)
     return (PyObject*)self;
 }
 
+// Wrap a loaded identifier, which the model then owns, destroying it on error
+static LangIdModel* LangId_new_model(LanguageIdentifier* identifier) {
+    LangIdModel* model = PyMem_Calloc(1, sizeof(LangIdModel));
+
+    if (model == NULL) {
+        destroy_identifier(identifier);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    model->refcount = 1;
+    model->identifier = identifier;
+
+    // Populate nb_classes, whose strings every result then shares
+    model->nb_classes = PyList_New(identifier->num_langs);
+    model->languages = PyTuple_New(identifier->num_langs);
+    for (size_t i = 0; model->languages != NULL && model->nb_classes != NULL && i < identifier->num_langs; ++i) {
+        PyObject* lang = PyUnicode_InternFromString((*identifier->nb_classes)[i]);
+        if (lang == NULL) {
+            PyErr_SetString(PyExc_RuntimeError, "Failed to create Python string from language code");
+            break;
+        }
+        Py_INCREF(lang);
+        PyList_SET_ITEM(model->nb_classes, i, lang);
+        PyTuple_SET_ITEM(model->languages, i, lang); // The tuple now owns the other reference
+    }
+    if (PyErr_Occurred()) {
+        Py_XDECREF(model->nb_classes);
+        Py_XDECREF(model->languages);
+        destroy_identifier(identifier);
+        PyMem_Free(model);
+        return NULL;
+    }
+    return model;
+}
+
+// Reference to the current model, for a call to use with the GIL released
+static LangIdModel* LangId_acquire_model(LangIdObject* self) {
+    self->model->refcount++;
+    return self->model;
+}
+
+// Drop a reference to a model, destroying it with the last one. Must be called with the GIL held.
+static void LangId_release_model(LangIdModel* model) {
+    if (--model->refcount > 0) {
+        return;
+    }
+    for (Py_ssize_t i = 0; i < model->num_contexts; ++i) {
+        free_context(model->contexts[i]);
+    }
+    PyMem_Free(model->contexts);
+    destroy_identifier(model->identifier);
+    Py_DECREF(model->nb_classes);
+    Py_DECREF(model->languages);
+    PyMem_Free(model);
+}
+
 static void LangId_dealloc(LangIdObject* self) {
-    if (self->identifier != NULL) {
-        destroy_identifier(self->identifier);
+    if (self->model != NULL) {
+        LangId_release_model(self->model);
     }
-    Py_XDECREF(self->nb_classes);
     Py_XDECREF(self->nb_classes_mask);
     Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
-// Initialize the LangIdObject with a LanguageIdentifier instance loaded from the model
+// Load a model from a path, or the model linked into the library without one, raising RuntimeError on failure
+static LanguageIdentifier* LangId_load_identifier(const char* model_path) {
+    LanguageIdentifier* identifier;
+
+    // Reading and unpacking the model does not touch Python objects, so other threads, including one waiting
+    // for a model preloaded in the background, keep running meanwhile
+    Py_BEGIN_ALLOW_THREADS
+    identifier = model_path != NULL ? load_identifier(model_path) : get_default_identifier();
+    Py_END_ALLOW_THREADS
+
+    if (identifier == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, model_path != NULL
+                                                ? "Failed to load LanguageIdentifier from model path"
+                                                : "No default model was linked into the library");
+    }
+    return identifier;
+}
+
+// Initialize the LangIdObject with a LanguageIdentifier instance loaded from the model, or from the model linked
+// into the library without a path
 static int LangId_init(LangIdObject* self, PyObject* args, PyObject* kwds) {
-    const char* model_path;
-    if (!PyArg_ParseTuple(args, "s", &model_path)) {
+    static char* kwlist[] = {"model_path", "cache_size", "state_posteriors", NULL};
+    const char* model_path = NULL;
+    Py_ssize_t cache_size = 0;
+    int state_posteriors = 0;
+    LanguageIdentifier* identifier;
+    LangIdModel* model;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|znp", kwlist, &model_path, &cache_size, &state_posteriors)) {
+        return -1;
+    }
+    if (cache_size < 0) {
+        PyErr_SetString(PyExc_ValueError, "cache_size must not be negative.");
         return -1;
     }
 
-    self->identifier = load_identifier(model_path);
-    if (self->identifier == NULL) {
-        PyErr_SetString(PyExc_RuntimeError, "Failed to load LanguageIdentifier from model path");
+    if ((identifier = LangId_load_identifier(model_path)) == NULL) {
+        return -1;
+    }
+    if (enable_cache(identifier, (size_t)cache_size) != 0 ||
+        (state_posteriors && set_state_posteriors(identifier, true) != 0)) {
+        destroy_identifier(identifier);
+        PyErr_NoMemory();
+        return -1;
+    }
+    if ((model = LangId_new_model(identifier)) == NULL) {
         return -1;
     }
 
-    // Clear existing lists
-    PyList_SetSlice(self->nb_classes, 0, PyList_Size(self->nb_classes), NULL);
-    PyList_SetSlice(self->nb_classes_mask, 0, PyList_Size(self->nb_classes_mask), NULL);
+    if (self->model != NULL) {
+        LangId_release_model(self->model);
+    }
+    self->model = model;
+    self->languages_version++;
+    return 0;
+}
 
-    // Populate nb_classes
-    for (size_t i = 0; i < self->identifier->num_langs; ++i) {
-        PyObject* lang = PyUnicode_FromString((*self->identifier->nb_classes)[i]);
-        if (lang == NULL) {
-            PyErr_SetString(PyExc_RuntimeError, "Failed to create Python string from language code");
-            return -1;
+// Take a scratch context from the free list, allocating a new one if every
+// context is in use by a call running with the GIL released.
+static LanguageIdentifierContext* LangId_acquire_context(LangIdModel* model) {
+    LanguageIdentifierContext* ctx;
+
+    if (model->num_contexts > 0) {
+        return model->contexts[--model->num_contexts];
+    }
+
+    ctx = alloc_context(model->identifier);
+    if (ctx == NULL) {
+        PyErr_NoMemory();
+    }
+    return ctx;
+}
+
+// Return a context to the free list. Must be called with the GIL held.
+static void LangId_release_context(LangIdModel* model, LanguageIdentifierContext* ctx) {
+    if (model->num_contexts == model->contexts_capacity) {
+        Py_ssize_t capacity = model->contexts_capacity ? 2 * model->contexts_capacity : 4;
+        LanguageIdentifierContext** contexts =
+            PyMem_Realloc(model->contexts, capacity * sizeof(LanguageIdentifierContext*));
+        if (contexts == NULL) {
+            free_context(ctx);
+            return;
         }
-        PyList_Append(self->nb_classes, lang);
-        Py_DECREF(lang); // The list now owns the reference
+        model->contexts = contexts;
+        model->contexts_capacity = capacity;
+    }
+    model->contexts[model->num_contexts++] = ctx;
+}
+
+// Make the contexts on the free list drop the languages they last classified
+// with, so that those replaced by set_languages are freed now rather than when
+// each context is next used. Must be called with the GIL held.
+static void LangId_release_idle_subsets(LangIdModel* model) {
+    for (Py_ssize_t i = 0; i < model->num_contexts; ++i) {
+        release_context_subset(model->contexts[i]);
     }
+    release_context_subset(model->identifier->context);
+}
+
+// (language, confidence) tuple of a result, sharing the string of the language
+static PyObject* LangId_result_tuple(LangIdModel* model, const LanguageConfidence* lc) {
+    PyObject *tuple, *confidence;
+
+    if ((confidence = PyFloat_FromDouble(lc->confidence)) == NULL) {
+        return NULL;
+    }
+    if ((tuple = PyTuple_New(2)) == NULL) {
+        Py_DECREF(confidence);
+        return NULL;
+    }
+    PyObject* language = PyTuple_GET_ITEM(model->languages, lc->index);
+    Py_INCREF(language);
+    PyTuple_SET_ITEM(tuple, 0, language);
+    PyTuple_SET_ITEM(tuple, 1, confidence);
+    return tuple;
+}
 
+// List of the result tuples of the n entries of a ranking
+static PyObject* LangId_ranking_list(LangIdModel* model, const LanguageConfidence* ranking, Py_ssize_t n) {
+    PyObject* list = PyList_New(n);
+
+    for (Py_ssize_t i = 0; list != NULL && i < n; ++i) {
+        PyObject* conf_tuple = LangId_result_tuple(model, &ranking[i]);
+        if (conf_tuple == NULL) {
+            Py_CLEAR(list);
+            break;
+        }
+        PyList_SET_ITEM(list, i, conf_tuple);
+    }
+    return list;
+}
+
+// List of the results of num_texts texts: a result tuple per text, or with a
+// ranking of num_ranked entries per text, a list of them
+static PyObject* LangId_batch_list(LangIdModel* model, const LanguageConfidence* confidences, Py_ssize_t num_texts,
+                                   size_t num_ranked) {
+    PyObject* list = PyList_New(num_texts);
+
+    for (Py_ssize_t i = 0; list != NULL && i < num_texts; ++i) {
+        PyObject* item = num_ranked ? LangId_ranking_list(model, &confidences[i * num_ranked], num_ranked)
+                                    : LangId_result_tuple(model, &confidences[i]);
+        if (item == NULL) {
+            Py_CLEAR(list);
+            break;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+    return list;
+}
+
+// Parse the k argument of rank, None for every language, into k
+static int LangId_parse_k(PyObject* k_obj, unsigned int* k) {
+    if (k_obj != Py_None) {
+        long value = PyLong_AsLong(k_obj);
+        if (value == -1 && PyErr_Occurred()) {
+            return -1;
+        }
+        if (value < 0) {
+            PyErr_SetString(PyExc_ValueError, "k must not be negative.");
+            return -1;
+        }
+        if ((unsigned long)value < *k) {
+            *k = value;
+        }
+    }
     return 0;
 }
 
 static PyObject* LangId_get_nb_classes(LangIdObject* self, void* closure) {
-    Py_INCREF(self->nb_classes);
-    return self->nb_classes;
+    Py_INCREF(self->model->nb_classes);
+    return self->model->nb_classes;
 }
 
 static PyObject* LangId_get_nb_classes_mask(LangIdObject* self, void* closure) {
     PyList_SetSlice(self->nb_classes_mask, 0, PyList_Size(self->nb_classes_mask), NULL);
 
-    for (size_t i = 0; i < self->identifier->num_langs; ++i) {
-        PyObject* value = self->identifier->nb_classes_mask[i] ? Py_True : Py_False;
+    for (size_t i = 0; i < self->model->identifier->num_langs; ++i) {
+        PyObject* value = self->model->identifier->nb_classes_mask[i] ? Py_True : Py_False;
         Py_INCREF(value); // Increment ref count as PyList_Append will steal a reference
         PyList_Append(self->nb_classes_mask, value);
         Py_DECREF(value); // Decrement ref count as we own this reference
@@ -161,61 +567,188 @@ static PyObject* LangId_get_nb_classes_mask(LangIdObject* self, void* closure) {
     return self->nb_classes_mask;
 }
 
+static PyObject* LangId_get_kernels(LangIdObject* self, void* closure) {
+    return PyUnicode_FromString(self->model->identifier->kernels->name);
+}
+
 /* langid.classify() Python method */
 static PyObject* LangId_classify(LangIdObject* self, PyObject* args) {
     const char* text;
     Py_ssize_t text_length;
     PyObject* result;
 
+    LangIdModel* model;
+    LanguageIdentifierContext* ctx;
+    LanguageConfidence language_confidence;
+
     if (!PyArg_ParseTuple(args, "s#", &text, &text_length))
         return NULL;
 
-    LanguageConfidence language_confidence = classify(self->identifier, text, text_length);
+    model = LangId_acquire_model(self);
+    if ((ctx = LangId_acquire_context(model)) == NULL) {
+        LangId_release_model(model);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    language_confidence = classify_r(model->identifier, ctx, text, text_length);
+    Py_END_ALLOW_THREADS
 
-    result = Py_BuildValue("(s,d)", language_confidence.language, language_confidence.confidence);
+    LangId_release_context(model, ctx);
+
+    result = LangId_result_tuple(model, &language_confidence);
+    LangId_release_model(model);
 
     return result;
 }
 
 /* langid.rank() Python method */
-static PyObject* LangId_rank(LangIdObject* self, PyObject* args) {
+static PyObject* LangId_rank(LangIdObject* self, PyObject* args, PyObject* kwds) {
+    static char* kwlist[] = {"text", "k", "min_confidence", NULL};
     const char* text;
     Py_ssize_t text_length;
+    PyObject* k_obj = Py_None;
+    double min_confidence = 0;
+    unsigned int k = UINT_MAX, num_confidences;
+    LangIdModel* model;
+    LanguageIdentifierContext* ctx;
 
-    if (!PyArg_ParseTuple(args, "s#", &text, &text_length)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s#|Od", kwlist, &text, &text_length, &k_obj, &min_confidence) ||
+        LangId_parse_k(k_obj, &k) < 0) {
         return NULL;
     }
 
-    LanguageConfidence* confidences =
-        (LanguageConfidence*)malloc(self->identifier->num_langs * sizeof(LanguageConfidence));
-
-    if (confidences == NULL) {
-        PyErr_NoMemory();
+    model = LangId_acquire_model(self);
+    if (k > model->identifier->num_langs) {
+        k = model->identifier->num_langs;
+    }
+    if ((ctx = LangId_acquire_context(model)) == NULL) {
+        LangId_release_model(model);
         return NULL;
     }
 
-    rank(self->identifier, text, text_length, confidences);
+    // the results stay in the context until it goes back to the free list
+    Py_BEGIN_ALLOW_THREADS
+    num_confidences = rank_top_r(model->identifier, ctx, text, text_length, k, min_confidence, ctx->ranking);
+    Py_END_ALLOW_THREADS
+
+    PyObject* lang_conf_list = LangId_ranking_list(model, ctx->ranking, num_confidences);
+
+    LangId_release_context(model, ctx);
+    LangId_release_model(model);
 
-    PyObject* lang_conf_list = PyList_New(self->identifier->num_langs);
+    return lang_conf_list;
+}
+
+/* langid.segment() Python method */
+static PyObject* LangId_segment(LangIdObject* self, PyObject* args, PyObject* kwds) {
+    static char* kwlist[] = {"text", "window", "stride", NULL};
+    PyObject *text_obj, *result = NULL;
+    Py_ssize_t window, stride, text_len, length;
+    Py_buffer view = {0};
+    const char* text;
+    unsigned int *starts = NULL, *ends = NULL, *byte_starts, *byte_ends, *offsets = NULL, num_windows, i;
+    LanguageConfidence* preds = NULL;
+    LangIdModel* model;
+    LanguageIdentifierContext* ctx;
+    int rc;
 
-    if (lang_conf_list == NULL) {
-        free(confidences);
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Onn", kwlist, &text_obj, &window, &stride)) {
+        return NULL;
+    }
+    if (window <= 0 || stride <= 0) {
+        PyErr_SetString(PyExc_ValueError, "window and stride must be positive.");
         return NULL;
     }
 
-    for (Py_ssize_t i = 0; i < self->identifier->num_langs; ++i) {
-        PyObject* conf_tuple = Py_BuildValue("(s,d)", confidences[i].language, confidences[i].confidence);
-        if (conf_tuple == NULL) {
-            Py_DECREF(lang_conf_list);
-            free(confidences);
+    // windows of a str are counted in characters, of the others in bytes
+    if (PyUnicode_Check(text_obj)) {
+        if ((text = PyUnicode_AsUTF8AndSize(text_obj, &text_len)) == NULL) {
+            return NULL;
+        }
+        length = PyUnicode_GET_LENGTH(text_obj);
+    } else {
+        if (PyObject_GetBuffer(text_obj, &view, PyBUF_SIMPLE) < 0) {
             return NULL;
         }
-        PyList_SET_ITEM(lang_conf_list, i, conf_tuple);
+        text = view.buf;
+        length = text_len = view.len;
+    }
+    if ((size_t)text_len >= UINT_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "text is too long.");
+        goto done;
     }
 
-    free(confidences);
+    window = window < UINT_MAX ? window : UINT_MAX;
+    stride = stride < UINT_MAX ? stride : UINT_MAX;
+    num_windows = segment_windows(length, window, stride, NULL, NULL);
+    starts = PyMem_Malloc(sizeof(unsigned int) * (num_windows + 1));
+    ends = PyMem_Malloc(sizeof(unsigned int) * (num_windows + 1));
+    preds = PyMem_Malloc(sizeof(LanguageConfidence) * (num_windows + 1));
+    if (starts == NULL || ends == NULL || preds == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    segment_windows(length, window, stride, starts, ends);
 
-    return lang_conf_list;
+    // byte offset in the UTF-8 text of each character, and of the bounds of each window after them
+    byte_starts = starts;
+    byte_ends = ends;
+    if (length != text_len) {
+        if ((offsets = PyMem_Malloc(sizeof(unsigned int) * (length + 1 + 2 * num_windows))) == NULL) {
+            PyErr_NoMemory();
+            goto done;
+        }
+        for (Py_ssize_t b = 0, c = 0; b < text_len; ++b) {
+            if ((text[b] & 0xC0) != 0x80) {
+                offsets[c++] = b;
+            }
+        }
+        offsets[length] = text_len;
+        byte_starts = offsets + length + 1;
+        byte_ends = byte_starts + num_windows;
+        for (i = 0; i < num_windows; ++i) {
+            byte_starts[i] = offsets[starts[i]];
+            byte_ends[i] = offsets[ends[i]];
+        }
+    }
+
+    model = LangId_acquire_model(self);
+    if ((ctx = LangId_acquire_context(model)) == NULL) {
+        LangId_release_model(model);
+        goto done;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    rc = segment_r(model->identifier, ctx, text, text_len, byte_starts, byte_ends, num_windows, preds);
+    Py_END_ALLOW_THREADS
+
+    LangId_release_context(model, ctx);
+
+    if (rc < 0) {
+        PyErr_NoMemory();
+    } else if ((result = PyList_New(num_windows)) != NULL) {
+        for (i = 0; i < num_windows; ++i) {
+            PyObject* language = PyTuple_GET_ITEM(model->languages, preds[i].index);
+            PyObject* span = Py_BuildValue("(IIOd)", starts[i], ends[i], language, preds[i].confidence);
+            if (span == NULL) {
+                Py_CLEAR(result);
+                break;
+            }
+            PyList_SET_ITEM(result, i, span);
+        }
+    }
+    LangId_release_model(model);
+
+done:
+    PyMem_Free(starts);
+    PyMem_Free(ends);
+    PyMem_Free(offsets);
+    PyMem_Free(preds);
+    if (view.obj != NULL) {
+        PyBuffer_Release(&view);
+    }
+    return result;
 }
 
 /* langid.set_languages() Python method */
@@ -226,7 +759,9 @@ static PyObject* LangId_set_languages(LangIdObject* self, PyObject* args) {
     }
     
     if (lang_list == Py_None) {
-        set_languages(self->identifier, NULL, 0);
+        set_languages(self->model->identifier, NULL, 0);
+        self->languages_version++;
+        LangId_release_idle_subsets(self->model);
         Py_RETURN_NONE;
     }
 
@@ -247,11 +782,958 @@ static PyObject* LangId_set_languages(LangIdObject* self, PyObject* args) {
         langs[i] = PyUnicode_AsUTF8(lang_item);
     }
 
-    int result = set_languages(self->identifier, langs, num_langs);
+    int result = set_languages(self->model->identifier, langs, num_langs);
+    self->languages_version++;
+    LangId_release_idle_subsets(self->model);
     if (result != 0) {
         PyErr_SetString(PyExc_RuntimeError, "Failed to set languages in LanguageIdentifier.");
         return NULL;
     }
 
     Py_RETURN_NONE;
-}
\ No newline at end of file
+}
+
+// Parse the arguments of the batch methods and collect the UTF-8 buffers of
+// the texts. Returns the sequence keeping the buffers alive, or NULL on error.
+static PyObject* LangId_parse_batch(PyObject* args, PyObject* kwds, const char*** texts, unsigned int** text_lens,
+                                    unsigned int* num_threads, int* blocked) {
+    static char* kwlist[] = {"texts", "num_threads", "blocked", NULL};
+    PyObject *texts_arg, *seq;
+    int threads = 0;
+
+    *blocked = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|ip", kwlist, &texts_arg, &threads, blocked)) {
+        return NULL;
+    }
+    if (threads < 0) {
+        PyErr_SetString(PyExc_ValueError, "num_threads must be non-negative.");
+        return NULL;
+    }
+    *num_threads = threads;
+
+    if ((seq = PySequence_Fast(texts_arg, "Argument must be a sequence of strings.")) == NULL) {
+        return NULL;
+    }
+
+    Py_ssize_t num_texts = PySequence_Fast_GET_SIZE(seq);
+    *texts = PyMem_Malloc((num_texts ? num_texts : 1) * sizeof(const char*));
+    *text_lens = PyMem_Malloc((num_texts ? num_texts : 1) * sizeof(unsigned int));
+    if (*texts == NULL || *text_lens == NULL) {
+        PyMem_Free(*texts);
+        PyMem_Free(*text_lens);
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    for (Py_ssize_t i = 0; i < num_texts; ++i) {
+        PyObject* item = PySequence_Fast_GET_ITEM(seq, i);
+        Py_ssize_t text_length;
+
+        if (!PyUnicode_Check(item)) {
+            PyErr_SetString(PyExc_TypeError, "All items in the text sequence must be strings.");
+            break;
+        }
+        // the UTF-8 buffer is cached in the str object, which seq keeps alive
+        if (((*texts)[i] = PyUnicode_AsUTF8AndSize(item, &text_length)) == NULL) {
+            break;
+        }
+        (*text_lens)[i] = text_length;
+    }
+
+    if (PyErr_Occurred()) {
+        PyMem_Free(*texts);
+        PyMem_Free(*text_lens);
+        Py_DECREF(seq);
+        return NULL;
+    }
+    return seq;
+}
+
+/* langid.classify_batch() Python method */
+static PyObject* LangId_classify_batch(LangIdObject* self, PyObject* args, PyObject* kwds) {
+    const char** texts;
+    unsigned int *text_lens, num_threads;
+    PyObject *seq, *result = NULL;
+    int status, blocked;
+    LangIdModel* model;
+
+    if ((seq = LangId_parse_batch(args, kwds, &texts, &text_lens, &num_threads, &blocked)) == NULL) {
+        return NULL;
+    }
+
+    model = LangId_acquire_model(self);
+    Py_ssize_t num_texts = PySequence_Fast_GET_SIZE(seq);
+    LanguageConfidence* confidences = PyMem_Malloc((num_texts ? num_texts : 1) * sizeof(LanguageConfidence));
+
+    if (confidences == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    status = (blocked ? classify_batch_blocked : classify_batch)(model->identifier, texts, text_lens, num_texts,
+                                                                 confidences, num_threads);
+    Py_END_ALLOW_THREADS
+
+    if (status != 0) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    result = LangId_batch_list(model, confidences, num_texts, 0);
+
+done:
+    LangId_release_model(model);
+    PyMem_Free(confidences);
+    PyMem_Free(texts);
+    PyMem_Free(text_lens);
+    Py_DECREF(seq);
+    return result;
+}
+
+/* langid.rank_batch() Python method */
+static PyObject* LangId_rank_batch(LangIdObject* self, PyObject* args, PyObject* kwds) {
+    const char** texts;
+    unsigned int *text_lens, num_threads;
+    PyObject *seq, *result = NULL;
+    int status, blocked;
+    LangIdModel* model;
+
+    if ((seq = LangId_parse_batch(args, kwds, &texts, &text_lens, &num_threads, &blocked)) == NULL) {
+        return NULL;
+    }
+
+    model = LangId_acquire_model(self);
+    size_t num_langs = model->identifier->num_langs;
+
+    Py_ssize_t num_texts = PySequence_Fast_GET_SIZE(seq);
+    LanguageConfidence* confidences =
+        PyMem_Malloc((num_texts ? num_texts : 1) * num_langs * sizeof(LanguageConfidence));
+
+    if (confidences == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    status = (blocked ? rank_batch_blocked : rank_batch)(model->identifier, texts, text_lens, num_texts, confidences,
+                                                         num_threads);
+    Py_END_ALLOW_THREADS
+
+    if (status != 0) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    result = LangId_batch_list(model, confidences, num_texts, num_langs);
+
+done:
+    LangId_release_model(model);
+    PyMem_Free(confidences);
+    PyMem_Free(texts);
+    PyMem_Free(text_lens);
+    Py_DECREF(seq);
+    return result;
+}
+
+// _langid._resolve_future, which the loop of a future calls with the result or
+// the exception of its AsyncCall. A future cancelled meanwhile stays so.
+static PyObject* resolve_future(PyObject* module, PyObject* args) {
+    PyObject *future, *result, *error, *done;
+
+    if (!PyArg_ParseTuple(args, "OOO", &future, &result, &error)) {
+        return NULL;
+    }
+    if ((done = PyObject_CallMethod(future, "done", NULL)) == NULL) {
+        return NULL;
+    }
+    int is_done = PyObject_IsTrue(done);
+    Py_DECREF(done);
+    if (is_done != 0) {
+        if (is_done < 0) {
+            return NULL;
+        }
+        Py_RETURN_NONE;
+    }
+    if (error != Py_None) {
+        return PyObject_CallMethod(future, "set_exception", "(O)", error);
+    }
+    return PyObject_CallMethod(future, "set_result", "(O)", result);
+}
+
+// Free a call, with the GIL held
+static void LangId_free_async(AsyncCall* call) {
+    if (call->ctx != NULL) {
+        LangId_release_context(call->model, call->ctx);
+    }
+    LangId_release_model(call->model);
+    Py_XDECREF(call->future);
+    Py_XDECREF(call->call_soon_threadsafe);
+    Py_XDECREF(call->texts);
+    PyMem_RawFree(call->batch_texts);
+    PyMem_RawFree(call->batch_text_lens);
+    PyMem_RawFree(call->out);
+    PyMem_RawFree(call);
+}
+
+// Build the result of a call and schedule resolve_future on the loop of its
+// future, with the GIL held
+static void LangId_finish_async(AsyncCall* call) {
+    PyObject *result = NULL, *error = NULL, *scheduled;
+
+    if (call->status != 0) {
+        PyErr_NoMemory();
+    } else {
+        switch (call->kind) {
+        case ASYNC_CLASSIFY:
+            result = LangId_result_tuple(call->model, call->out);
+            break;
+        case ASYNC_RANK:
+            result = LangId_ranking_list(call->model, call->ctx->ranking, call->num_out);
+            break;
+        case ASYNC_CLASSIFY_BATCH:
+            result = LangId_batch_list(call->model, call->out, call->num_texts, 0);
+            break;
+        case ASYNC_RANK_BATCH:
+            result = LangId_batch_list(call->model, call->out, call->num_texts, call->model->identifier->num_langs);
+            break;
+        }
+    }
+    if (result == NULL) {
+        PyObject *type, *traceback;
+        PyErr_Fetch(&type, &error, &traceback);
+        PyErr_NormalizeException(&type, &error, &traceback);
+        Py_XDECREF(type);
+        Py_XDECREF(traceback);
+    }
+
+    // fails once the loop is closed, with nobody left to wait for the future
+    scheduled = PyObject_CallFunctionObjArgs(call->call_soon_threadsafe, resolve_future_fn, call->future,
+                                             result ? result : Py_None, error ? error : Py_None, NULL);
+    if (scheduled == NULL) {
+        PyErr_Clear();
+    }
+    Py_XDECREF(scheduled);
+    Py_XDECREF(result);
+    Py_XDECREF(error);
+    LangId_free_async(call);
+}
+
+// The task of the worker pool
+static void LangId_run_async(void* arg) {
+    AsyncCall* call = (AsyncCall*)arg;
+    const LanguageIdentifier* lid = call->model->identifier;
+    PyGILState_STATE gil;
+
+    switch (call->kind) {
+    case ASYNC_CLASSIFY:
+        call->out[0] = classify_r(lid, call->ctx, call->text, call->text_len);
+        break;
+    case ASYNC_RANK:
+        call->num_out =
+            rank_top_r(lid, call->ctx, call->text, call->text_len, call->k, call->min_confidence, call->ctx->ranking);
+        break;
+    case ASYNC_CLASSIFY_BATCH:
+        call->status = (call->blocked ? classify_batch_blocked : classify_batch)(
+            lid, call->batch_texts, call->batch_text_lens, call->num_texts, call->out, call->num_threads);
+        break;
+    case ASYNC_RANK_BATCH:
+        call->status = (call->blocked ? rank_batch_blocked : rank_batch)(
+            lid, call->batch_texts, call->batch_text_lens, call->num_texts, call->out, call->num_threads);
+        break;
+    }
+
+    gil = PyGILState_Ensure();
+    LangId_finish_async(call);
+    PyGILState_Release(gil);
+}
+
+// A call of the given kind on the current model of self for future
+static AsyncCall* LangId_new_async(LangIdObject* self, AsyncKind kind, PyObject* future) {
+    AsyncCall* call;
+    PyObject* loop;
+
+    if ((call = PyMem_RawCalloc(1, sizeof(AsyncCall))) == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    call->kind = kind;
+    call->model = LangId_acquire_model(self);
+    Py_INCREF(future);
+    call->future = future;
+
+    if ((loop = PyObject_CallMethod(future, "get_loop", NULL)) == NULL) {
+        LangId_free_async(call);
+        return NULL;
+    }
+    call->call_soon_threadsafe = PyObject_GetAttrString(loop, "call_soon_threadsafe");
+    Py_DECREF(loop);
+    if (call->call_soon_threadsafe == NULL) {
+        LangId_free_async(call);
+        return NULL;
+    }
+    return call;
+}
+
+// Queue a call on the worker pool, or free it on error
+static PyObject* LangId_submit_async(AsyncCall* call) {
+    ThreadPool* pool = get_default_threadpool();
+
+    if (pool == NULL || threadpool_submit(pool, LangId_run_async, call) != 0) {
+        LangId_free_async(call);
+        return PyErr_NoMemory();
+    }
+    Py_RETURN_NONE;
+}
+
+// Set up a classify or rank call of a single text
+static int LangId_async_text(AsyncCall* call, PyObject* text_obj) {
+    Py_ssize_t text_length;
+
+    if (PyUnicode_Check(text_obj)) {
+        call->text = PyUnicode_AsUTF8AndSize(text_obj, &text_length);
+    } else if (PyBytes_Check(text_obj)) {
+        call->text = PyBytes_AS_STRING(text_obj);
+        text_length = PyBytes_GET_SIZE(text_obj);
+    } else {
+        PyErr_SetString(PyExc_TypeError, "text must be a string or bytes.");
+        return -1;
+    }
+    if (call->text == NULL) {
+        return -1;
+    }
+    call->text_len = text_length;
+    Py_INCREF(text_obj);
+    call->texts = text_obj;
+
+    if ((call->ctx = LangId_acquire_context(call->model)) == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+/* langid.classify_async() Python method */
+static PyObject* LangId_classify_async(LangIdObject* self, PyObject* args) {
+    PyObject *future, *text_obj;
+    AsyncCall* call;
+
+    if (!PyArg_ParseTuple(args, "OO", &future, &text_obj)) {
+        return NULL;
+    }
+    if ((call = LangId_new_async(self, ASYNC_CLASSIFY, future)) == NULL) {
+        return NULL;
+    }
+    if (LangId_async_text(call, text_obj) < 0 || (call->out = PyMem_RawMalloc(sizeof(LanguageConfidence))) == NULL) {
+        if (!PyErr_Occurred()) {
+            PyErr_NoMemory();
+        }
+        LangId_free_async(call);
+        return NULL;
+    }
+    return LangId_submit_async(call);
+}
+
+/* langid.rank_async() Python method */
+static PyObject* LangId_rank_async(LangIdObject* self, PyObject* args, PyObject* kwds) {
+    static char* kwlist[] = {"future", "text", "k", "min_confidence", NULL};
+    PyObject *future, *text_obj, *k_obj = Py_None;
+    double min_confidence = 0;
+    unsigned int k = UINT_MAX;
+    AsyncCall* call;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|Od", kwlist, &future, &text_obj, &k_obj, &min_confidence) ||
+        LangId_parse_k(k_obj, &k) < 0) {
+        return NULL;
+    }
+    if ((call = LangId_new_async(self, ASYNC_RANK, future)) == NULL) {
+        return NULL;
+    }
+    call->k = k < call->model->identifier->num_langs ? k : call->model->identifier->num_langs;
+    call->min_confidence = min_confidence;
+    if (LangId_async_text(call, text_obj) < 0) {
+        LangId_free_async(call);
+        return NULL;
+    }
+    return LangId_submit_async(call);
+}
+
+// Set up a classify_batch or rank_batch call from the arguments after the future
+static PyObject* LangId_batch_async(LangIdObject* self, AsyncKind kind, PyObject* args, PyObject* kwds) {
+    const char** texts;
+    unsigned int *text_lens, num_threads;
+    PyObject *future, *batch_args, *seq;
+    int blocked;
+    AsyncCall* call;
+
+    if (PyTuple_GET_SIZE(args) < 1) {
+        PyErr_SetString(PyExc_TypeError, "a future is required.");
+        return NULL;
+    }
+    future = PyTuple_GET_ITEM(args, 0);
+    if ((batch_args = PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args))) == NULL) {
+        return NULL;
+    }
+    seq = LangId_parse_batch(batch_args, kwds, &texts, &text_lens, &num_threads, &blocked);
+    Py_DECREF(batch_args);
+    if (seq == NULL) {
+        return NULL;
+    }
+
+    if ((call = LangId_new_async(self, kind, future)) == NULL) {
+        PyMem_Free(texts);
+        PyMem_Free(text_lens);
+        Py_DECREF(seq);
+        return NULL;
+    }
+    // a tuple of the texts, which the caller cannot change while they are classified
+    call->texts = PySequence_Tuple(seq);
+    Py_DECREF(seq);
+    if (call->texts == NULL) {
+        PyMem_Free(texts);
+        PyMem_Free(text_lens);
+        LangId_free_async(call);
+        return NULL;
+    }
+    call->num_texts = PyTuple_GET_SIZE(call->texts);
+    call->num_threads = num_threads;
+    call->blocked = blocked;
+
+    size_t num_out = (call->num_texts ? call->num_texts : 1) *
+                     (kind == ASYNC_RANK_BATCH ? (size_t)call->model->identifier->num_langs : 1);
+    call->batch_texts = PyMem_RawMalloc((call->num_texts ? call->num_texts : 1) * sizeof(const char*));
+    call->batch_text_lens = PyMem_RawMalloc((call->num_texts ? call->num_texts : 1) * sizeof(unsigned int));
+    call->out = PyMem_RawMalloc(num_out * sizeof(LanguageConfidence));
+    if (call->batch_texts != NULL && call->batch_text_lens != NULL) {
+        memcpy(call->batch_texts, texts, call->num_texts * sizeof(const char*));
+        memcpy(call->batch_text_lens, text_lens, call->num_texts * sizeof(unsigned int));
+    }
+    PyMem_Free(texts);
+    PyMem_Free(text_lens);
+    if (call->batch_texts == NULL || call->batch_text_lens == NULL || call->out == NULL) {
+        LangId_free_async(call);
+        return PyErr_NoMemory();
+    }
+    return LangId_submit_async(call);
+}
+
+/* langid.classify_batch_async() Python method */
+static PyObject* LangId_classify_batch_async(LangIdObject* self, PyObject* args, PyObject* kwds) {
+    return LangId_batch_async(self, ASYNC_CLASSIFY_BATCH, args, kwds);
+}
+
+/* langid.rank_batch_async() Python method */
+static PyObject* LangId_rank_batch_async(LangIdObject* self, PyObject* args, PyObject* kwds) {
+    return LangId_batch_async(self, ASYNC_RANK_BATCH, args, kwds);
+}
+
+// Get a C-contiguous, optionally writable, buffer of obj whose items are of
+// one of the struct kinds, any if kinds is NULL, and of itemsize bytes unless
+// itemsize is 0.
+static int LangId_get_column_buffer(PyObject* obj, Py_buffer* view, const char* name, const char* kinds,
+                                    Py_ssize_t itemsize, int writable) {
+    if (PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT | (writable ? PyBUF_WRITABLE : 0)) != 0) {
+        return -1;
+    }
+    // the kind comes after the byte order, if any
+    const char* format = view->format != NULL && view->format[0] != '\0' ? view->format : "B";
+    char kind = format[strlen(format) - 1];
+
+    if ((kinds != NULL && strchr(kinds, kind) == NULL) || (itemsize != 0 && view->itemsize != itemsize)) {
+        PyErr_Format(PyExc_TypeError, "%s has items of format '%s', which is not supported.", name, format);
+        PyBuffer_Release(view);
+        return -1;
+    }
+    return 0;
+}
+
+static int64_t LangId_column_offset(const Py_buffer* offsets, Py_ssize_t i) {
+    return offsets->itemsize == sizeof(int32_t) ? ((const int32_t*)offsets->buf)[i] : ((const int64_t*)offsets->buf)[i];
+}
+
+/* langid.classify_column() Python method */
+static PyObject* LangId_classify_column(LangIdObject* self, PyObject* args, PyObject* kwds) {
+    static char* kwlist[] = {"data", "offsets", "languages", "confidences", "probabilities", "num_threads", "blocked",
+                             NULL};
+    PyObject *data_arg, *offsets_arg, *languages_arg, *confidences_arg, *probs_arg = Py_None;
+    Py_buffer data = {0}, offsets = {0}, languages = {0}, confidences = {0}, probs = {0};
+    Py_ssize_t num_langs, num_texts;
+    int threads = 0, blocked = 0, status;
+    PyObject* result = NULL;
+    LangIdModel* model;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OOOO|Oip", kwlist, &data_arg, &offsets_arg, &languages_arg,
+                                     &confidences_arg, &probs_arg, &threads, &blocked)) {
+        return NULL;
+    }
+    if (threads < 0) {
+        PyErr_SetString(PyExc_ValueError, "num_threads must be non-negative.");
+        return NULL;
+    }
+
+    model = LangId_acquire_model(self);
+    num_langs = model->identifier->num_langs;
+    if (LangId_get_column_buffer(data_arg, &data, "data", NULL, 1, 0) != 0 ||
+        LangId_get_column_buffer(offsets_arg, &offsets, "offsets", "ilq", 0, 0) != 0 ||
+        LangId_get_column_buffer(languages_arg, &languages, "languages", "h", sizeof(int16_t), 1) != 0 ||
+        LangId_get_column_buffer(confidences_arg, &confidences, "confidences", "f", sizeof(float), 1) != 0 ||
+        (probs_arg != Py_None &&
+         LangId_get_column_buffer(probs_arg, &probs, "probabilities", "f", sizeof(float), 1) != 0)) {
+        goto done;
+    }
+
+    // 32 or 64 bit, as in Arrow string and large_string columns
+    if (offsets.itemsize != sizeof(int32_t) && offsets.itemsize != sizeof(int64_t)) {
+        PyErr_SetString(PyExc_TypeError, "offsets must be 32 or 64 bit integers.");
+        goto done;
+    }
+    num_texts = offsets.len / offsets.itemsize - 1;
+    if (num_texts < 0 || num_texts > UINT_MAX) {
+        PyErr_SetString(PyExc_ValueError, "offsets must hold between 1 and 2**32 offsets.");
+        goto done;
+    }
+    if (languages.len != num_texts * (Py_ssize_t)sizeof(int16_t) ||
+        confidences.len != num_texts * (Py_ssize_t)sizeof(float)) {
+        PyErr_SetString(PyExc_ValueError, "languages and confidences must have one item per text.");
+        goto done;
+    }
+    if (probs.obj != NULL && probs.len != num_texts * num_langs * (Py_ssize_t)sizeof(float)) {
+        PyErr_SetString(PyExc_ValueError, "probabilities must have a row of one item per language for each text.");
+        goto done;
+    }
+    // liblangid reads the texts the offsets point to as they are
+    for (Py_ssize_t i = 0; i < num_texts; ++i) {
+        int64_t start = LangId_column_offset(&offsets, i), end = LangId_column_offset(&offsets, i + 1);
+        if (start < 0 || end < start || end > data.len || end - start > UINT_MAX) {
+            PyErr_Format(PyExc_ValueError, "offsets %zd and %zd do not delimit a text of data.", i, i + 1);
+            goto done;
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    status = classify_column(model->identifier, data.buf, offsets.buf, offsets.itemsize, num_texts, languages.buf,
+                             confidences.buf, probs.buf, threads, blocked);
+    Py_END_ALLOW_THREADS
+
+    if (status != 0) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    Py_INCREF(Py_None);
+    result = Py_None;
+
+done:
+    LangId_release_model(model);
+    PyBuffer_Release(&data);
+    PyBuffer_Release(&offsets);
+    PyBuffer_Release(&languages);
+    PyBuffer_Release(&confidences);
+    PyBuffer_Release(&probs);
+    return result;
+}
+
+/* langid.stream_begin() Python method */
+static PyObject* LangId_stream_begin(LangIdObject* self, PyObject* args, PyObject* kwds) {
+    static char* kwlist[] = {"min_bytes", "check_interval", "min_confidence", "min_margin", NULL};
+    Py_ssize_t min_bytes = 0, check_interval = 0;
+    PyObject *min_confidence = Py_None, *min_margin = Py_None;
+    StreamStopPolicy policy;
+    StreamObject* stream;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|nnOO", kwlist, &min_bytes, &check_interval, &min_confidence,
+                                     &min_margin)) {
+        return NULL;
+    }
+    if (min_bytes < 0 || check_interval < 0) {
+        PyErr_SetString(PyExc_ValueError, "min_bytes and check_interval must not be negative.");
+        return NULL;
+    }
+
+    // a threshold above 1 is never met
+    policy.min_bytes = min_bytes;
+    policy.check_interval = check_interval;
+    policy.min_confidence = min_confidence == Py_None ? 2.0 : PyFloat_AsDouble(min_confidence);
+    policy.min_margin = min_margin == Py_None ? 2.0 : PyFloat_AsDouble(min_margin);
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+
+    if ((stream = PyObject_New(StreamObject, &StreamType)) == NULL) {
+        return NULL;
+    }
+    stream->busy = 0;
+    stream->model = LangId_acquire_model(self);
+
+    if ((stream->stream = alloc_stream(stream->model->identifier)) == NULL) {
+        Py_DECREF(stream);
+        return PyErr_NoMemory();
+    }
+    if (min_confidence != Py_None || min_margin != Py_None) {
+        stream_begin(stream->stream, &policy);
+    }
+
+    return (PyObject*)stream;
+}
+
+static void Stream_dealloc(StreamObject* self) {
+    free_stream(self->stream);
+    LangId_release_model(self->model);
+    PyObject_Del(self);
+}
+
+/* Stream.feed() Python method */
+static PyObject* Stream_feed(StreamObject* self, PyObject* args) {
+    Py_buffer chunk;
+    bool done;
+
+    // str chunks are fed as UTF-8, bytes-like ones as they are
+    if (!PyArg_ParseTuple(args, "s*", &chunk)) {
+        return NULL;
+    }
+    if (self->busy) {
+        PyBuffer_Release(&chunk);
+        PyErr_SetString(PyExc_RuntimeError, "Stream is being fed by another thread.");
+        return NULL;
+    }
+
+    self->busy = 1;
+    Py_BEGIN_ALLOW_THREADS
+    done = stream_feed(self->stream, chunk.buf, chunk.len);
+    Py_END_ALLOW_THREADS
+    self->busy = 0;
+
+    PyBuffer_Release(&chunk);
+    return PyBool_FromLong(done);
+}
+
+/* Stream.result() Python method */
+static PyObject* Stream_result(StreamObject* self, PyObject* args) {
+    LanguageConfidence language_confidence;
+
+    if (self->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "Stream is being fed by another thread.");
+        return NULL;
+    }
+
+    language_confidence = stream_result(self->stream);
+    return LangId_result_tuple(self->model, &language_confidence);
+}
+
+static PyObject* Stream_get_num_bytes(StreamObject* self, void* closure) {
+    return PyLong_FromSize_t(self->stream->num_bytes);
+}
+
+static PyObject* Stream_get_done(StreamObject* self, void* closure) {
+    return PyBool_FromLong(self->stream->done);
+}
+
+/* langid.set_stats_enabled() Python method */
+static PyObject* LangId_set_stats_enabled(LangIdObject* self, PyObject* args) {
+    int enabled;
+
+    if (!PyArg_ParseTuple(args, "p", &enabled)) {
+        return NULL;
+    }
+    set_stats_enabled(self->model->identifier, enabled);
+    Py_RETURN_NONE;
+}
+
+// Python list of the counts of a histogram
+static PyObject* histogram_to_list(const unsigned long long* counts) {
+    PyObject* list = PyList_New(STATS_HISTOGRAM_BUCKETS);
+
+    for (Py_ssize_t i = 0; list != NULL && i < STATS_HISTOGRAM_BUCKETS; ++i) {
+        PyObject* count = PyLong_FromUnsignedLongLong(counts[i]);
+        if (count == NULL) {
+            Py_CLEAR(list);
+            break;
+        }
+        PyList_SET_ITEM(list, i, count);
+    }
+    return list;
+}
+
+/* langid.stats() Python method */
+static PyObject* LangId_stats(LangIdObject* self, PyObject* args) {
+    LanguageIdentifierStats stats;
+    PyObject *stage_cycles = NULL, *stage_seconds = NULL, *result = NULL;
+
+    get_stats(self->model->identifier, &stats);
+
+    if ((stage_cycles = PyDict_New()) == NULL || (stage_seconds = PyDict_New()) == NULL) {
+        goto done;
+    }
+    for (size_t i = 0; i < STATS_NUM_STAGES; ++i) {
+        PyObject* cycles = PyLong_FromUnsignedLongLong(stats.stage_cycles[i]);
+        PyObject* seconds = PyFloat_FromDouble(stats.cycles_per_second > 0
+                                                   ? stats.stage_cycles[i] / stats.cycles_per_second
+                                                   : 0.0);
+        int status = cycles == NULL || seconds == NULL ||
+                     PyDict_SetItemString(stage_cycles, stats_stage_names[i], cycles) != 0 ||
+                     PyDict_SetItemString(stage_seconds, stats_stage_names[i], seconds) != 0;
+        Py_XDECREF(cycles);
+        Py_XDECREF(seconds);
+        if (status) {
+            goto done;
+        }
+    }
+
+    result = Py_BuildValue("{s:O,s:K,s:K,s:K,s:N,s:N,s:O,s:O,s:d}", "enabled", stats.enabled ? Py_True : Py_False,
+                           "calls", stats.calls, "bytes", stats.bytes, "cache_hits", stats.cache_hits,
+                           "sv_members", histogram_to_list(stats.sv_members), "fv_members",
+                           histogram_to_list(stats.fv_members), "stage_cycles", stage_cycles, "stage_seconds",
+                           stage_seconds, "cycles_per_second", stats.cycles_per_second);
+
+done:
+    Py_XDECREF(stage_cycles);
+    Py_XDECREF(stage_seconds);
+    return result;
+}
+
+/* langid.reset_stats() Python method */
+static PyObject* LangId_reset_stats(LangIdObject* self, PyObject* args) {
+    reset_stats(self->model->identifier);
+    Py_RETURN_NONE;
+}
+
+/* langid.cache_info() Python method, named after functools.lru_cache */
+static PyObject* LangId_cache_info(LangIdObject* self, PyObject* args) {
+    ResultCacheStats stats = {0};
+
+    get_cache_stats(self->model->identifier, &stats);
+    return Py_BuildValue("{s:K,s:K,s:n,s:n}", "hits", stats.hits, "misses", stats.misses, "currsize",
+                         (Py_ssize_t)stats.size, "maxsize", (Py_ssize_t)stats.capacity);
+}
+
+static PyObject* LangId_prefault(LangIdObject* self, PyObject* args) {
+    LangIdModel* model = LangId_acquire_model(self);
+
+    Py_BEGIN_ALLOW_THREADS
+    prefault_identifier(model->identifier);
+    Py_END_ALLOW_THREADS
+
+    LangId_release_model(model);
+    Py_RETURN_NONE;
+}
+
+// Languages set on an identifier, NULL if all of them are
+static const char** LangId_set_languages_of(const LanguageIdentifier* identifier, const char* langs[],
+                                            unsigned int* num_langs) {
+    *num_langs = 0;
+    for (unsigned int i = 0; i < identifier->num_langs; ++i) {
+        if (identifier->nb_classes_mask[i]) {
+            langs[(*num_langs)++] = (*identifier->nb_classes)[i];
+        }
+    }
+    return *num_langs < identifier->num_langs ? langs : NULL;
+}
+
+/* langid.swap_model() Python method */
+static PyObject* LangId_swap_model(LangIdObject* self, PyObject* args, PyObject* kwds) {
+    static char* kwlist[] = {"model_path", NULL};
+    const char* model_path = NULL;
+    LanguageIdentifier* identifier;
+    LanguageIdentifierStats stats;
+    ResultCacheStats cache_stats = {0};
+    LangIdModel *old_model, *model;
+    unsigned long languages_version;
+    unsigned int num_langs;
+    int status;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|z", kwlist, &model_path)) {
+        return NULL;
+    }
+
+    // the settings and languages of the current model carry over, its language codes stay alive while it is held
+    old_model = LangId_acquire_model(self);
+    languages_version = self->languages_version;
+    const LanguageIdentifier* old = old_model->identifier;
+    const char* old_langs[old->num_langs ? old->num_langs : 1];
+    const char** langs = LangId_set_languages_of(old, old_langs, &num_langs);
+    bool state_posteriors = old->state_posteriors;
+    get_cache_stats(old, &cache_stats);
+
+    if ((identifier = LangId_load_identifier(model_path)) == NULL) {
+        LangId_release_model(old_model);
+        return NULL;
+    }
+
+    // the new model is not shared yet, so it is set up while calls keep running on the current one
+    Py_BEGIN_ALLOW_THREADS
+    if (langs != NULL && set_languages(identifier, langs, num_langs) != 0) {
+        status = -2;
+    } else if (enable_cache(identifier, cache_stats.capacity) != 0 ||
+               (state_posteriors && set_state_posteriors(identifier, true) != 0)) {
+        status = -1;
+    } else {
+        prefault_identifier(identifier);
+        status = 0;
+    }
+    Py_END_ALLOW_THREADS
+
+    // unless set_languages ran meanwhile, in which case its languages apply to the new model as well
+    if (status == 0 && self->languages_version != languages_version) {
+        const char* current_langs[self->model->identifier->num_langs + 1];
+        langs = LangId_set_languages_of(self->model->identifier, current_langs, &num_langs);
+        status = set_languages(identifier, langs, num_langs) != 0 ? -2 : 0;
+    }
+    LangId_release_model(old_model);
+
+    if (status != 0) {
+        destroy_identifier(identifier);
+        if (status == -2) {
+            PyErr_SetString(PyExc_ValueError, "The new model lacks languages set on the current one, reset them with "
+                                              "set_languages() first.");
+        } else {
+            PyErr_NoMemory();
+        }
+        return NULL;
+    }
+
+    get_stats(self->model->identifier, &stats);
+    set_stats_enabled(identifier, stats.enabled);
+    if ((model = LangId_new_model(identifier)) == NULL) {
+        return NULL;
+    }
+
+    // calls from now on use the new model, those running hold a reference to the old one
+    old_model = self->model;
+    self->model = model;
+    self->languages_version++;
+    LangId_release_idle_subsets(old_model);
+    LangId_release_model(old_model);
+    Py_RETURN_NONE;
+}
+
+static PyObject* Cascade_new(PyTypeObject* type, PyObject* args, PyObject* kwds) {
+    static char* kwlist[] = {"first", "second", "min_confidence", "min_margin", NULL};
+    LangIdObject *first, *second;
+    PyObject *min_confidence = Py_None, *min_margin = Py_None;
+    CascadeObject* self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!O!|OO", kwlist, &LangIdType, &first, &LangIdType, &second,
+                                     &min_confidence, &min_margin)) {
+        return NULL;
+    }
+    if (first->model == NULL || second->model == NULL) {
+        PyErr_SetString(PyExc_ValueError, "Both identifiers must be initialized.");
+        return NULL;
+    }
+
+    if ((self = (CascadeObject*)type->tp_alloc(type, 0)) == NULL) {
+        return NULL;
+    }
+    Py_INCREF(first);
+    self->first = first;
+    Py_INCREF(second);
+    self->second = second;
+    self->models = NULL;
+
+    // as for streams, a threshold above 1 is never met
+    self->min_confidence = min_confidence == Py_None ? 2.0 : PyFloat_AsDouble(min_confidence);
+    self->min_margin = min_margin == Py_None ? 2.0 : PyFloat_AsDouble(min_margin);
+    if (PyErr_Occurred()) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject*)self;
+}
+
+// Drop a reference to the cascade of two models. Must be called with the GIL held.
+static void Cascade_release_models(CascadeModels* models) {
+    if (--models->refcount > 0) {
+        return;
+    }
+    free_cascade(models->cascade);
+    LangId_release_model(models->first);
+    LangId_release_model(models->second);
+    PyMem_Free(models);
+}
+
+// Reference to the cascade of the current models of both identifiers, built again after either swapped its model
+static CascadeModels* Cascade_acquire_models(CascadeObject* self) {
+    CascadeModels* models = self->models;
+
+    if (models == NULL || models->first != self->first->model || models->second != self->second->model) {
+        if ((models = PyMem_Malloc(sizeof(CascadeModels))) == NULL) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        models->cascade = alloc_cascade(self->first->model->identifier, self->second->model->identifier,
+                                        self->min_confidence, self->min_margin);
+        if (models->cascade == NULL) {
+            PyMem_Free(models);
+            PyErr_NoMemory();
+            return NULL;
+        }
+        models->refcount = 1;
+        models->first = LangId_acquire_model(self->first);
+        models->second = LangId_acquire_model(self->second);
+
+        if (self->models != NULL) {
+            Cascade_release_models(self->models);
+        }
+        self->models = models;
+    }
+    models->refcount++;
+    return models;
+}
+
+static void Cascade_dealloc(CascadeObject* self) {
+    if (self->models != NULL) {
+        Cascade_release_models(self->models);
+    }
+    Py_XDECREF(self->first);
+    Py_XDECREF(self->second);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/* Cascade.classify() Python method */
+static PyObject* Cascade_classify(CascadeObject* self, PyObject* args) {
+    const char* text;
+    Py_ssize_t text_length;
+    PyObject* result = NULL;
+
+    CascadeModels* models;
+    LanguageIdentifierContext *first_ctx, *second_ctx = NULL;
+    LanguageConfidence language_confidence;
+    unsigned int stage;
+
+    if (!PyArg_ParseTuple(args, "s#", &text, &text_length))
+        return NULL;
+
+    if ((models = Cascade_acquire_models(self)) == NULL)
+        return NULL;
+    if ((first_ctx = LangId_acquire_context(models->first)) == NULL ||
+        (second_ctx = LangId_acquire_context(models->second)) == NULL) {
+        goto done;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    language_confidence = classify_cascade_r(models->cascade, first_ctx, second_ctx, text, text_length, &stage);
+    Py_END_ALLOW_THREADS
+
+    self->resolved[stage]++;
+    result = LangId_result_tuple(models->second, &language_confidence);
+
+done:
+    if (first_ctx != NULL) {
+        LangId_release_context(models->first, first_ctx);
+    }
+    if (second_ctx != NULL) {
+        LangId_release_context(models->second, second_ctx);
+    }
+    Cascade_release_models(models);
+    return result;
+}
+
+/* Cascade.stats() Python method */
+static PyObject* Cascade_stats(CascadeObject* self, PyObject* args) {
+    return Py_BuildValue("{s:K,s:K}", "first", self->resolved[0], "second", self->resolved[1]);
+}
+
+/* Cascade.reset_stats() Python method */
+static PyObject* Cascade_reset_stats(CascadeObject* self, PyObject* args) {
+    self->resolved[0] = self->resolved[1] = 0;
+    Py_RETURN_NONE;
+}
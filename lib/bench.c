@@ -0,0 +1,489 @@
+/*
+ * Microbenchmark of the liblangid classification pipeline
+ *
+ * Classifies a deterministic synthetic multilingual corpus at several
+ * document sizes and prints one JSON object per line: ns/byte and docs/s of
+ * classify_r, and the time spent in each stage of the pipeline, plus the
+ * time taken by load_identifier and prefault_identifier. Short documents
+ * are also classified in batches, with and without blocks. The tokenizer is
+ * also timed on its own, one document at a time and over 4 to 16 documents
+ * in lockstep. The corpus of 4096 byte documents is also segmented into
+ * windows, against classifying each window. With -s, the documents are
+ * scored from precomputed per-state posteriors, whose size is reported as
+ * well.
+ *
+ * Reading the clock around every stage of every document would cost more
+ * than the stages of short documents, so instead the input of every stage
+ * is computed once for each document of the corpus, and each stage is run
+ * on its own over the whole corpus. Stages are reported with the standard
+ * deviation of their passes over the corpus.
+ */
+/* the stages are static functions of liblangid.c */
+#include "liblangid.c"
+
+#include <time.h>
+
+static const char* default_model_path = "../langid_pyc/ldpy3.fmodel";
+
+static const unsigned int doc_sizes[] = {64, 512, 4096, 32768};
+#define NUM_DOC_SIZES (sizeof(doc_sizes) / sizeof(doc_sizes[0]))
+#define CORPUS_BYTES (1 << 20)
+
+/* syllables of a few scripts, words of a document are drawn from one of them */
+static const char* const syllables[][12] = {
+    {"the", "and", "ing", "ion", "er", "to", "of", "is", "ver", "ent", "al", "st"},
+    {"der", "die", "und", "sch", "ein", "ich", "ung", "en", "ge", "ber", "auf", "zu"},
+    {"le", "la", "les", "des", "que", "ent", "ou", "eau", "est", "par", "pour", "ne"},
+    {"ка", "про", "ни", "ет", "ва", "ост", "ро", "на", "ть", "ли", "ско", "же"},
+    {"και", "το", "να", "της", "πο", "με", "στη", "ει", "ου", "αν", "τα", "ση"},
+    {"的", "是", "在", "了", "不", "和", "有", "大", "这", "中", "人", "上"},
+    {"ال", "في", "من", "على", "إلى", "أن", "ها", "ية", "ات", "لا", "ما", "هو"},
+    {"के", "में", "है", "की", "और", "से", "को", "पर", "ने", "कि", "भी", "था"},
+};
+#define NUM_SCRIPTS (sizeof(syllables) / sizeof(syllables[0]))
+
+typedef struct {
+    char* text;
+    unsigned int num_docs;
+    unsigned int doc_size;
+} Corpus;
+
+static uint32_t lcg(uint32_t* seed) {
+    *seed = *seed * 1664525u + 1013904223u;
+    return *seed >> 8;
+}
+
+/* Documents of doc_size bytes, each in a single script, filling about CORPUS_BYTES */
+static Corpus make_corpus(unsigned int doc_size) {
+    Corpus corpus;
+    uint32_t seed = doc_size;
+    unsigned int i, len;
+
+    corpus.doc_size = doc_size;
+    corpus.num_docs = CORPUS_BYTES / doc_size;
+    if ((corpus.text = (char*)malloc((size_t)corpus.num_docs * doc_size)) == NULL) {
+        fprintf(stderr, "Memory allocation failed for the corpus\n");
+        exit(-1);
+    }
+
+    for (i = 0; i < corpus.num_docs; ++i) {
+        char* doc = corpus.text + (size_t)i * doc_size;
+        unsigned int script = lcg(&seed) % NUM_SCRIPTS;
+
+        for (len = 0; len < doc_size;) {
+            const char* syllable = lcg(&seed) % 5 == 0 ? " " : syllables[script][lcg(&seed) % 12];
+            size_t syllable_len = strlen(syllable);
+            if (len + syllable_len > doc_size) {
+                syllable = " ";
+                syllable_len = 1;
+            }
+            memcpy(doc + len, syllable, syllable_len);
+            len += syllable_len;
+        }
+    }
+    return corpus;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Times load_identifier, then prefault_identifier on the loaded model: the
+ * start-up cost of a process, before and after its first documents */
+static void bench_load(const char* model_path, double min_seconds) {
+    LanguageIdentifier* lid;
+    unsigned int loads = 0;
+    double start = now_ns(), elapsed, prefault_ns = 0;
+
+    do {
+        if ((lid = load_identifier(model_path)) == NULL) {
+            exit(-1);
+        }
+        elapsed = now_ns();
+        prefault_identifier(lid);
+        prefault_ns += now_ns() - elapsed;
+        destroy_identifier(lid);
+        loads++;
+    } while ((elapsed = now_ns() - start) < min_seconds * 1e9);
+
+    printf("{\"benchmark\": \"load_identifier\", \"model\": \"%s\", \"loads\": %u, \"ms_per_load\": %.4f, "
+           "\"ms_per_prefault\": %.4f}\n",
+           model_path, loads, (elapsed - prefault_ns) / loads / 1e6, prefault_ns / loads / 1e6);
+}
+
+static const char* const stage_names[] = {"text_to_sv", "sv_to_fv", "fv_to_logprob", "logprob_to_prob"};
+#define NUM_STAGES (sizeof(stage_names) / sizeof(stage_names[0]))
+
+/* The states or features counted in a document, as a Set without its sparse
+ * array: enough for the stages that only iterate over the members */
+typedef struct {
+    unsigned int *keys, *counts;
+    size_t* offsets;
+} StoredSets;
+
+static void store_set(StoredSets* sets, unsigned int i, const Set* set) {
+    memcpy(sets->keys + sets->offsets[i], set->dense, sizeof(unsigned int) * set->members);
+    memcpy(sets->counts + sets->offsets[i], set->counts, sizeof(unsigned int) * set->members);
+    sets->offsets[i + 1] = sets->offsets[i] + set->members;
+}
+
+static Set stored_set(const StoredSets* sets, unsigned int i) {
+    Set set = {(unsigned int)(sets->offsets[i + 1] - sets->offsets[i]), NULL, sets->keys + sets->offsets[i],
+               sets->counts + sets->offsets[i]};
+    return set;
+}
+
+static void alloc_stored_sets(StoredSets* sets, const Corpus* corpus, size_t max_members) {
+    /* a document cannot count more states or features than it has bytes, plus the start state */
+    size_t capacity = (size_t)corpus->num_docs * (corpus->doc_size + 1);
+
+    if (capacity > (size_t)corpus->num_docs * max_members) {
+        capacity = (size_t)corpus->num_docs * max_members;
+    }
+    sets->keys = (unsigned int*)malloc(sizeof(unsigned int) * capacity);
+    sets->counts = (unsigned int*)malloc(sizeof(unsigned int) * capacity);
+    sets->offsets = (size_t*)malloc(sizeof(size_t) * (corpus->num_docs + 1));
+    if (sets->keys == NULL || sets->counts == NULL || sets->offsets == NULL) {
+        fprintf(stderr, "Memory allocation failed for the stage inputs\n");
+        exit(-1);
+    }
+    sets->offsets[0] = 0;
+}
+
+static void free_stored_sets(StoredSets* sets) {
+    free(sets->keys);
+    free(sets->counts);
+    free(sets->offsets);
+}
+
+/* Inputs of every stage for each document of the corpus */
+typedef struct {
+    StoredSets sv, fv;
+    double* logprob; /* [num_docs][num_langs] */
+} StageInputs;
+
+/* Runs stage on its own over every document of the corpus */
+static void run_stage(const LanguageIdentifier* lid, const LanguageSubset* subset, LanguageIdentifierContext* ctx,
+                      const Corpus* corpus, StageInputs* inputs, unsigned int stage) {
+    bool by_state = subset->state_ptc != NULL;
+
+    for (unsigned int i = 0; i < corpus->num_docs; ++i) {
+        Set counts;
+        double* lp = inputs->logprob + (size_t)i * subset->num_langs;
+
+        switch (stage) {
+        case 0:
+            clear(ctx->sv);
+            text_to_sv(lid, 0, corpus->text + (size_t)i * corpus->doc_size, corpus->doc_size, ctx->sv);
+            break;
+        case 1:
+            counts = stored_set(&inputs->sv, i);
+            sv_to_fv(lid, &counts, ctx->fv);
+            break;
+        case 2:
+            counts = stored_set(by_state ? &inputs->sv : &inputs->fv, i);
+            counts_to_logprob(lid, subset, &counts, by_state, ctx->prob);
+            break;
+        case 3:
+            /* rows hold probabilities after the first pass, which cost the same to normalize */
+            logprob_to_prob(lid->kernels, lp, subset->num_langs);
+            prob_to_pred_idx(lp, subset->num_langs);
+            break;
+        }
+    }
+}
+
+static void bench_classify(const LanguageIdentifier* lid, const Corpus* corpus, double min_seconds) {
+    LanguageIdentifierContext* ctx = alloc_context(lid);
+    LanguageSubset* subset = acquire_subset(lid);
+    bool by_state = subset->state_ptc != NULL;
+    unsigned int i, stage;
+    double start, elapsed;
+    double stage_ns[NUM_STAGES], stage_stddev_ns[NUM_STAGES];
+    size_t docs = 0, sv_members = 0, fv_members = 0;
+    StageInputs inputs;
+
+    if (ctx == NULL) {
+        fprintf(stderr, "Memory allocation failed for context\n");
+        exit(-1);
+    }
+
+    /* end to end, as callers see it */
+    start = now_ns();
+    do {
+        for (i = 0; i < corpus->num_docs; ++i) {
+            classify_r(lid, ctx, corpus->text + (size_t)i * corpus->doc_size, corpus->doc_size);
+        }
+        docs += corpus->num_docs;
+    } while ((elapsed = now_ns() - start) < min_seconds * 1e9);
+
+    alloc_stored_sets(&inputs.sv, corpus, lid->num_states);
+    alloc_stored_sets(&inputs.fv, corpus, lid->num_feats);
+    if ((inputs.logprob = (double*)malloc(sizeof(double) * corpus->num_docs * subset->num_langs + 1)) == NULL) {
+        fprintf(stderr, "Memory allocation failed for the stage inputs\n");
+        exit(-1);
+    }
+    for (i = 0; i < corpus->num_docs; ++i) {
+        clear(ctx->sv);
+        text_to_sv(lid, 0, corpus->text + (size_t)i * corpus->doc_size, corpus->doc_size, ctx->sv);
+        sv_to_fv(lid, ctx->sv, ctx->fv);
+        store_set(&inputs.sv, i, ctx->sv);
+        store_set(&inputs.fv, i, ctx->fv);
+        counts_to_logprob(lid, subset, by_state ? ctx->sv : ctx->fv, by_state,
+                          inputs.logprob + (size_t)i * subset->num_langs);
+        sv_members += ctx->sv->members;
+        fv_members += ctx->fv->members;
+    }
+
+    /* each stage on its own from the stored inputs, at least 3 passes over the corpus */
+    for (stage = 0; stage < NUM_STAGES; ++stage) {
+        double sum = 0, sum_squares = 0;
+        unsigned int passes = 0;
+
+        /* state posteriors have no sv_to_fv stage */
+        if (stage == 1 && by_state) {
+            stage_ns[stage] = stage_stddev_ns[stage] = 0;
+            continue;
+        }
+        start = now_ns();
+        do {
+            double pass_start = now_ns();
+            run_stage(lid, subset, ctx, corpus, &inputs, stage);
+            double ns_per_doc = (now_ns() - pass_start) / corpus->num_docs;
+            sum += ns_per_doc;
+            sum_squares += ns_per_doc * ns_per_doc;
+            passes++;
+        } while (passes < 3 || now_ns() - start < min_seconds / NUM_STAGES * 1e9);
+
+        stage_ns[stage] = sum / passes;
+        double variance = (sum_squares - sum * sum / passes) / (passes - 1);
+        stage_stddev_ns[stage] = variance > 0 ? sqrt(variance) : 0;
+    }
+
+    printf("{\"benchmark\": \"classify\", \"kernels\": \"%s\", \"state_posteriors\": %s, \"doc_bytes\": %u, \"docs\": %zu, "
+           "\"ns_per_byte\": %.4f, \"docs_per_s\": %.1f, \"mean_sv_members\": %.1f, \"mean_fv_members\": %.1f, "
+           "\"stage_ns_per_doc\": {",
+           lid->kernels->name, by_state ? "true" : "false", corpus->doc_size, docs, elapsed / ((double)docs * corpus->doc_size),
+           docs / (elapsed / 1e9), (double)sv_members / corpus->num_docs, (double)fv_members / corpus->num_docs);
+    for (i = 0; i < NUM_STAGES; ++i) {
+        printf("%s\"%s\": %.1f", i ? ", " : "", stage_names[i], stage_ns[i]);
+    }
+    printf("}, \"stage_stddev_ns_per_doc\": {");
+    for (i = 0; i < NUM_STAGES; ++i) {
+        printf("%s\"%s\": %.1f", i ? ", " : "", stage_names[i], stage_stddev_ns[i]);
+    }
+    printf("}}\n");
+
+    free_stored_sets(&inputs.sv);
+    free_stored_sets(&inputs.fv);
+    free(inputs.logprob);
+    release_subset(subset);
+    free_context(ctx);
+}
+
+/* classify_batch against classify_batch_blocked on one thread, over the documents of the corpus */
+static void bench_batch(const LanguageIdentifier* lid, const Corpus* corpus, double min_seconds) {
+    const char** texts = (const char**)malloc(sizeof(const char*) * corpus->num_docs);
+    unsigned int* text_lens = (unsigned int*)malloc(sizeof(unsigned int) * corpus->num_docs);
+    LanguageConfidence* out = (LanguageConfidence*)malloc(sizeof(LanguageConfidence) * corpus->num_docs);
+    unsigned int i;
+
+    if (texts == NULL || text_lens == NULL || out == NULL) {
+        fprintf(stderr, "Memory allocation failed for the batch\n");
+        exit(-1);
+    }
+    for (i = 0; i < corpus->num_docs; ++i) {
+        texts[i] = corpus->text + (size_t)i * corpus->doc_size;
+        text_lens[i] = corpus->doc_size;
+    }
+
+    for (int blocked = 0; blocked < 2; ++blocked) {
+        size_t docs = 0;
+        double start = now_ns(), elapsed;
+
+        do {
+            if ((blocked ? classify_batch_blocked : classify_batch)(lid, texts, text_lens, corpus->num_docs, out, 1) !=
+                0) {
+                exit(-1);
+            }
+            docs += corpus->num_docs;
+        } while ((elapsed = now_ns() - start) < min_seconds * 1e9);
+
+        printf("{\"benchmark\": \"classify_batch\", \"blocked\": %s, \"doc_bytes\": %u, \"docs\": %zu, "
+               "\"ns_per_byte\": %.4f, \"docs_per_s\": %.1f}\n",
+               blocked ? "true" : "false", corpus->doc_size, docs, elapsed / ((double)docs * corpus->doc_size),
+               docs / (elapsed / 1e9));
+    }
+
+    free(texts);
+    free(text_lens);
+    free(out);
+}
+
+/* text_to_sv one document at a time against texts_to_sv over lanes of documents, with and without prefetching */
+static void bench_tokenizer(const LanguageIdentifier* lid, const Corpus* corpus, double min_seconds) {
+    static const unsigned int lane_counts[] = {1, 4, 8, 16};
+    const char* texts[TOKENIZER_MAX_LANES];
+    unsigned int text_lens[TOKENIZER_MAX_LANES];
+    Set* sv[TOKENIZER_MAX_LANES];
+    unsigned int i, l;
+
+    for (l = 0; l < TOKENIZER_MAX_LANES; ++l) {
+        sv[l] = alloc_set(lid->num_states);
+        text_lens[l] = corpus->doc_size;
+    }
+
+    /* lanes = 0 stands for text_to_sv */
+    for (int c = -1; c < (int)(sizeof(lane_counts) / sizeof(lane_counts[0])); ++c) {
+        for (int prefetch = 0; prefetch < (c < 0 ? 1 : 2); ++prefetch) {
+            unsigned int lanes = c < 0 ? 0 : lane_counts[c];
+            size_t docs = 0;
+            double start = now_ns(), elapsed;
+
+            do {
+                for (i = 0; i < corpus->num_docs; i += lanes ? lanes : 1) {
+                    const char* text = corpus->text + (size_t)i * corpus->doc_size;
+                    unsigned int n = lanes < corpus->num_docs - i ? lanes : corpus->num_docs - i;
+
+                    if (lanes == 0) {
+                        clear(sv[0]);
+                        text_to_sv(lid, 0, text, corpus->doc_size, sv[0]);
+                        continue;
+                    }
+                    for (l = 0; l < n; ++l) {
+                        texts[l] = text + (size_t)l * corpus->doc_size;
+                    }
+                    texts_to_sv(lid, texts, text_lens, n, sv, prefetch);
+                }
+                docs += corpus->num_docs;
+            } while ((elapsed = now_ns() - start) < min_seconds * 1e9);
+
+            printf("{\"benchmark\": \"tokenizer\", \"lanes\": %u, \"prefetch\": %s, \"doc_bytes\": %u, "
+                   "\"docs\": %zu, \"ns_per_byte\": %.4f}\n",
+                   lanes, prefetch ? "true" : "false", corpus->doc_size, docs,
+                   elapsed / ((double)docs * corpus->doc_size));
+        }
+    }
+
+    for (l = 0; l < TOKENIZER_MAX_LANES; ++l) {
+        free_set(sv[l]);
+    }
+}
+
+/* segment_r over the corpus as one document, switching language every
+ * document, against classify_r of each of its windows
+ */
+static void bench_segment(const LanguageIdentifier* lid, const Corpus* corpus, double min_seconds) {
+    static const unsigned int strides[] = {256, 128, 64, 16};
+    const unsigned int window = 256;
+    unsigned int text_len = corpus->num_docs * corpus->doc_size;
+    unsigned int num_windows = segment_windows(text_len, window, strides[3], NULL, NULL);
+    unsigned int* starts = (unsigned int*)malloc(sizeof(unsigned int) * num_windows);
+    unsigned int* ends = (unsigned int*)malloc(sizeof(unsigned int) * num_windows);
+    LanguageConfidence* out = (LanguageConfidence*)malloc(sizeof(LanguageConfidence) * num_windows);
+    LanguageIdentifierContext* ctx = alloc_context(lid);
+    unsigned int i;
+
+    if (starts == NULL || ends == NULL || out == NULL || ctx == NULL) {
+        fprintf(stderr, "Memory allocation failed for the windows\n");
+        exit(-1);
+    }
+
+    for (size_t s = 0; s < sizeof(strides) / sizeof(strides[0]); ++s) {
+        double ns[2];
+
+        num_windows = segment_windows(text_len, window, strides[s], starts, ends);
+        for (int segmented = 0; segmented < 2; ++segmented) {
+            size_t windows = 0;
+            double start = now_ns(), elapsed;
+
+            do {
+                if (segmented) {
+                    if (segment_r(lid, ctx, corpus->text, text_len, starts, ends, num_windows, out) != 0) {
+                        exit(-1);
+                    }
+                } else {
+                    for (i = 0; i < num_windows; ++i) {
+                        out[i] = classify_r(lid, ctx, corpus->text + starts[i], ends[i] - starts[i]);
+                    }
+                }
+                windows += num_windows;
+            } while ((elapsed = now_ns() - start) < min_seconds / 2 * 1e9);
+            ns[segmented] = elapsed / windows;
+        }
+
+        printf("{\"benchmark\": \"segment\", \"doc_bytes\": %u, \"window\": %u, \"stride\": %u, \"windows\": %u, "
+               "\"classify_ns_per_window\": %.1f, \"segment_ns_per_window\": %.1f, \"speedup\": %.2f}\n",
+               corpus->doc_size, window, strides[s], num_windows, ns[0], ns[1], ns[0] / ns[1]);
+    }
+
+    free(starts);
+    free(ends);
+    free(out);
+    free_context(ctx);
+}
+
+int main(int argc, char** argv) {
+    const char* model_path = default_model_path;
+    double min_seconds = 1.0;
+    bool state_posteriors = false;
+    LanguageIdentifier* lid;
+    int c;
+
+    /* valid options are:
+     * m: model file to benchmark
+     * t: minimum number of seconds spent on each benchmark
+     * s: score from per-state posteriors
+     */
+    while ((c = getopt(argc, argv, "m:t:s")) != -1)
+        switch (c) {
+        case 'm':
+            model_path = optarg;
+            break;
+        case 't':
+            min_seconds = atof(optarg);
+            break;
+        case 's':
+            state_posteriors = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-m model] [-t seconds] [-s]\n", argv[0]);
+            return 1;
+        }
+
+    bench_load(model_path, min_seconds);
+
+    if ((lid = load_identifier(model_path)) == NULL) {
+        return 1;
+    }
+    if (state_posteriors) {
+        double start = now_ns();
+        if (set_state_posteriors(lid, true) != 0) {
+            return 1;
+        }
+        printf("{\"benchmark\": \"state_posteriors\", \"model\": \"%s\", \"states\": %u, \"state_rows\": %u, "
+               "\"nb_ptc_bytes\": %zu, \"state_ptc_bytes\": %zu, \"ms_to_build\": %.4f}\n",
+               model_path, lid->num_states, lid->num_state_rows,
+               (size_t)lid->num_feats * lid->num_langs * nb_ptc_element_size[lid->nb_ptc_encoding],
+               (size_t)lid->num_state_rows * lid->num_langs * sizeof(double), (now_ns() - start) / 1e6);
+    }
+    for (size_t i = 0; i < NUM_DOC_SIZES; ++i) {
+        Corpus corpus = make_corpus(doc_sizes[i]);
+        bench_classify(lid, &corpus, min_seconds);
+        bench_tokenizer(lid, &corpus, min_seconds);
+        /* blocks are meant for short documents */
+        if (doc_sizes[i] <= 512) {
+            bench_batch(lid, &corpus, min_seconds);
+        }
+        /* documents of a few windows each */
+        if (doc_sizes[i] == 4096) {
+            bench_segment(lid, &corpus, min_seconds);
+        }
+        free(corpus.text);
+    }
+    destroy_identifier(lid);
+
+    return 0;
+}
@@ -0,0 +1,14 @@
+#ifndef _DEFAULTMODEL_H
+#define _DEFAULTMODEL_H
+
+#include <stddef.h>
+
+/* Flat model linked into the library when it is built with
+ * LANGID_DEFAULT_MODEL defined and defaultmodel.c, generated by
+ * ldpy_to_protobuf.py --format c. get_default_identifier uses it in place
+ * from the read-only data of the library.
+ */
+extern const unsigned char default_model[];
+extern const size_t default_model_len;
+
+#endif
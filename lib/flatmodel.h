@@ -0,0 +1,50 @@
+#ifndef _FLATMODEL_H
+#define _FLATMODEL_H
+
+#include <stdint.h>
+
+/* Flat model format: a header, followed by a table of sections. Every
+ * section is an array starting at a multiple of FLAT_MODEL_ALIGNMENT bytes
+ * from the beginning of the file, so that load_identifier can use the
+ * tables in place from a read-only mapping of the file instead of copying
+ * them to the heap. All values are little-endian.
+ *
+ * Sections with an unknown id are ignored, newer writers may add
+ * sections without bumping the version.
+ */
+#define FLAT_MODEL_MAGIC "LANGIDFM"
+#define FLAT_MODEL_VERSION 1
+#define FLAT_MODEL_ALIGNMENT 64
+
+typedef enum {
+    FLAT_MODEL_TK_NEXTMOVE = 1, /* uint32_t[num_states][256], only needed without the two below */
+    FLAT_MODEL_TK_OUTPUT_C = 2, /* uint32_t[num_states] */
+    FLAT_MODEL_TK_OUTPUT_S = 3, /* uint32_t[num_states] */
+    FLAT_MODEL_TK_OUTPUT = 4,   /* uint32_t[] */
+    FLAT_MODEL_NB_PC = 5,       /* double[num_langs] */
+    FLAT_MODEL_NB_PTC = 6,      /* [num_feats][num_langs] elements of the section encoding */
+    FLAT_MODEL_NB_CLASSES = 7,  /* num_langs NUL-terminated strings */
+    FLAT_MODEL_NB_PTC_SCALE = 8, /* double[num_langs], required by integer nb_ptc encodings */
+    FLAT_MODEL_TK_BYTE_CLASS = 9, /* uint8_t[256], class of each byte */
+    FLAT_MODEL_TK_TRANSITIONS = 10, /* [num_states][num_classes] states of the section encoding bytes */
+} FlatModelSectionId;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_feats;
+    uint32_t num_langs;
+    uint32_t num_states;
+    uint32_t num_sections;
+    uint32_t reserved[3];
+} FlatModelHeader;
+
+typedef struct {
+    uint32_t id;
+    uint32_t encoding; /* an NbPtcEncoding for FLAT_MODEL_NB_PTC, the size of a state for
+                          FLAT_MODEL_TK_TRANSITIONS, 0 otherwise */
+    uint64_t offset;
+    uint64_t size;
+} FlatModelSection;
+
+#endif
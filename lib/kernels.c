@@ -0,0 +1,682 @@
+/* Scalar, SSE2, AVX2, AVX-512 and NEON implementations of the kernels
+ * declared in kernels.h, and the runtime selection between them.
+ *
+ * The vector kernels process 8 elements at a time and fall back to the
+ * scalar code for the remainder. Sums are kept in 8 partial sums, one per
+ * position in a block, that are added up in a fixed order; together with
+ * a polynomial exp that does not depend on libm this keeps every kernel
+ * bit-identical to the scalar one. That requires the compiler not to fuse
+ * multiplications and additions, hence -ffp-contract=off in the builds.
+ */
+#include "kernels.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERNELS_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__)
+#define KERNELS_NEON
+#include <arm_neon.h>
+#endif
+
+#ifdef __clang__
+#pragma STDC FP_CONTRACT OFF
+#endif
+
+#define BLOCK 8
+
+/* exp(x) = 2^n * exp(r) with n = round(x / ln2) and |r| <= ln2 / 2,
+ * exp(r) being evaluated by its Taylor series up to r^12.
+ * Results below 2^-1022 are flushed to zero.
+ */
+static const double exp_min = -708.3964185322641;
+static const double exp_log2e = 1.4426950408889634;
+static const double exp_ln2_hi = 6.93147180369123816490e-01;
+static const double exp_ln2_lo = 1.90821492927058770002e-10;
+/* adding 1.5 * 2^52 rounds to an integer, which ends up in the low mantissa bits */
+static const double exp_shift = 6755399441055744.0;
+static const double exp_coeffs[] = {
+    2.08767569878681e-09,   /* 1/12! */
+    2.505210838544172e-08,  /* 1/11! */
+    2.755731922398589e-07,  /* 1/10! */
+    2.7557319223985893e-06, /* 1/9! */
+    2.48015873015873e-05,   /* 1/8! */
+    0.0001984126984126984,  /* 1/7! */
+    0.001388888888888889,   /* 1/6! */
+    0.008333333333333333,   /* 1/5! */
+    0.041666666666666664,   /* 1/4! */
+    0.16666666666666666,    /* 1/3! */
+    0.5,                    /* 1/2! */
+    1.0,                    /* 1/1! */
+    1.0,                    /* 1/0! */
+};
+#define EXP_NUM_COEFFS (sizeof(exp_coeffs) / sizeof(exp_coeffs[0]))
+
+static double exp_nonpositive(double x) {
+    double t, n, r, p, scale;
+    uint64_t bits, shift_bits;
+    unsigned int k;
+
+    if (!(x >= exp_min)) {
+        return 0.0;
+    }
+
+    t = x * exp_log2e + exp_shift;
+    n = t - exp_shift;
+    r = (x - n * exp_ln2_hi) - n * exp_ln2_lo;
+
+    p = exp_coeffs[0];
+    for (k = 1; k < EXP_NUM_COEFFS; ++k) {
+        p = p * r + exp_coeffs[k];
+    }
+
+    memcpy(&bits, &t, sizeof(bits));
+    memcpy(&shift_bits, &exp_shift, sizeof(shift_bits));
+    bits = (bits - shift_bits + 1023) << 52;
+    memcpy(&scale, &bits, sizeof(scale));
+
+    return p * scale;
+}
+
+static double sum_partials(const double partial[BLOCK]) {
+    return ((partial[0] + partial[1]) + (partial[2] + partial[3])) +
+           ((partial[4] + partial[5]) + (partial[6] + partial[7]));
+}
+
+/* scalar kernels, also used for the remainder of the vector ones */
+
+static void scalar_accumulate_f64(double* logprob, const double* row, double count, unsigned int n) {
+    for (unsigned int j = 0; j < n; ++j) {
+        logprob[j] += count * row[j];
+    }
+}
+
+static void scalar_accumulate_f32(double* logprob, const float* row, double count, unsigned int n) {
+    for (unsigned int j = 0; j < n; ++j) {
+        logprob[j] += count * (double)row[j];
+    }
+}
+
+static void scalar_accumulate_i16(double* logprob, const int16_t* row, double count, unsigned int n) {
+    for (unsigned int j = 0; j < n; ++j) {
+        logprob[j] += count * (double)row[j];
+    }
+}
+
+static void scalar_accumulate_i8(double* logprob, const int8_t* row, double count, unsigned int n) {
+    for (unsigned int j = 0; j < n; ++j) {
+        logprob[j] += count * (double)row[j];
+    }
+}
+
+static void scalar_accumulate_docs(double* logprob, unsigned int stride, const unsigned int* docs,
+                                   const unsigned int* counts, unsigned int m, const double* row, unsigned int n) {
+    for (unsigned int i = 0; i < m; ++i) {
+        scalar_accumulate_f64(logprob + (size_t)docs[i] * stride, row, counts[i], n);
+    }
+}
+
+static double scalar_max(const double* x, unsigned int n) {
+    double max = -INFINITY;
+    for (unsigned int i = 0; i < n; ++i) {
+        if (x[i] > max) {
+            max = x[i];
+        }
+    }
+    return max;
+}
+
+/* exp and sum of x[start..n), x[start] being at position start % BLOCK of its block */
+static void exp_sum_tail(double* x, double max, unsigned int start, unsigned int n, double partial[BLOCK]) {
+    for (unsigned int i = start; i < n; ++i) {
+        x[i] = exp_nonpositive(x[i] - max);
+        partial[i % BLOCK] += x[i];
+    }
+}
+
+static double scalar_exp_sum(double* x, double max, unsigned int n) {
+    double partial[BLOCK] = {0};
+    exp_sum_tail(x, max, 0, n, partial);
+    return sum_partials(partial);
+}
+
+static void scalar_divide(double* x, double divisor, unsigned int n) {
+    for (unsigned int i = 0; i < n; ++i) {
+        x[i] /= divisor;
+    }
+}
+
+static const Kernels scalar_kernels = {
+    "scalar",   scalar_accumulate_f64, scalar_accumulate_f32, scalar_accumulate_i16, scalar_accumulate_i8,
+    scalar_accumulate_docs, scalar_max, scalar_exp_sum, scalar_divide,
+};
+
+#ifdef KERNELS_X86
+
+/* SSE2: integer rows are left to the scalar code, as widening them needs SSE4.1 */
+
+__attribute__((target("sse2"))) static void sse2_accumulate_f64(double* logprob, const double* row, double count,
+                                                                 unsigned int n) {
+    __m128d c = _mm_set1_pd(count);
+    unsigned int j = 0;
+    for (; j + 2 <= n; j += 2) {
+        __m128d lp = _mm_loadu_pd(logprob + j);
+        _mm_storeu_pd(logprob + j, _mm_add_pd(lp, _mm_mul_pd(c, _mm_loadu_pd(row + j))));
+    }
+    scalar_accumulate_f64(logprob + j, row + j, count, n - j);
+}
+
+__attribute__((target("sse2"))) static void sse2_accumulate_f32(double* logprob, const float* row, double count,
+                                                                 unsigned int n) {
+    __m128d c = _mm_set1_pd(count);
+    unsigned int j = 0;
+    for (; j + 2 <= n; j += 2) {
+        __m128d r = _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i*)(row + j))));
+        __m128d lp = _mm_loadu_pd(logprob + j);
+        _mm_storeu_pd(logprob + j, _mm_add_pd(lp, _mm_mul_pd(c, r)));
+    }
+    scalar_accumulate_f32(logprob + j, row + j, count, n - j);
+}
+
+/* the vector accumulate_docs load each block of the row once for all the documents */
+__attribute__((target("sse2"))) static void sse2_accumulate_docs(double* logprob, unsigned int stride,
+                                                                  const unsigned int* docs, const unsigned int* counts,
+                                                                  unsigned int m, const double* row, unsigned int n) {
+    unsigned int i, j = 0;
+    for (; j + 2 <= n; j += 2) {
+        __m128d r = _mm_loadu_pd(row + j);
+        for (i = 0; i < m; ++i) {
+            double* lp = logprob + (size_t)docs[i] * stride + j;
+            _mm_storeu_pd(lp, _mm_add_pd(_mm_loadu_pd(lp), _mm_mul_pd(_mm_set1_pd(counts[i]), r)));
+        }
+    }
+    for (i = 0; i < m; ++i) {
+        scalar_accumulate_f64(logprob + (size_t)docs[i] * stride + j, row + j, counts[i], n - j);
+    }
+}
+
+__attribute__((target("sse2"))) static double sse2_max(const double* x, unsigned int n) {
+    __m128d m = _mm_set1_pd(-INFINITY);
+    double lanes[2];
+    unsigned int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        m = _mm_max_pd(m, _mm_loadu_pd(x + i));
+    }
+    _mm_storeu_pd(lanes, m);
+    double max = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+    for (; i < n; ++i) {
+        if (x[i] > max) {
+            max = x[i];
+        }
+    }
+    return max;
+}
+
+__attribute__((target("sse2"))) static __m128d sse2_exp_nonpositive(__m128d x) {
+    __m128d t = _mm_add_pd(_mm_mul_pd(x, _mm_set1_pd(exp_log2e)), _mm_set1_pd(exp_shift));
+    __m128d n = _mm_sub_pd(t, _mm_set1_pd(exp_shift));
+    __m128d r = _mm_sub_pd(_mm_sub_pd(x, _mm_mul_pd(n, _mm_set1_pd(exp_ln2_hi))), _mm_mul_pd(n, _mm_set1_pd(exp_ln2_lo)));
+
+    __m128d p = _mm_set1_pd(exp_coeffs[0]);
+    for (unsigned int k = 1; k < EXP_NUM_COEFFS; ++k) {
+        p = _mm_add_pd(_mm_mul_pd(p, r), _mm_set1_pd(exp_coeffs[k]));
+    }
+
+    __m128i bits = _mm_sub_epi64(_mm_castpd_si128(t), _mm_castpd_si128(_mm_set1_pd(exp_shift)));
+    bits = _mm_slli_epi64(_mm_add_epi64(bits, _mm_set1_epi64x(1023)), 52);
+    __m128d result = _mm_mul_pd(p, _mm_castsi128_pd(bits));
+
+    return _mm_and_pd(result, _mm_cmpge_pd(x, _mm_set1_pd(exp_min)));
+}
+
+__attribute__((target("sse2"))) static double sse2_exp_sum(double* x, double max, unsigned int n) {
+    __m128d m = _mm_set1_pd(max);
+    __m128d sums[BLOCK / 2];
+    double partial[BLOCK];
+    unsigned int i = 0, k;
+
+    for (k = 0; k < BLOCK / 2; ++k) {
+        sums[k] = _mm_setzero_pd();
+    }
+    for (; i + BLOCK <= n; i += BLOCK) {
+        for (k = 0; k < BLOCK / 2; ++k) {
+            __m128d e = sse2_exp_nonpositive(_mm_sub_pd(_mm_loadu_pd(x + i + 2 * k), m));
+            _mm_storeu_pd(x + i + 2 * k, e);
+            sums[k] = _mm_add_pd(sums[k], e);
+        }
+    }
+    for (k = 0; k < BLOCK / 2; ++k) {
+        _mm_storeu_pd(partial + 2 * k, sums[k]);
+    }
+    exp_sum_tail(x, max, i, n, partial);
+    return sum_partials(partial);
+}
+
+__attribute__((target("sse2"))) static void sse2_divide(double* x, double divisor, unsigned int n) {
+    __m128d d = _mm_set1_pd(divisor);
+    unsigned int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(x + i, _mm_div_pd(_mm_loadu_pd(x + i), d));
+    }
+    scalar_divide(x + i, divisor, n - i);
+}
+
+static const Kernels sse2_kernels = {
+    "sse2",   sse2_accumulate_f64, sse2_accumulate_f32, scalar_accumulate_i16, scalar_accumulate_i8,
+    sse2_accumulate_docs, sse2_max, sse2_exp_sum, sse2_divide,
+};
+
+/* AVX2 */
+
+__attribute__((target("avx2"))) static void avx2_accumulate_f64(double* logprob, const double* row, double count,
+                                                                 unsigned int n) {
+    __m256d c = _mm256_set1_pd(count);
+    unsigned int j = 0;
+    for (; j + 4 <= n; j += 4) {
+        __m256d lp = _mm256_loadu_pd(logprob + j);
+        _mm256_storeu_pd(logprob + j, _mm256_add_pd(lp, _mm256_mul_pd(c, _mm256_loadu_pd(row + j))));
+    }
+    scalar_accumulate_f64(logprob + j, row + j, count, n - j);
+}
+
+__attribute__((target("avx2"))) static void avx2_accumulate_f32(double* logprob, const float* row, double count,
+                                                                 unsigned int n) {
+    __m256d c = _mm256_set1_pd(count);
+    unsigned int j = 0;
+    for (; j + 4 <= n; j += 4) {
+        __m256d lp = _mm256_loadu_pd(logprob + j);
+        _mm256_storeu_pd(logprob + j, _mm256_add_pd(lp, _mm256_mul_pd(c, _mm256_cvtps_pd(_mm_loadu_ps(row + j)))));
+    }
+    scalar_accumulate_f32(logprob + j, row + j, count, n - j);
+}
+
+/* adds count times 8 integers widened to 32 bits to logprob[0..8) */
+__attribute__((target("avx2"))) static void avx2_accumulate_epi32(double* logprob, __m256i row, __m256d c) {
+    __m256d lo = _mm256_cvtepi32_pd(_mm256_castsi256_si128(row));
+    __m256d hi = _mm256_cvtepi32_pd(_mm256_extracti128_si256(row, 1));
+    _mm256_storeu_pd(logprob, _mm256_add_pd(_mm256_loadu_pd(logprob), _mm256_mul_pd(c, lo)));
+    _mm256_storeu_pd(logprob + 4, _mm256_add_pd(_mm256_loadu_pd(logprob + 4), _mm256_mul_pd(c, hi)));
+}
+
+__attribute__((target("avx2"))) static void avx2_accumulate_i16(double* logprob, const int16_t* row, double count,
+                                                                 unsigned int n) {
+    __m256d c = _mm256_set1_pd(count);
+    unsigned int j = 0;
+    for (; j + 8 <= n; j += 8) {
+        avx2_accumulate_epi32(logprob + j, _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(row + j))), c);
+    }
+    scalar_accumulate_i16(logprob + j, row + j, count, n - j);
+}
+
+__attribute__((target("avx2"))) static void avx2_accumulate_i8(double* logprob, const int8_t* row, double count,
+                                                                unsigned int n) {
+    __m256d c = _mm256_set1_pd(count);
+    unsigned int j = 0;
+    for (; j + 8 <= n; j += 8) {
+        avx2_accumulate_epi32(logprob + j, _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(row + j))), c);
+    }
+    scalar_accumulate_i8(logprob + j, row + j, count, n - j);
+}
+
+__attribute__((target("avx2"))) static void avx2_accumulate_docs(double* logprob, unsigned int stride,
+                                                                  const unsigned int* docs, const unsigned int* counts,
+                                                                  unsigned int m, const double* row, unsigned int n) {
+    unsigned int i, j = 0;
+    for (; j + 4 <= n; j += 4) {
+        __m256d r = _mm256_loadu_pd(row + j);
+        for (i = 0; i < m; ++i) {
+            double* lp = logprob + (size_t)docs[i] * stride + j;
+            _mm256_storeu_pd(lp, _mm256_add_pd(_mm256_loadu_pd(lp), _mm256_mul_pd(_mm256_set1_pd(counts[i]), r)));
+        }
+    }
+    for (i = 0; i < m; ++i) {
+        scalar_accumulate_f64(logprob + (size_t)docs[i] * stride + j, row + j, counts[i], n - j);
+    }
+}
+
+__attribute__((target("avx2"))) static double avx2_max(const double* x, unsigned int n) {
+    __m256d m = _mm256_set1_pd(-INFINITY);
+    double lanes[4];
+    unsigned int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        m = _mm256_max_pd(m, _mm256_loadu_pd(x + i));
+    }
+    _mm256_storeu_pd(lanes, m);
+    double max = scalar_max(lanes, 4);
+    for (; i < n; ++i) {
+        if (x[i] > max) {
+            max = x[i];
+        }
+    }
+    return max;
+}
+
+__attribute__((target("avx2"))) static __m256d avx2_exp_nonpositive(__m256d x) {
+    __m256d t = _mm256_add_pd(_mm256_mul_pd(x, _mm256_set1_pd(exp_log2e)), _mm256_set1_pd(exp_shift));
+    __m256d n = _mm256_sub_pd(t, _mm256_set1_pd(exp_shift));
+    __m256d r = _mm256_sub_pd(_mm256_sub_pd(x, _mm256_mul_pd(n, _mm256_set1_pd(exp_ln2_hi))),
+                              _mm256_mul_pd(n, _mm256_set1_pd(exp_ln2_lo)));
+
+    __m256d p = _mm256_set1_pd(exp_coeffs[0]);
+    for (unsigned int k = 1; k < EXP_NUM_COEFFS; ++k) {
+        p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(exp_coeffs[k]));
+    }
+
+    __m256i bits = _mm256_sub_epi64(_mm256_castpd_si256(t), _mm256_castpd_si256(_mm256_set1_pd(exp_shift)));
+    bits = _mm256_slli_epi64(_mm256_add_epi64(bits, _mm256_set1_epi64x(1023)), 52);
+    __m256d result = _mm256_mul_pd(p, _mm256_castsi256_pd(bits));
+
+    return _mm256_and_pd(result, _mm256_cmp_pd(x, _mm256_set1_pd(exp_min), _CMP_GE_OQ));
+}
+
+__attribute__((target("avx2"))) static double avx2_exp_sum(double* x, double max, unsigned int n) {
+    __m256d m = _mm256_set1_pd(max);
+    __m256d lo = _mm256_setzero_pd(), hi = _mm256_setzero_pd();
+    double partial[BLOCK];
+    unsigned int i = 0;
+
+    for (; i + BLOCK <= n; i += BLOCK) {
+        __m256d e_lo = avx2_exp_nonpositive(_mm256_sub_pd(_mm256_loadu_pd(x + i), m));
+        __m256d e_hi = avx2_exp_nonpositive(_mm256_sub_pd(_mm256_loadu_pd(x + i + 4), m));
+        _mm256_storeu_pd(x + i, e_lo);
+        _mm256_storeu_pd(x + i + 4, e_hi);
+        lo = _mm256_add_pd(lo, e_lo);
+        hi = _mm256_add_pd(hi, e_hi);
+    }
+    _mm256_storeu_pd(partial, lo);
+    _mm256_storeu_pd(partial + 4, hi);
+    exp_sum_tail(x, max, i, n, partial);
+    return sum_partials(partial);
+}
+
+__attribute__((target("avx2"))) static void avx2_divide(double* x, double divisor, unsigned int n) {
+    __m256d d = _mm256_set1_pd(divisor);
+    unsigned int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(x + i, _mm256_div_pd(_mm256_loadu_pd(x + i), d));
+    }
+    scalar_divide(x + i, divisor, n - i);
+}
+
+static const Kernels avx2_kernels = {
+    "avx2",   avx2_accumulate_f64, avx2_accumulate_f32, avx2_accumulate_i16, avx2_accumulate_i8,
+    avx2_accumulate_docs, avx2_max, avx2_exp_sum, avx2_divide,
+};
+
+/* AVX-512 */
+
+__attribute__((target("avx512f"))) static void avx512_accumulate_f64(double* logprob, const double* row, double count,
+                                                                      unsigned int n) {
+    __m512d c = _mm512_set1_pd(count);
+    unsigned int j = 0;
+    for (; j + 8 <= n; j += 8) {
+        __m512d lp = _mm512_loadu_pd(logprob + j);
+        _mm512_storeu_pd(logprob + j, _mm512_add_pd(lp, _mm512_mul_pd(c, _mm512_loadu_pd(row + j))));
+    }
+    scalar_accumulate_f64(logprob + j, row + j, count, n - j);
+}
+
+__attribute__((target("avx512f"))) static void avx512_accumulate_f32(double* logprob, const float* row, double count,
+                                                                      unsigned int n) {
+    __m512d c = _mm512_set1_pd(count);
+    unsigned int j = 0;
+    for (; j + 8 <= n; j += 8) {
+        __m512d lp = _mm512_loadu_pd(logprob + j);
+        _mm512_storeu_pd(logprob + j, _mm512_add_pd(lp, _mm512_mul_pd(c, _mm512_cvtps_pd(_mm256_loadu_ps(row + j)))));
+    }
+    scalar_accumulate_f32(logprob + j, row + j, count, n - j);
+}
+
+__attribute__((target("avx512f"))) static void avx512_accumulate_i16(double* logprob, const int16_t* row,
+                                                                      double count, unsigned int n) {
+    __m512d c = _mm512_set1_pd(count);
+    unsigned int j = 0;
+    for (; j + 8 <= n; j += 8) {
+        __m512d r = _mm512_cvtepi32_pd(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(row + j))));
+        _mm512_storeu_pd(logprob + j, _mm512_add_pd(_mm512_loadu_pd(logprob + j), _mm512_mul_pd(c, r)));
+    }
+    scalar_accumulate_i16(logprob + j, row + j, count, n - j);
+}
+
+__attribute__((target("avx512f"))) static void avx512_accumulate_i8(double* logprob, const int8_t* row, double count,
+                                                                     unsigned int n) {
+    __m512d c = _mm512_set1_pd(count);
+    unsigned int j = 0;
+    for (; j + 8 <= n; j += 8) {
+        __m512d r = _mm512_cvtepi32_pd(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(row + j))));
+        _mm512_storeu_pd(logprob + j, _mm512_add_pd(_mm512_loadu_pd(logprob + j), _mm512_mul_pd(c, r)));
+    }
+    scalar_accumulate_i8(logprob + j, row + j, count, n - j);
+}
+
+__attribute__((target("avx512f"))) static void avx512_accumulate_docs(double* logprob, unsigned int stride,
+                                                                       const unsigned int* docs,
+                                                                       const unsigned int* counts, unsigned int m,
+                                                                       const double* row, unsigned int n) {
+    unsigned int i, j = 0;
+    for (; j + 8 <= n; j += 8) {
+        __m512d r = _mm512_loadu_pd(row + j);
+        for (i = 0; i < m; ++i) {
+            double* lp = logprob + (size_t)docs[i] * stride + j;
+            _mm512_storeu_pd(lp, _mm512_add_pd(_mm512_loadu_pd(lp), _mm512_mul_pd(_mm512_set1_pd(counts[i]), r)));
+        }
+    }
+    for (i = 0; i < m; ++i) {
+        scalar_accumulate_f64(logprob + (size_t)docs[i] * stride + j, row + j, counts[i], n - j);
+    }
+}
+
+__attribute__((target("avx512f"))) static double avx512_max(const double* x, unsigned int n) {
+    __m512d m = _mm512_set1_pd(-INFINITY);
+    double lanes[8];
+    unsigned int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        m = _mm512_max_pd(m, _mm512_loadu_pd(x + i));
+    }
+    _mm512_storeu_pd(lanes, m);
+    double max = scalar_max(lanes, 8);
+    for (; i < n; ++i) {
+        if (x[i] > max) {
+            max = x[i];
+        }
+    }
+    return max;
+}
+
+__attribute__((target("avx512f"))) static __m512d avx512_exp_nonpositive(__m512d x) {
+    __m512d t = _mm512_add_pd(_mm512_mul_pd(x, _mm512_set1_pd(exp_log2e)), _mm512_set1_pd(exp_shift));
+    __m512d n = _mm512_sub_pd(t, _mm512_set1_pd(exp_shift));
+    __m512d r = _mm512_sub_pd(_mm512_sub_pd(x, _mm512_mul_pd(n, _mm512_set1_pd(exp_ln2_hi))),
+                              _mm512_mul_pd(n, _mm512_set1_pd(exp_ln2_lo)));
+
+    __m512d p = _mm512_set1_pd(exp_coeffs[0]);
+    for (unsigned int k = 1; k < EXP_NUM_COEFFS; ++k) {
+        p = _mm512_add_pd(_mm512_mul_pd(p, r), _mm512_set1_pd(exp_coeffs[k]));
+    }
+
+    __m512i bits = _mm512_sub_epi64(_mm512_castpd_si512(t), _mm512_castpd_si512(_mm512_set1_pd(exp_shift)));
+    bits = _mm512_slli_epi64(_mm512_add_epi64(bits, _mm512_set1_epi64(1023)), 52);
+    __m512d result = _mm512_mul_pd(p, _mm512_castsi512_pd(bits));
+
+    return _mm512_maskz_mov_pd(_mm512_cmp_pd_mask(x, _mm512_set1_pd(exp_min), _CMP_GE_OQ), result);
+}
+
+__attribute__((target("avx512f"))) static double avx512_exp_sum(double* x, double max, unsigned int n) {
+    __m512d m = _mm512_set1_pd(max);
+    __m512d sum = _mm512_setzero_pd();
+    double partial[BLOCK];
+    unsigned int i = 0;
+
+    for (; i + BLOCK <= n; i += BLOCK) {
+        __m512d e = avx512_exp_nonpositive(_mm512_sub_pd(_mm512_loadu_pd(x + i), m));
+        _mm512_storeu_pd(x + i, e);
+        sum = _mm512_add_pd(sum, e);
+    }
+    _mm512_storeu_pd(partial, sum);
+    exp_sum_tail(x, max, i, n, partial);
+    return sum_partials(partial);
+}
+
+__attribute__((target("avx512f"))) static void avx512_divide(double* x, double divisor, unsigned int n) {
+    __m512d d = _mm512_set1_pd(divisor);
+    unsigned int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm512_storeu_pd(x + i, _mm512_div_pd(_mm512_loadu_pd(x + i), d));
+    }
+    scalar_divide(x + i, divisor, n - i);
+}
+
+static const Kernels avx512_kernels = {
+    "avx512",   avx512_accumulate_f64, avx512_accumulate_f32, avx512_accumulate_i16, avx512_accumulate_i8,
+    avx512_accumulate_docs, avx512_max, avx512_exp_sum, avx512_divide,
+};
+
+#endif /* KERNELS_X86 */
+
+#ifdef KERNELS_NEON
+
+/* NEON: integer rows are left to the scalar code */
+
+static void neon_accumulate_f64(double* logprob, const double* row, double count, unsigned int n) {
+    float64x2_t c = vdupq_n_f64(count);
+    unsigned int j = 0;
+    for (; j + 2 <= n; j += 2) {
+        vst1q_f64(logprob + j, vaddq_f64(vld1q_f64(logprob + j), vmulq_f64(c, vld1q_f64(row + j))));
+    }
+    scalar_accumulate_f64(logprob + j, row + j, count, n - j);
+}
+
+static void neon_accumulate_f32(double* logprob, const float* row, double count, unsigned int n) {
+    float64x2_t c = vdupq_n_f64(count);
+    unsigned int j = 0;
+    for (; j + 2 <= n; j += 2) {
+        float64x2_t r = vcvt_f64_f32(vld1_f32(row + j));
+        vst1q_f64(logprob + j, vaddq_f64(vld1q_f64(logprob + j), vmulq_f64(c, r)));
+    }
+    scalar_accumulate_f32(logprob + j, row + j, count, n - j);
+}
+
+static void neon_accumulate_docs(double* logprob, unsigned int stride, const unsigned int* docs,
+                                 const unsigned int* counts, unsigned int m, const double* row, unsigned int n) {
+    unsigned int i, j = 0;
+    for (; j + 2 <= n; j += 2) {
+        float64x2_t r = vld1q_f64(row + j);
+        for (i = 0; i < m; ++i) {
+            double* lp = logprob + (size_t)docs[i] * stride + j;
+            vst1q_f64(lp, vaddq_f64(vld1q_f64(lp), vmulq_f64(vdupq_n_f64(counts[i]), r)));
+        }
+    }
+    for (i = 0; i < m; ++i) {
+        scalar_accumulate_f64(logprob + (size_t)docs[i] * stride + j, row + j, counts[i], n - j);
+    }
+}
+
+static double neon_max(const double* x, unsigned int n) {
+    float64x2_t m = vdupq_n_f64(-INFINITY);
+    unsigned int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        m = vmaxq_f64(m, vld1q_f64(x + i));
+    }
+    double max = vmaxvq_f64(m);
+    for (; i < n; ++i) {
+        if (x[i] > max) {
+            max = x[i];
+        }
+    }
+    return max;
+}
+
+static float64x2_t neon_exp_nonpositive(float64x2_t x) {
+    float64x2_t t = vaddq_f64(vmulq_f64(x, vdupq_n_f64(exp_log2e)), vdupq_n_f64(exp_shift));
+    float64x2_t n = vsubq_f64(t, vdupq_n_f64(exp_shift));
+    float64x2_t r =
+        vsubq_f64(vsubq_f64(x, vmulq_f64(n, vdupq_n_f64(exp_ln2_hi))), vmulq_f64(n, vdupq_n_f64(exp_ln2_lo)));
+
+    float64x2_t p = vdupq_n_f64(exp_coeffs[0]);
+    for (unsigned int k = 1; k < EXP_NUM_COEFFS; ++k) {
+        p = vaddq_f64(vmulq_f64(p, r), vdupq_n_f64(exp_coeffs[k]));
+    }
+
+    int64x2_t bits = vsubq_s64(vreinterpretq_s64_f64(t), vreinterpretq_s64_f64(vdupq_n_f64(exp_shift)));
+    bits = vshlq_n_s64(vaddq_s64(bits, vdupq_n_s64(1023)), 52);
+    float64x2_t result = vmulq_f64(p, vreinterpretq_f64_s64(bits));
+
+    uint64x2_t in_range = vcgeq_f64(x, vdupq_n_f64(exp_min));
+    return vreinterpretq_f64_u64(vandq_u64(vreinterpretq_u64_f64(result), in_range));
+}
+
+static double neon_exp_sum(double* x, double max, unsigned int n) {
+    float64x2_t m = vdupq_n_f64(max);
+    float64x2_t sums[BLOCK / 2];
+    double partial[BLOCK];
+    unsigned int i = 0, k;
+
+    for (k = 0; k < BLOCK / 2; ++k) {
+        sums[k] = vdupq_n_f64(0.0);
+    }
+    for (; i + BLOCK <= n; i += BLOCK) {
+        for (k = 0; k < BLOCK / 2; ++k) {
+            float64x2_t e = neon_exp_nonpositive(vsubq_f64(vld1q_f64(x + i + 2 * k), m));
+            vst1q_f64(x + i + 2 * k, e);
+            sums[k] = vaddq_f64(sums[k], e);
+        }
+    }
+    for (k = 0; k < BLOCK / 2; ++k) {
+        vst1q_f64(partial + 2 * k, sums[k]);
+    }
+    exp_sum_tail(x, max, i, n, partial);
+    return sum_partials(partial);
+}
+
+static void neon_divide(double* x, double divisor, unsigned int n) {
+    float64x2_t d = vdupq_n_f64(divisor);
+    unsigned int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        vst1q_f64(x + i, vdivq_f64(vld1q_f64(x + i), d));
+    }
+    scalar_divide(x + i, divisor, n - i);
+}
+
+static const Kernels neon_kernels = {
+    "neon",   neon_accumulate_f64, neon_accumulate_f32, scalar_accumulate_i16, scalar_accumulate_i8,
+    neon_accumulate_docs, neon_max, neon_exp_sum, neon_divide,
+};
+
+#endif /* KERNELS_NEON */
+
+const Kernels* select_kernels(void) {
+    const Kernels* supported[4];
+    unsigned int num_supported = 0;
+    const char* requested = getenv("LANGID_KERNELS");
+
+    /* widest first */
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        supported[num_supported++] = &avx512_kernels;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        supported[num_supported++] = &avx2_kernels;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        supported[num_supported++] = &sse2_kernels;
+    }
+#endif
+#ifdef KERNELS_NEON
+    supported[num_supported++] = &neon_kernels;
+#endif
+    supported[num_supported++] = &scalar_kernels;
+
+    if (requested != NULL) {
+        for (unsigned int i = 0; i < num_supported; ++i) {
+            if (strcmp(supported[i]->name, requested) == 0) {
+                return supported[i];
+            }
+        }
+    }
+    return supported[0];
+}
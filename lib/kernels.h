@@ -0,0 +1,36 @@
+#ifndef _KERNELS_H
+#define _KERNELS_H
+
+#include <stdint.h>
+
+/* Vector kernels for the hot loops of the classifier. Every implementation
+ * performs the same floating point operations in the same order, so that
+ * all of them give bit-identical results to the scalar one.
+ */
+typedef struct {
+    const char* name;
+
+    /* logprob[j] += count * row[j] for j < n */
+    void (*accumulate_f64)(double* logprob, const double* row, double count, unsigned int n);
+    void (*accumulate_f32)(double* logprob, const float* row, double count, unsigned int n);
+    void (*accumulate_i16)(double* logprob, const int16_t* row, double count, unsigned int n);
+    void (*accumulate_i8)(double* logprob, const int8_t* row, double count, unsigned int n);
+    /* logprob[docs[i] * stride + j] += counts[i] * row[j] for i < m, j < n */
+    void (*accumulate_docs)(double* logprob, unsigned int stride, const unsigned int* docs,
+                            const unsigned int* counts, unsigned int m, const double* row, unsigned int n);
+
+    /* largest of x[0..n) */
+    double (*max)(const double* x, unsigned int n);
+    /* x[i] = exp(x[i] - max) (0 for -INFINITY), returns the sum of the results */
+    double (*exp_sum)(double* x, double max, unsigned int n);
+    /* x[i] /= divisor */
+    void (*divide)(double* x, double divisor, unsigned int n);
+} Kernels;
+
+/* Picks the widest kernels supported by the cpu. The LANGID_KERNELS
+ * environment variable may name a narrower one (scalar, sse2, avx2,
+ * avx512 or neon) to compare them.
+ */
+extern const Kernels* select_kernels(void);
+
+#endif
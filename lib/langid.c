@@ -4,8 +4,11 @@
  * Marco Lui <saffsd@gmail.com>, September 2014
  */
 #include "liblangid.h"
+#include "threadpool.h"
 #include <ctype.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,29 +19,314 @@ const char* no_file = "NOSUCHFILE";
 const char* not_file = "NOTAFILE";
 const char* default_model_path = "../ldpy3.pmodel";
 
-int main(int argc, char** argv) {
+/* file mode reads stdin in chunks, stopping once the prefix read so far is
+ * conclusive unless -a asks for the whole input
+ */
+#define FILE_CHUNK_SIZE 65536
+const StreamStopPolicy file_stop_policy = {
+    .min_bytes = FILE_CHUNK_SIZE,
+    .check_interval = FILE_CHUNK_SIZE,
+    .min_confidence = 0.9999,
+    .min_margin = 2.0,
+};
+
+/* Line and batch modes run as a pipeline: the main thread reads blocks of
+ * input lines, a pool of workers classifies them and a writer thread prints
+ * the blocks back in input order. At most PIPELINE_BLOCKS_PER_WORKER blocks
+ * per worker are in flight, which bounds memory use.
+ */
+#define PIPELINE_BLOCK_BYTES (1 << 20)
+#define PIPELINE_LINE_ITEMS 4096
+#define PIPELINE_BATCH_ITEMS 16
+#define PIPELINE_BLOCKS_PER_WORKER 4
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+typedef enum { BLOCK_FREE, BLOCK_READ, BLOCK_DONE } BlockStatus;
+
+typedef struct {
+    BlockStatus status;
+
+    /* items of the block back to back, ends[i] is the end of item i */
+    char* input;
+    size_t input_len, input_size;
+    size_t* ends;
+    unsigned int num_items;
+
+    char* output;
+    size_t output_len, output_size;
+} Block;
+
+typedef struct {
+    const LanguageIdentifier* lid;
+    int batch_mode, print_confidence;
+
+    Block* blocks;
+    unsigned int num_blocks;
+    /* sequence numbers of the next block to read, classify and write */
+    size_t next_read, next_work, next_write;
+    int eof;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} Pipeline;
+
+static void* grow(void* buf, size_t* size, size_t needed) {
+    if (needed <= *size) {
+        return buf;
+    }
+    while (*size < needed) {
+        *size = *size ? 2 * *size : 4096;
+    }
+    if ((buf = realloc(buf, *size)) == NULL) {
+        fprintf(stderr, "Memory allocation failed for the pipeline\n");
+        exit(-1);
+    }
+    return buf;
+}
+
+static void block_printf(Block* block, const char* format, ...) {
+    va_list args;
+    int len;
+
+    for (;;) {
+        va_start(args, format);
+        len = vsnprintf(block->output + block->output_len, block->output_size - block->output_len, format, args);
+        va_end(args);
+        if (block->output_len + len < block->output_size) {
+            break;
+        }
+        block->output = grow(block->output, &block->output_size, block->output_len + len + 1);
+    }
+    block->output_len += len;
+}
+
+static void classify_block(Pipeline* pipeline, LanguageIdentifierContext* ctx, Block* block) {
+    LanguageConfidence language_confidence;
     const char* lang;
+    size_t start = 0, textlen;
+    const char* text;
+    off_t file_len;
+    int fd;
+
+    block->output_len = 0;
+    for (unsigned int i = 0; i < block->num_items; start = block->ends[i++]) {
+        char* item = block->input + start;
+
+        if (!pipeline->batch_mode) {
+            textlen = block->ends[i] - start;
+            language_confidence = classify_r(pipeline->lid, ctx, item, textlen);
+            block_printf(block, "%s,%zu", language_confidence.language, textlen);
+        } else {
+            /* items are NUL-terminated paths */
+            textlen = 0;
+            language_confidence.confidence = 0;
+            if ((fd = open(item, O_RDONLY)) == -1) {
+                lang = no_file;
+            } else {
+                file_len = lseek(fd, 0, SEEK_END);
+                textlen = file_len > 0 ? file_len : 0;
+                text = textlen ? mmap(NULL, textlen, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+                if (file_len < 0 || text == MAP_FAILED) {
+                    lang = not_file;
+                    textlen = 0;
+                } else {
+                    language_confidence = classify_r(pipeline->lid, ctx, text, textlen);
+                    lang = language_confidence.language;
+                    if (textlen && munmap((void*)text, textlen) == -1) {
+                        fprintf(stderr, "failed to munmap %s of length %zu \n", item, textlen);
+                        exit(-1);
+                    }
+                }
+                close(fd);
+            }
+            block_printf(block, "%s,%zu,%s", item, textlen, lang);
+        }
+
+        if (pipeline->print_confidence) {
+            block_printf(block, ",%.6f", language_confidence.confidence);
+        }
+        block_printf(block, "\n");
+    }
+}
+
+static void* pipeline_worker(void* arg) {
+    Pipeline* pipeline = (Pipeline*)arg;
+    LanguageIdentifierContext* ctx;
+    Block* block;
+
+    if ((ctx = alloc_context(pipeline->lid)) == NULL) {
+        fprintf(stderr, "Memory allocation failed for context\n");
+        exit(-1);
+    }
+
+    pthread_mutex_lock(&pipeline->lock);
+    for (;;) {
+        while (pipeline->next_work == pipeline->next_read && !pipeline->eof) {
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+        }
+        if (pipeline->next_work == pipeline->next_read) {
+            break;
+        }
+        block = &pipeline->blocks[pipeline->next_work++ % pipeline->num_blocks];
+        pthread_mutex_unlock(&pipeline->lock);
+
+        classify_block(pipeline, ctx, block);
+
+        pthread_mutex_lock(&pipeline->lock);
+        block->status = BLOCK_DONE;
+        pthread_cond_broadcast(&pipeline->changed);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+
+    free_context(ctx);
+    return NULL;
+}
+
+static void* pipeline_writer(void* arg) {
+    Pipeline* pipeline = (Pipeline*)arg;
+    Block* block;
+
+    pthread_mutex_lock(&pipeline->lock);
+    for (;;) {
+        block = &pipeline->blocks[pipeline->next_write % pipeline->num_blocks];
+        while (!(pipeline->next_write < pipeline->next_read && block->status == BLOCK_DONE) &&
+               !(pipeline->eof && pipeline->next_write == pipeline->next_read)) {
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+        }
+        if (pipeline->next_write == pipeline->next_read) {
+            break;
+        }
+        pthread_mutex_unlock(&pipeline->lock);
+
+        fwrite(block->output, 1, block->output_len, stdout);
+
+        pthread_mutex_lock(&pipeline->lock);
+        block->status = BLOCK_FREE;
+        pipeline->next_write++;
+        pthread_cond_broadcast(&pipeline->changed);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+
+    fflush(stdout);
+    return NULL;
+}
+
+/* Hand the block being filled over to the workers */
+static void publish_block(Pipeline* pipeline) {
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->blocks[pipeline->next_read % pipeline->num_blocks].status = BLOCK_READ;
+    pipeline->next_read++;
+    pthread_cond_broadcast(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+static void run_pipeline(const LanguageIdentifier* lid, int batch_mode, int print_confidence,
+                         unsigned int num_workers) {
+    Pipeline pipeline = {.lid = lid, .batch_mode = batch_mode, .print_confidence = print_confidence};
+    unsigned int i, max_items = batch_mode ? PIPELINE_BATCH_ITEMS : PIPELINE_LINE_ITEMS;
+    pthread_t workers[num_workers], writer;
+    size_t line_size = 0;
+    ssize_t linelen;
+    char* line = NULL;
+    Block* block = NULL;
+
+    pipeline.num_blocks = num_workers * PIPELINE_BLOCKS_PER_WORKER;
+    if ((pipeline.blocks = (Block*)calloc(pipeline.num_blocks, sizeof(Block))) == NULL) {
+        fprintf(stderr, "Memory allocation failed for the pipeline\n");
+        exit(-1);
+    }
+    for (i = 0; i < pipeline.num_blocks; ++i) {
+        pipeline.blocks[i].ends = (size_t*)malloc(max_items * sizeof(size_t));
+        if (pipeline.blocks[i].ends == NULL) {
+            fprintf(stderr, "Memory allocation failed for the pipeline\n");
+            exit(-1);
+        }
+    }
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.changed, NULL);
+
+    setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    for (i = 0; i < num_workers; ++i) {
+        pthread_create(&workers[i], NULL, pipeline_worker, &pipeline);
+    }
+    pthread_create(&writer, NULL, pipeline_writer, &pipeline);
+
+    while ((linelen = getline(&line, &line_size, stdin)) != -1) {
+        if (block == NULL) {
+            /* wait for the writer to be done with the slot */
+            block = &pipeline.blocks[pipeline.next_read % pipeline.num_blocks];
+            pthread_mutex_lock(&pipeline.lock);
+            while (block->status != BLOCK_FREE) {
+                pthread_cond_wait(&pipeline.changed, &pipeline.lock);
+            }
+            pthread_mutex_unlock(&pipeline.lock);
+            block->input_len = 0;
+            block->num_items = 0;
+        }
+
+        /* lines are classified with their newline, paths without it */
+        if (batch_mode && line[linelen - 1] == '\n') {
+            line[--linelen] = '\0';
+        }
+        block->input = grow(block->input, &block->input_size, block->input_len + linelen + 1);
+        memcpy(block->input + block->input_len, line, linelen + 1);
+        block->input_len += linelen + batch_mode;
+        block->ends[block->num_items++] = block->input_len;
+
+        if (block->num_items == max_items || block->input_len >= PIPELINE_BLOCK_BYTES) {
+            publish_block(&pipeline);
+            block = NULL;
+        }
+    }
+    if (block != NULL) {
+        publish_block(&pipeline);
+    }
+
+    pthread_mutex_lock(&pipeline.lock);
+    pipeline.eof = 1;
+    pthread_cond_broadcast(&pipeline.changed);
+    pthread_mutex_unlock(&pipeline.lock);
+
+    for (i = 0; i < num_workers; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_join(writer, NULL);
+
+    for (i = 0; i < pipeline.num_blocks; ++i) {
+        free(pipeline.blocks[i].input);
+        free(pipeline.blocks[i].ends);
+        free(pipeline.blocks[i].output);
+    }
+    free(pipeline.blocks);
+    free(line);
+    pthread_cond_destroy(&pipeline.changed);
+    pthread_mutex_destroy(&pipeline.lock);
+}
+
+int main(int argc, char** argv) {
     LanguageConfidence language_confidence;
-    size_t path_size = 4096, text_size = 4096;
-    ssize_t pathlen, textlen;
-    char *path = NULL, *text = NULL; /* NULL init required for use with getline/getdelim*/
+    size_t text_size = 4096;
+    ssize_t textlen;
+    char* text = NULL; /* NULL init required for use with getline/getdelim*/
     LanguageIdentifier* lid;
-
-    /* for use while accessing files through mmap*/
-    int fd;
+    LanguageIdentifierStream* stream;
+    size_t chunk_len;
 
     /* for use with getopt */
     char* model_path = NULL;
-    int c, l_flag = 0, b_flag = 0;
+    int c, l_flag = 0, b_flag = 0, a_flag = 0, c_flag = 0, num_workers = 1;
     opterr = 0;
 
     /* valid options are:
      * l: line-mode
      * b: batch-mode
+     * j: number of worker threads in line and batch modes, 0 for one per cpu
+     * c: print the confidence in line and batch modes
+     * a: read all of the input in file-mode
      * m: load a model file
      */
 
-    while ((c = getopt(argc, argv, "lbm:")) != -1)
+    while ((c = getopt(argc, argv, "lbj:cam:")) != -1)
         switch (c) {
         case 'l':
             l_flag = 1;
@@ -46,11 +334,27 @@ int main(int argc, char** argv) {
         case 'b':
             b_flag = 1;
             break;
+        case 'j':
+            num_workers = atoi(optarg);
+            if (num_workers < 0) {
+                fprintf(stderr, "Option -j requires a non-negative number of threads.\n");
+                return 1;
+            }
+            if (num_workers == 0) {
+                num_workers = num_cpus();
+            }
+            break;
+        case 'c':
+            c_flag = 1;
+            break;
+        case 'a':
+            a_flag = 1;
+            break;
         case 'm':
             model_path = optarg;
             break;
         case '?':
-            if (optopt == 'm')
+            if (optopt == 'm' || optopt == 'j')
                 fprintf(stderr, "Option -%c requires an argument.\n", optopt);
             else if (isprint(optopt))
                 fprintf(stderr, "Unknown option `-%c'.\n", optopt);
@@ -68,7 +372,14 @@ int main(int argc, char** argv) {
     }
 
     /* load an identifier */
-    lid = model_path ? load_identifier(model_path) : load_identifier(default_model_path);
+    if (model_path != NULL) {
+        lid = load_identifier(model_path);
+    } else if ((lid = get_default_identifier()) == NULL) {
+        lid = load_identifier(default_model_path);
+    }
+    if (lid == NULL) {
+        exit(-1);
+    }
 
     /* enter appropriate operating mode.
      * we have an interactive mode determined by isatty, and then
@@ -89,46 +400,25 @@ int main(int argc, char** argv) {
 
         printf("Bye!\n");
 
-    } else if (l_flag) { /*line mode*/
+    } else if (l_flag || b_flag) { /*line mode and batch mode, where each line is a path*/
 
-        while ((textlen = getline(&text, &text_size, stdin)) != -1) {
-            language_confidence = classify(lid, text, textlen);
-            printf("%s,%zd\n", language_confidence.language, textlen);
-        }
-
-    } else if (b_flag) { /*batch mode*/
+        run_pipeline(lid, b_flag, c_flag, num_workers);
 
-        /* loop on stdin, interpreting each line as a path */
-        while ((pathlen = getline(&path, &path_size, stdin)) != -1) {
-            path[pathlen - 1] = '\0';
-            /* TODO: ensure that path is a real file.
-         * the main issue is with directories I think, no problem reading from a pipe or socket
-         * presumably. Anything that returns data should be fair game.*/
-            if ((fd = open(path, O_RDONLY)) == -1) {
-                lang = no_file;
-            } else {
-                textlen = lseek(fd, 0, SEEK_END);
-                text = (char*)mmap(NULL, textlen, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-                language_confidence = classify(lid, text, textlen);
-                lang = language_confidence.language;
-
-                /* no need to munmap if textlen is 0 */
-                if (textlen && (munmap(text, textlen) == -1)) {
-                    fprintf(stderr, "failed to munmap %s of length %zd \n", path, textlen);
-                    exit(-1);
-                }
+    } else { /*file mode*/
 
-                close(fd);
-            }
-            printf("%s,%zd,%s\n", path, textlen, lang);
+        /* process stdin as a single file, reporting how much of it was read */
+        if ((text = (char*)malloc(FILE_CHUNK_SIZE)) == NULL || (stream = alloc_stream(lid)) == NULL) {
+            fprintf(stderr, "Memory allocation failed for the input stream\n");
+            exit(-1);
         }
+        stream_begin(stream, a_flag ? NULL : &file_stop_policy);
 
-    } else { /*file mode*/
+        while ((chunk_len = fread(text, 1, FILE_CHUNK_SIZE, stdin)) > 0 && !stream_feed(stream, text, chunk_len))
+            ;
 
-        /* read all of stdin and process as a single file */
-        textlen = getdelim(&text, &text_size, EOF, stdin);
-        language_confidence = classify(lid, text, textlen);
-        printf("%s,%zd\n", language_confidence.language, textlen);
+        language_confidence = stream_result(stream);
+        printf("%s,%zu\n", language_confidence.language, stream->num_bytes);
+        free_stream(stream);
         free(text);
     }
 
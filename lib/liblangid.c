@@ -7,252 +7,2371 @@
  */
 
 #include "liblangid.h"
+#ifdef LANGID_DEFAULT_MODEL
+#include "defaultmodel.h"
+#endif
+#include "flatmodel.h"
 #include "langid.pb-c.h"
+#include "resultcache.h"
 #include "sparseset.h"
+#include "threadpool.h"
 #include <fcntl.h>
 #include <float.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 
-LanguageIdentifier* load_identifier(const char* model_path) {
+static const size_t nb_ptc_element_size[] = {
+    [NB_PTC_F64] = sizeof(double),
+    [NB_PTC_F32] = sizeof(float),
+    [NB_PTC_I16] = sizeof(int16_t),
+    [NB_PTC_I8] = sizeof(int8_t),
+};
+
+static bool same_transitions(const uint32_t* nextmove, unsigned int num_states, unsigned int a, unsigned int b) {
+    for (size_t s = 0; s < num_states; ++s) {
+        if (nextmove[s * 256 + a] != nextmove[s * 256 + b]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Checks that the features of every state are within tk_output and are
+ * features of the model, as the tokenizer adds them to fv unchecked.
+ */
+static bool valid_tk_output(const uint32_t* tk_output_c, const uint32_t* tk_output_s, const uint32_t* tk_output,
+                            size_t output_len, uint32_t num_states, uint32_t num_feats) {
+    for (uint32_t i = 0; i < num_states; ++i) {
+        if ((uint64_t)tk_output_s[i] + tk_output_c[i] > output_len) {
+            return false;
+        }
+        for (uint32_t j = 0; j < tk_output_c[i]; ++j) {
+            if (tk_output[tk_output_s[i] + j] >= num_feats) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/* Builds the byte equivalence classes and the narrowed transition table of
+ * the tokenizer from a full [num_states][256] transition table.
+ */
+static int build_compact_dfa(LanguageIdentifier* lid, const uint32_t* nextmove) {
+    uint64_t hash[256];
+    unsigned int representative[256];
+    unsigned int b, c, num_classes = 0;
+    size_t s;
+
+    /* hash the column of every byte so that only likely equal columns are compared */
+    for (b = 0; b < 256; ++b) {
+        hash[b] = 14695981039346656037ULL;
+    }
+    for (s = 0; s < lid->num_states; ++s) {
+        for (b = 0; b < 256; ++b) {
+            if (nextmove[s * 256 + b] >= lid->num_states) {
+                fprintf(stderr, "Transition to unknown state %u in tk_nextmove\n", nextmove[s * 256 + b]);
+                return -1;
+            }
+            hash[b] = (hash[b] ^ nextmove[s * 256 + b]) * 1099511628211ULL;
+        }
+    }
+
+    for (b = 0; b < 256; ++b) {
+        for (c = 0; c < num_classes; ++c) {
+            if (hash[representative[c]] == hash[b] && same_transitions(nextmove, lid->num_states, representative[c], b)) {
+                break;
+            }
+        }
+        if (c == num_classes) {
+            representative[num_classes++] = b;
+        }
+        lid->tk_byte_class[b] = c;
+    }
+
+    lid->tk_num_classes = num_classes;
+    lid->tk_state_size = lid->num_states <= UINT16_MAX + 1 ? sizeof(uint16_t) : sizeof(uint32_t);
+    lid->tk_transitions_buf = malloc((size_t)lid->num_states * num_classes * lid->tk_state_size);
+    if (lid->tk_transitions_buf == NULL) {
+        fprintf(stderr, "Memory allocation failed for tk_transitions\n");
+        return -1;
+    }
+
+    for (s = 0; s < lid->num_states; ++s) {
+        for (c = 0; c < num_classes; ++c) {
+            uint32_t next = nextmove[s * 256 + representative[c]];
+            if (lid->tk_state_size == sizeof(uint16_t)) {
+                ((uint16_t*)lid->tk_transitions_buf)[s * num_classes + c] = next;
+            } else {
+                ((uint32_t*)lid->tk_transitions_buf)[s * num_classes + c] = next;
+            }
+        }
+    }
+    lid->tk_transitions = lid->tk_transitions_buf;
+
+    return 0;
+}
+
+/* Classifier tables for the languages of a mask. A strict subset gets its
+ * own copy of the nb_pc and nb_ptc columns of its languages, so that
+ * scoring only goes through num_langs columns; the full set points to the
+ * model tables.
+ */
+struct LanguageSubset {
+    unsigned int num_langs;
+    /* indices in nb_classes: the languages of the subset, then the others */
+    unsigned int* langs;
+
+    const double* nb_pc;
+    const void* nb_ptc; /* [num_feats][num_langs] in the nb_ptc_encoding of the model */
+    const double* nb_ptc_scale;
+    bool compacted;
+
+    /* [num_state_rows][num_langs] sums of the unscaled nb_ptc rows of the
+     * outputs of each state, NULL without state posteriors
+     */
+    const double* state_ptc;
+
+    /* unique to each subset ever made, tags its entries in the result cache */
+    uint64_t generation;
+
+    atomic_uint refs;
+};
+
+static atomic_ullong subset_generations = 0;
+
+static void free_subset(LanguageSubset* subset) {
+    if (subset->compacted) {
+        free((void*)subset->nb_pc);
+        free((void*)subset->nb_ptc);
+        free((void*)subset->nb_ptc_scale);
+    }
+    free((void*)subset->state_ptc);
+    free(subset->langs);
+    free(subset);
+}
+
+static double nb_ptc_element(NbPtcEncoding encoding, const void* nb_ptc, size_t i) {
+    switch (encoding) {
+    case NB_PTC_F64:
+        return ((const double*)nb_ptc)[i];
+    case NB_PTC_F32:
+        return ((const float*)nb_ptc)[i];
+    case NB_PTC_I16:
+        return ((const int16_t*)nb_ptc)[i];
+    case NB_PTC_I8:
+        return ((const int8_t*)nb_ptc)[i];
+    }
+    return 0;
+}
+
+/* Sum the nb_ptc rows of the outputs of every state with a row */
+static double* build_state_ptc(const LanguageIdentifier* lid, const LanguageSubset* subset) {
+    unsigned int k = subset->num_langs, s, j, f;
+    double* state_ptc = (double*)calloc((size_t)lid->num_state_rows * k + 1, sizeof(double));
+
+    if (state_ptc == NULL) {
+        fprintf(stderr, "Memory allocation failed for state posteriors\n");
+        return NULL;
+    }
+
+    for (s = 0; s < lid->num_states; ++s) {
+        if (lid->tk_state_row[s] == STATE_ROW_NONE) {
+            continue;
+        }
+        double* row = state_ptc + (size_t)lid->tk_state_row[s] * k;
+        for (j = 0; j < (*lid->tk_output_c)[s]; ++j) {
+            size_t feat_row = (size_t)(*lid->tk_output)[(*lid->tk_output_s)[s] + j] * k;
+            for (f = 0; f < k; ++f) {
+                row[f] += nb_ptc_element(lid->nb_ptc_encoding, subset->nb_ptc, feat_row + f);
+            }
+        }
+    }
+    return state_ptc;
+}
+
+static LanguageSubset* alloc_subset(const LanguageIdentifier* lid, const bool mask[]) {
+    LanguageSubset* subset;
+    size_t element_size = nb_ptc_element_size[lid->nb_ptc_encoding];
+    unsigned int i, j, k = 0;
+
+    if ((subset = (LanguageSubset*)malloc(sizeof(LanguageSubset))) == NULL ||
+        (subset->langs = (unsigned int*)malloc(sizeof(unsigned int) * lid->num_langs)) == NULL) {
+        free(subset);
+        fprintf(stderr, "Memory allocation failed for language subset\n");
+        return NULL;
+    }
+    atomic_init(&subset->refs, 1);
+    subset->state_ptc = NULL;
+    subset->generation = atomic_fetch_add_explicit(&subset_generations, 1, memory_order_relaxed);
+
+    for (i = 0; i < lid->num_langs; ++i) {
+        if (mask[i]) {
+            subset->langs[k++] = i;
+        }
+    }
+    subset->num_langs = k;
+    for (i = 0; i < lid->num_langs; ++i) {
+        if (!mask[i]) {
+            subset->langs[k++] = i;
+        }
+    }
+
+    if (subset->num_langs == lid->num_langs) {
+        subset->nb_pc = *lid->nb_pc;
+        subset->nb_ptc = lid->nb_ptc;
+        subset->nb_ptc_scale = lid->nb_ptc_scale != NULL ? *lid->nb_ptc_scale : NULL;
+        subset->compacted = false;
+        goto state_posteriors;
+    }
+
+    k = subset->num_langs;
+    double* nb_pc = (double*)malloc(sizeof(double) * (k + 1));
+    char* nb_ptc = (char*)malloc(element_size * lid->num_feats * k + 1);
+    double* nb_ptc_scale = lid->nb_ptc_scale != NULL ? (double*)malloc(sizeof(double) * (k + 1)) : NULL;
+
+    subset->nb_pc = nb_pc;
+    subset->nb_ptc = nb_ptc;
+    subset->nb_ptc_scale = nb_ptc_scale;
+    subset->compacted = true;
+
+    if (nb_pc == NULL || nb_ptc == NULL || (lid->nb_ptc_scale != NULL && nb_ptc_scale == NULL)) {
+        free_subset(subset);
+        fprintf(stderr, "Memory allocation failed for language subset\n");
+        return NULL;
+    }
+
+    for (j = 0; j < k; ++j) {
+        nb_pc[j] = (*lid->nb_pc)[subset->langs[j]];
+        if (nb_ptc_scale != NULL) {
+            nb_ptc_scale[j] = (*lid->nb_ptc_scale)[subset->langs[j]];
+        }
+    }
+
+    const char* row = (const char*)lid->nb_ptc;
+    for (i = 0; i < lid->num_feats; ++i, row += element_size * lid->num_langs) {
+        for (j = 0; j < k; ++j) {
+            memcpy(nb_ptc, row + element_size * subset->langs[j], element_size);
+            nb_ptc += element_size;
+        }
+    }
+
+state_posteriors:
+    if (lid->state_posteriors && (subset->state_ptc = build_state_ptc(lid, subset)) == NULL) {
+        free_subset(subset);
+        return NULL;
+    }
+    return subset;
+}
+
+/* Takes a reference to the current subset of languages, so that a
+ * concurrent set_languages cannot free it while it is in use.
+ */
+static LanguageSubset* acquire_subset(const LanguageIdentifier* lid) {
+    pthread_mutex_t* lock = (pthread_mutex_t*)&lid->subset_lock;
+    LanguageSubset* subset;
+
+    pthread_mutex_lock(lock);
+    subset = atomic_load_explicit(&lid->subset, memory_order_relaxed);
+    atomic_fetch_add_explicit(&subset->refs, 1, memory_order_relaxed);
+    pthread_mutex_unlock(lock);
+
+    return subset;
+}
+
+static void release_subset(LanguageSubset* subset) {
+    if (atomic_fetch_sub_explicit(&subset->refs, 1, memory_order_acq_rel) == 1) {
+        free_subset(subset);
+    }
+}
+
+/* The current subset of languages, through the reference ctx keeps to the
+ * one it last used: unless set_languages replaced it since, this only reads
+ * lid->subset. The reference keeps the subset of ctx from being freed, so
+ * no new subset can take its address.
+ */
+static const LanguageSubset* context_subset(const LanguageIdentifier* lid, LanguageIdentifierContext* ctx) {
+    if (atomic_load_explicit(&lid->subset, memory_order_acquire) != ctx->subset) {
+        if (ctx->subset != NULL) {
+            release_subset(ctx->subset);
+        }
+        ctx->subset = acquire_subset(lid);
+    }
+    return ctx->subset;
+}
+
+/* Counters behind get_stats. Only updated while enabled, from any number
+ * of threads at once.
+ */
+struct LanguageIdentifierCounters {
+    atomic_bool enabled;
+    atomic_ullong calls;
+    atomic_ullong bytes;
+    atomic_ullong cache_hits;
+    atomic_ullong sv_members[STATS_HISTOGRAM_BUCKETS];
+    atomic_ullong fv_members[STATS_HISTOGRAM_BUCKETS];
+    atomic_ullong stage_cycles[STATS_NUM_STAGES];
+
+    /* cycle counter and clock when the counters were last reset, to turn cycles into seconds */
+    pthread_mutex_t lock;
+    uint64_t reset_cycles;
+    double reset_ns;
+};
+
+const char* const stats_stage_names[STATS_NUM_STAGES] = {"text_to_sv", "sv_to_fv", "fv_to_logprob",
+                                                         "logprob_to_prob"};
+
+/* Cycle counter of the cpu where there is one, nanoseconds otherwise */
+static inline uint64_t read_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t cycles;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(cycles));
+    return cycles;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static double monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* bucket 0 counts 0, bucket i > 0 counts [2^(i-1), 2^i), the last one everything above */
+static unsigned int histogram_bucket(unsigned int value) {
+    unsigned int bucket = 0;
+
+    while (value > 0 && bucket < STATS_HISTOGRAM_BUCKETS - 1) {
+        value >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+void set_stats_enabled(LanguageIdentifier* lid, bool enabled) {
+    atomic_store_explicit(&lid->counters->enabled, enabled, memory_order_relaxed);
+}
+
+void reset_stats(LanguageIdentifier* lid) {
+    LanguageIdentifierCounters* counters = lid->counters;
+    unsigned int i;
+
+    pthread_mutex_lock(&counters->lock);
+    atomic_store_explicit(&counters->calls, 0, memory_order_relaxed);
+    atomic_store_explicit(&counters->bytes, 0, memory_order_relaxed);
+    atomic_store_explicit(&counters->cache_hits, 0, memory_order_relaxed);
+    for (i = 0; i < STATS_HISTOGRAM_BUCKETS; ++i) {
+        atomic_store_explicit(&counters->sv_members[i], 0, memory_order_relaxed);
+        atomic_store_explicit(&counters->fv_members[i], 0, memory_order_relaxed);
+    }
+    for (i = 0; i < STATS_NUM_STAGES; ++i) {
+        atomic_store_explicit(&counters->stage_cycles[i], 0, memory_order_relaxed);
+    }
+    counters->reset_cycles = read_cycles();
+    counters->reset_ns = monotonic_ns();
+    pthread_mutex_unlock(&counters->lock);
+}
+
+void get_stats(const LanguageIdentifier* lid, LanguageIdentifierStats* stats) {
+    LanguageIdentifierCounters* counters = lid->counters;
+    unsigned int i;
+
+    stats->enabled = atomic_load_explicit(&counters->enabled, memory_order_relaxed);
+    stats->calls = atomic_load_explicit(&counters->calls, memory_order_relaxed);
+    stats->bytes = atomic_load_explicit(&counters->bytes, memory_order_relaxed);
+    stats->cache_hits = atomic_load_explicit(&counters->cache_hits, memory_order_relaxed);
+    for (i = 0; i < STATS_HISTOGRAM_BUCKETS; ++i) {
+        stats->sv_members[i] = atomic_load_explicit(&counters->sv_members[i], memory_order_relaxed);
+        stats->fv_members[i] = atomic_load_explicit(&counters->fv_members[i], memory_order_relaxed);
+    }
+    for (i = 0; i < STATS_NUM_STAGES; ++i) {
+        stats->stage_cycles[i] = atomic_load_explicit(&counters->stage_cycles[i], memory_order_relaxed);
+    }
+
+    pthread_mutex_lock(&counters->lock);
+    uint64_t cycles = read_cycles() - counters->reset_cycles;
+    double ns = monotonic_ns() - counters->reset_ns;
+    pthread_mutex_unlock(&counters->lock);
+    stats->cycles_per_second = ns > 0 ? cycles / ns * 1e9 : 0;
+}
+
+/* Sets up the mutable state of an identifier whose tables are in place */
+static int init_identifier(LanguageIdentifier* lid) {
+    lid->state_posteriors = false;
+    lid->num_state_rows = 0;
+    lid->tk_state_row = NULL;
+
+    lid->kernels = select_kernels();
+    lid->context = alloc_context(lid);
+    lid->nb_classes_mask = malloc(sizeof(bool) * lid->num_langs);
+
+    if (lid->context == NULL || lid->nb_classes_mask == NULL) {
+        fprintf(stderr, "Memory allocation failed for language_mask or context\n");
+        free(lid->nb_classes_mask);
+        free_context(lid->context);
+        return -1;
+    }
+
+    for (size_t i = 0; i < lid->num_langs; ++i) {
+        lid->nb_classes_mask[i] = true;
+    }
+
+    if ((lid->subset = alloc_subset(lid, lid->nb_classes_mask)) == NULL) {
+        free(lid->nb_classes_mask);
+        free_context(lid->context);
+        return -1;
+    }
+    pthread_mutex_init(&lid->subset_lock, NULL);
+
+    if ((lid->counters = (LanguageIdentifierCounters*)malloc(sizeof(LanguageIdentifierCounters))) == NULL) {
+        fprintf(stderr, "Memory allocation failed for counters\n");
+        release_subset(lid->subset);
+        pthread_mutex_destroy(&lid->subset_lock);
+        free(lid->nb_classes_mask);
+        free_context(lid->context);
+        return -1;
+    }
+    atomic_init(&lid->counters->enabled, false);
+    pthread_mutex_init(&lid->counters->lock, NULL);
+    reset_stats(lid);
+
+    lid->cache = NULL;
+    return 0;
+}
+
+static LanguageIdentifier* load_protobuf_identifier(const unsigned char* model_buf, size_t model_len,
+                                                    const char* model_path) {
     Langid__LanguageIdentifier* msg;
+    LanguageIdentifier* lid;
+
+    msg = langid__language_identifier__unpack(NULL, model_len, model_buf);
+    if (msg == NULL) {
+        fprintf(stderr, "Error unpacking model from: %s\n", model_path);
+        return NULL;
+    }
+
+    /* the tables are read with the sizes in the header, which they must match */
+    if (msg->num_feats < 0 || msg->num_langs < 0 || msg->num_states <= 0 ||
+        msg->n_tk_nextmove != (size_t)msg->num_states * 256 || msg->n_tk_output_c != (size_t)msg->num_states ||
+        msg->n_tk_output_s != (size_t)msg->num_states || msg->n_nb_pc != (size_t)msg->num_langs ||
+        msg->n_nb_ptc != (size_t)msg->num_feats * msg->num_langs || msg->n_nb_classes != (size_t)msg->num_langs ||
+        !valid_tk_output((const uint32_t*)msg->tk_output_c, (const uint32_t*)msg->tk_output_s,
+                         (const uint32_t*)msg->tk_output, msg->n_tk_output, msg->num_states, msg->num_feats)) {
+        fprintf(stderr, "Malformed model: %s\n", model_path);
+        langid__language_identifier__free_unpacked(msg, NULL);
+        return NULL;
+    }
+
+    lid = (LanguageIdentifier*)malloc(sizeof(LanguageIdentifier));
+    if (lid == NULL) {
+        fprintf(stderr, "Memory allocation failed for LanguageIdentifier\n");
+        langid__language_identifier__free_unpacked(msg, NULL);
+        return NULL;
+    }
+
+    lid->num_feats = msg->num_feats;
+    lid->num_langs = msg->num_langs;
+    lid->num_states = msg->num_states;
+
+    lid->tk_output_c = (unsigned(*)[])msg->tk_output_c;
+    lid->tk_output_s = (unsigned(*)[])msg->tk_output_s;
+    lid->tk_output = (unsigned(*)[])msg->tk_output;
+
+    lid->nb_pc = (double(*)[])msg->nb_pc;
+    lid->nb_ptc_encoding = NB_PTC_F64;
+    lid->nb_ptc = msg->nb_ptc;
+    lid->nb_ptc_scale = NULL;
+    lid->nb_classes = (char*(*)[])msg->nb_classes;
+
+    lid->protobuf_model = msg;
+    lid->model_map = NULL;
+    lid->model_map_len = 0;
+
+    if (build_compact_dfa(lid, (const uint32_t*)msg->tk_nextmove) != 0) {
+        free(lid);
+        langid__language_identifier__free_unpacked(msg, NULL);
+        return NULL;
+    }
+
+    /* the full transition table is no longer needed */
+    free(msg->tk_nextmove);
+    msg->tk_nextmove = NULL;
+    msg->n_tk_nextmove = 0;
+
+    if (init_identifier(lid) != 0) {
+        free(lid->tk_transitions_buf);
+        free(lid);
+        langid__language_identifier__free_unpacked(msg, NULL);
+        return NULL;
+    }
+    return lid;
+}
+
+/* Looks up a section of a flat model, checking that it lies within the
+ * file. Returns NULL if the model has no such section.
+ */
+static const FlatModelSection* find_flat_section(const unsigned char* model_buf, size_t model_len, uint32_t id) {
+    const FlatModelHeader* header = (const FlatModelHeader*)model_buf;
+    const FlatModelSection* sections = (const FlatModelSection*)(model_buf + sizeof(FlatModelHeader));
+
+    for (uint32_t i = 0; i < header->num_sections; ++i) {
+        if (sections[i].id == id) {
+            if (sections[i].offset % FLAT_MODEL_ALIGNMENT != 0 || sections[i].offset > model_len ||
+                sections[i].size > model_len - sections[i].offset) {
+                return NULL;
+            }
+            return &sections[i];
+        }
+    }
+    return NULL;
+}
+
+static LanguageIdentifier* load_flat_identifier(const unsigned char* model_buf, size_t model_len,
+                                                const char* model_path) {
+    const FlatModelHeader* header = (const FlatModelHeader*)model_buf;
+    const FlatModelSection *nextmove, *byte_class, *transitions, *output_c, *output_s, *output, *pc, *ptc, *scale,
+        *classes;
+    LanguageIdentifier* lid;
+    char** nb_classes;
+
+    if (header->version != FLAT_MODEL_VERSION) {
+        fprintf(stderr, "Unsupported flat model version %u in: %s\n", header->version, model_path);
+        return NULL;
+    }
+    if (header->num_sections > (model_len - sizeof(FlatModelHeader)) / sizeof(FlatModelSection)) {
+        fprintf(stderr, "Truncated flat model: %s\n", model_path);
+        return NULL;
+    }
+    /* the tokenizer starts from state 0 */
+    if (header->num_states == 0) {
+        fprintf(stderr, "Malformed flat model: %s\n", model_path);
+        return NULL;
+    }
+
+    nextmove = find_flat_section(model_buf, model_len, FLAT_MODEL_TK_NEXTMOVE);
+    byte_class = find_flat_section(model_buf, model_len, FLAT_MODEL_TK_BYTE_CLASS);
+    transitions = find_flat_section(model_buf, model_len, FLAT_MODEL_TK_TRANSITIONS);
+    output_c = find_flat_section(model_buf, model_len, FLAT_MODEL_TK_OUTPUT_C);
+    output_s = find_flat_section(model_buf, model_len, FLAT_MODEL_TK_OUTPUT_S);
+    output = find_flat_section(model_buf, model_len, FLAT_MODEL_TK_OUTPUT);
+    pc = find_flat_section(model_buf, model_len, FLAT_MODEL_NB_PC);
+    ptc = find_flat_section(model_buf, model_len, FLAT_MODEL_NB_PTC);
+    scale = find_flat_section(model_buf, model_len, FLAT_MODEL_NB_PTC_SCALE);
+    classes = find_flat_section(model_buf, model_len, FLAT_MODEL_NB_CLASSES);
+
+    if (output_c == NULL || output_s == NULL || output == NULL || pc == NULL || ptc == NULL || classes == NULL ||
+        output_c->size != (uint64_t)header->num_states * sizeof(uint32_t) || output_s->size != output_c->size ||
+        pc->size != (uint64_t)header->num_langs * sizeof(double) || ptc->encoding > NB_PTC_I8 ||
+        ptc->size != (uint64_t)header->num_feats * header->num_langs * nb_ptc_element_size[ptc->encoding]) {
+        fprintf(stderr, "Malformed flat model: %s\n", model_path);
+        return NULL;
+    }
+    if ((ptc->encoding == NB_PTC_I16 || ptc->encoding == NB_PTC_I8) &&
+        (scale == NULL || scale->size != (uint64_t)header->num_langs * sizeof(double))) {
+        fprintf(stderr, "Malformed flat model: %s\n", model_path);
+        return NULL;
+    }
+
+
+    /* the compact tokenizer is used in place, otherwise it is built from the full table */
+    unsigned int num_classes = 0;
+    if (byte_class != NULL && transitions != NULL && byte_class->size == 256) {
+        for (unsigned int b = 0; b < 256; ++b) {
+            if (model_buf[byte_class->offset + b] >= num_classes) {
+                num_classes = model_buf[byte_class->offset + b] + 1;
+            }
+        }
+        if ((transitions->encoding != sizeof(uint16_t) && transitions->encoding != sizeof(uint32_t)) ||
+            (transitions->encoding == sizeof(uint16_t) && header->num_states > UINT16_MAX + 1) ||
+            transitions->size != (uint64_t)header->num_states * num_classes * transitions->encoding) {
+            fprintf(stderr, "Malformed flat model: %s\n", model_path);
+            return NULL;
+        }
+        /* the tokenizer follows transitions unchecked */
+        const unsigned char* tk_transitions = model_buf + transitions->offset;
+        for (size_t i = 0; i < (size_t)header->num_states * num_classes; ++i) {
+            uint32_t next = transitions->encoding == sizeof(uint16_t) ? ((const uint16_t*)tk_transitions)[i]
+                                                                      : ((const uint32_t*)tk_transitions)[i];
+            if (next >= header->num_states) {
+                fprintf(stderr, "Malformed flat model: %s\n", model_path);
+                return NULL;
+            }
+        }
+    } else if (nextmove == NULL || nextmove->size != (uint64_t)header->num_states * 256 * sizeof(uint32_t)) {
+        fprintf(stderr, "Malformed flat model: %s\n", model_path);
+        return NULL;
+    }
+
+    if (!valid_tk_output((const uint32_t*)(model_buf + output_c->offset),
+                         (const uint32_t*)(model_buf + output_s->offset), (const uint32_t*)(model_buf + output->offset),
+                         output->size / sizeof(uint32_t), header->num_states, header->num_feats)) {
+        fprintf(stderr, "Malformed flat model: %s\n", model_path);
+        return NULL;
+    }
+
+    /* the class labels are the only table that needs unpacking */
+    nb_classes = (char**)malloc(sizeof(char*) * (header->num_langs ? header->num_langs : 1));
+    if (nb_classes == NULL) {
+        fprintf(stderr, "Memory allocation failed for nb_classes\n");
+        return NULL;
+    }
+
+    const char* label = (const char*)model_buf + classes->offset;
+    const char* labels_end = label + classes->size;
+    for (uint32_t i = 0; i < header->num_langs; ++i) {
+        const char* nul = memchr(label, '\0', labels_end - label);
+        if (nul == NULL) {
+            fprintf(stderr, "Malformed flat model: %s\n", model_path);
+            free(nb_classes);
+            return NULL;
+        }
+        nb_classes[i] = (char*)label;
+        label = nul + 1;
+    }
+
+    lid = (LanguageIdentifier*)malloc(sizeof(LanguageIdentifier));
+    if (lid == NULL) {
+        fprintf(stderr, "Memory allocation failed for LanguageIdentifier\n");
+        free(nb_classes);
+        return NULL;
+    }
+
+    lid->num_feats = header->num_feats;
+    lid->num_langs = header->num_langs;
+    lid->num_states = header->num_states;
+
+    lid->tk_output_c = (unsigned(*)[])(model_buf + output_c->offset);
+    lid->tk_output_s = (unsigned(*)[])(model_buf + output_s->offset);
+    lid->tk_output = (unsigned(*)[])(model_buf + output->offset);
+
+    lid->nb_pc = (double(*)[])(model_buf + pc->offset);
+    lid->nb_ptc_encoding = (NbPtcEncoding)ptc->encoding;
+    lid->nb_ptc = model_buf + ptc->offset;
+    lid->nb_ptc_scale = scale != NULL ? (double(*)[])(model_buf + scale->offset) : NULL;
+    lid->nb_classes = (char*(*)[])nb_classes;
+
+    lid->protobuf_model = NULL;
+    lid->model_map = (void*)model_buf;
+    lid->model_map_len = model_len;
+
+    if (num_classes > 0) {
+        lid->tk_num_classes = num_classes;
+        memcpy(lid->tk_byte_class, model_buf + byte_class->offset, 256);
+        lid->tk_state_size = transitions->encoding;
+        lid->tk_transitions = model_buf + transitions->offset;
+        lid->tk_transitions_buf = NULL;
+    } else if (build_compact_dfa(lid, (const uint32_t*)(model_buf + nextmove->offset)) != 0) {
+        free(lid);
+        free(nb_classes);
+        return NULL;
+    }
+
+    if (init_identifier(lid) != 0) {
+        free(lid->tk_transitions_buf);
+        free(lid);
+        free(nb_classes);
+        return NULL;
+    }
+    return lid;
+}
+
+LanguageIdentifier* load_identifier(const char* model_path) {
     int fd;
     unsigned char* model_buf;
     LanguageIdentifier* lid;
 
-    fd = open(model_path, O_RDONLY);
-    if (fd == -1) {
-        fprintf(stderr, "Unable to open: %s\n", model_path);
-        return NULL;
+    fd = open(model_path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Unable to open: %s\n", model_path);
+        return NULL;
+    }
+
+    off_t model_len = lseek(fd, 0, SEEK_END);
+    model_buf = mmap(NULL, model_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (model_buf == MAP_FAILED) {
+        fprintf(stderr, "Failed to map the model file: %s\n", model_path);
+        close(fd);
+        return NULL;
+    }
+    /* the mapping stays valid after the descriptor is closed */
+    close(fd);
+
+    if ((size_t)model_len >= sizeof(FlatModelHeader) &&
+        memcmp(model_buf, FLAT_MODEL_MAGIC, sizeof(((FlatModelHeader*)0)->magic)) == 0) {
+        /* a flat model is used in place and unmapped by destroy_identifier */
+        lid = load_flat_identifier(model_buf, model_len, model_path);
+        if (lid == NULL) {
+            munmap(model_buf, model_len);
+        }
+    } else {
+        /* the unpacked protobuf message holds copies of all the tables */
+        lid = load_protobuf_identifier(model_buf, model_len, model_path);
+        munmap(model_buf, model_len);
+    }
+
+    return lid;
+}
+
+LanguageIdentifier* get_default_identifier(void) {
+#ifdef LANGID_DEFAULT_MODEL
+    LanguageIdentifier* lid = load_flat_identifier(default_model, default_model_len, "default model");
+
+    /* the tables point into the data of the library, nothing to unmap */
+    if (lid != NULL) {
+        lid->model_map = NULL;
+        lid->model_map_len = 0;
+    }
+    return lid;
+#else
+    return NULL;
+#endif
+}
+
+void prefault_identifier(const LanguageIdentifier* lid) {
+    const volatile unsigned char* page = lid->model_map;
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    unsigned char sink = 0;
+
+    if (page == NULL) {
+        return;
+    }
+    /* start the read-ahead of the whole file, then wait for each page */
+    madvise(lid->model_map, lid->model_map_len, MADV_WILLNEED);
+    for (size_t offset = 0; offset < lid->model_map_len; offset += page_size) {
+        sink ^= page[offset];
+    }
+    (void)sink;
+}
+
+void destroy_identifier(LanguageIdentifier* lid) {
+    if (lid->protobuf_model != NULL) {
+        langid__language_identifier__free_unpacked(lid->protobuf_model, NULL);
+    } else {
+        free(lid->nb_classes);
+    }
+    if (lid->model_map != NULL) {
+        munmap(lid->model_map, lid->model_map_len);
+    }
+    free(lid->tk_transitions_buf);
+    free(lid->tk_state_row);
+    free(lid->nb_classes_mask);
+    release_subset(lid->subset);
+    pthread_mutex_destroy(&lid->subset_lock);
+    pthread_mutex_destroy(&lid->counters->lock);
+    free(lid->counters);
+    free_result_cache(lid->cache);
+    free_context(lid->context);
+    free(lid);
+}
+
+LanguageIdentifierContext* alloc_context(const LanguageIdentifier* lid) {
+    LanguageIdentifierContext* ctx;
+
+    ctx = (LanguageIdentifierContext*)malloc(sizeof(LanguageIdentifierContext));
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    ctx->sv = alloc_set(lid->num_states);
+    ctx->fv = alloc_set(lid->num_feats);
+    ctx->prob = (double*)malloc(sizeof(double) * (lid->num_langs + 1));
+    ctx->ranking = (LanguageConfidence*)malloc(sizeof(LanguageConfidence) * (lid->num_langs + 1));
+    ctx->subset = NULL;
+    if (ctx->prob == NULL || ctx->ranking == NULL) {
+        free_context(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+void free_context(LanguageIdentifierContext* ctx) {
+    if (ctx == NULL) {
+        return;
+    }
+    free_set(ctx->sv);
+    free_set(ctx->fv);
+    free(ctx->prob);
+    free(ctx->ranking);
+    release_context_subset(ctx);
+    free(ctx);
+}
+
+void release_context_subset(LanguageIdentifierContext* ctx) {
+    if (ctx->subset != NULL) {
+        release_subset(ctx->subset);
+        ctx->subset = NULL;
+    }
+}
+
+/*
+ * Run the tokenizer over text from state s, counting the states entered in
+ * sv. Returns the state reached at the end of the text.
+ */
+static unsigned int text_to_sv(const LanguageIdentifier* lid, unsigned int s, const char* text, unsigned int text_len,
+                               Set* sv) {
+    unsigned int i;
+
+    if (lid->tk_state_size == sizeof(uint16_t)) {
+        const uint16_t* transitions = lid->tk_transitions;
+        for (i = 0; i < text_len; ++i) {
+            s = transitions[(size_t)s * lid->tk_num_classes + lid->tk_byte_class[(unsigned char)text[i]]];
+            add(sv, s, 1);
+        }
+    } else {
+        const uint32_t* transitions = lid->tk_transitions;
+        for (i = 0; i < text_len; ++i) {
+            s = transitions[(size_t)s * lid->tk_num_classes + lid->tk_byte_class[(unsigned char)text[i]]];
+            add(sv, s, 1);
+        }
+    }
+
+    return s;
+}
+
+#define TOKENIZER_MAX_LANES 16
+#define TOKENIZER_STRETCH 64
+
+/* Advances every lane by n bytes, one byte of each lane in turn, recording
+ * the states entered in entered[lane][byte] to be counted afterwards, so that
+ * the sparse sets do not get in between the loads; state_size is a constant where this is inlined, so that
+ * each width gets its own loop. With prefetch, the transition each lane
+ * takes next is requested as soon as its state is known.
+ */
+static inline __attribute__((always_inline)) void step_lanes(const LanguageIdentifier* lid, size_t state_size,
+                                                            const unsigned char* const text[], unsigned int state[],
+                                                            unsigned int num_lanes, unsigned int n, bool prefetch,
+                                                            unsigned int entered[][TOKENIZER_STRETCH]) {
+    const void* transitions = lid->tk_transitions;
+    const uint8_t* byte_class = lid->tk_byte_class;
+    size_t num_classes = lid->tk_num_classes, t;
+    unsigned int i, l, s;
+
+    for (i = 0; i < n; ++i) {
+        for (l = 0; l < num_lanes; ++l) {
+            t = (size_t)state[l] * num_classes + byte_class[text[l][i]];
+            s = state_size == sizeof(uint16_t) ? ((const uint16_t*)transitions)[t] : ((const uint32_t*)transitions)[t];
+            state[l] = s;
+            entered[l][i] = s;
+            if (prefetch && i + 1 < n) {
+                t = (size_t)s * num_classes + byte_class[text[l][i + 1]];
+                __builtin_prefetch((const char*)transitions + t * state_size);
+            }
+        }
+    }
+}
+
+/*
+ * Run the tokenizer over num_texts texts at once, up to TOKENIZER_MAX_LANES,
+ * counting the states entered in text i in sv[i]. Each transition depends
+ * on the one before it in the same text only, so advancing the texts in
+ * lockstep lets the loads of different texts overlap where text_to_sv waits
+ * for each in turn. Every sv[i] ends up as text_to_sv from state 0 leaves it,
+ * down to the order of its members.
+ */
+static void texts_to_sv(const LanguageIdentifier* lid, const char* const texts[], const unsigned int text_lens[],
+                        unsigned int num_texts, Set* const sv[], bool prefetch) {
+    const unsigned char* text[TOKENIZER_MAX_LANES];
+    unsigned int text_len[TOKENIZER_MAX_LANES], state[TOKENIZER_MAX_LANES];
+    unsigned int entered[TOKENIZER_MAX_LANES][TOKENIZER_STRETCH];
+    Set* lane_sv[TOKENIZER_MAX_LANES];
+    unsigned int i, l, n, num_lanes = 0;
+
+    for (i = 0; i < num_texts; ++i) {
+        clear(sv[i]);
+        if (text_lens[i] > 0) {
+            text[num_lanes] = (const unsigned char*)texts[i];
+            text_len[num_lanes] = text_lens[i];
+            state[num_lanes] = 0;
+            lane_sv[num_lanes++] = sv[i];
+        }
+    }
+
+    while (num_lanes > 0) {
+        /* all lanes run up to the end of the shortest text, a stretch at a time */
+        for (l = 1, n = text_len[0]; l < num_lanes; ++l) {
+            n = text_len[l] < n ? text_len[l] : n;
+        }
+        n = n < TOKENIZER_STRETCH ? n : TOKENIZER_STRETCH;
+
+        if (lid->tk_state_size == sizeof(uint16_t)) {
+            step_lanes(lid, sizeof(uint16_t), text, state, num_lanes, n, prefetch, entered);
+        } else {
+            step_lanes(lid, sizeof(uint32_t), text, state, num_lanes, n, prefetch, entered);
+        }
+
+        for (l = 0; l < num_lanes;) {
+            for (i = 0; i < n; ++i) {
+                increment(lane_sv[l], entered[l][i]);
+            }
+            text[l] += n;
+            text_len[l] -= n;
+
+            /* lanes whose text ended make way for the others */
+            if (text_len[l] == 0) {
+                num_lanes--;
+                text[l] = text[num_lanes];
+                text_len[l] = text_len[num_lanes];
+                state[l] = state[num_lanes];
+                lane_sv[l] = lane_sv[num_lanes];
+                memcpy(entered[l], entered[num_lanes], sizeof(unsigned int) * n);
+            } else {
+                ++l;
+            }
+        }
+    }
+}
+
+/* Convert the counts of states into counts of the features they complete */
+static void sv_to_fv(const LanguageIdentifier* lid, const Set* sv, Set* fv) {
+    unsigned int i, j, m;
+
+    clear(fv);
+    for (i = 0; i < sv->members; ++i) {
+        m = sv->dense[i];
+        for (j = 0; j < (*lid->tk_output_c)[m]; ++j) {
+            add(fv, (*lid->tk_output)[(*lid->tk_output_s)[m] + j], sv->counts[i]);
+        }
+    }
+}
+
+/* Add count times the nb_ptc row of feature f to logprob, integer rows unscaled */
+static inline void accumulate_feature(const LanguageIdentifier* lid, const LanguageSubset* subset, unsigned int f,
+                                      double count, double logprob[]) {
+    const Kernels* kernels = lid->kernels;
+    unsigned int num_langs = subset->num_langs;
+    /* NUM_FEATS * NUM_LANGS */
+    size_t row = (size_t)f * num_langs;
+
+    switch (lid->nb_ptc_encoding) {
+    case NB_PTC_F64:
+        kernels->accumulate_f64(logprob, (const double*)subset->nb_ptc + row, count, num_langs);
+        break;
+    case NB_PTC_F32:
+        kernels->accumulate_f32(logprob, (const float*)subset->nb_ptc + row, count, num_langs);
+        break;
+    case NB_PTC_I16:
+        kernels->accumulate_i16(logprob, (const int16_t*)subset->nb_ptc + row, count, num_langs);
+        break;
+    case NB_PTC_I8:
+        kernels->accumulate_i8(logprob, (const int8_t*)subset->nb_ptc + row, count, num_langs);
+        break;
+    }
+}
+
+/* Add count times the nb_ptc row of every feature of fv to logprob, integer
+ * rows unscaled.
+ */
+static void accumulate_nb_ptc(const LanguageIdentifier* lid, const LanguageSubset* subset, const Set* fv,
+                              double logprob[]) {
+    unsigned int i;
+
+    for (i = 0; i < fv->members; ++i) {
+        accumulate_feature(lid, subset, fv->dense[i], fv->counts[i], logprob);
+    }
+}
+
+/* Add count times the state_ptc row of every state of sv with output to
+ * logprob, integer rows unscaled.
+ */
+static void accumulate_state_ptc(const LanguageIdentifier* lid, const LanguageSubset* subset, const Set* sv,
+                                 double logprob[]) {
+    unsigned int i, row, num_langs = subset->num_langs;
+
+    for (i = 0; i < sv->members; ++i) {
+        if ((row = lid->tk_state_row[sv->dense[i]]) != STATE_ROW_NONE) {
+            lid->kernels->accumulate_f64(logprob, subset->state_ptc + (size_t)row * num_langs, sv->counts[i],
+                                         num_langs);
+        }
+    }
+}
+
+/* Posterior of each class given the counts of features, or of states with
+ * state posteriors
+ */
+static void counts_to_logprob(const LanguageIdentifier* lid, const LanguageSubset* subset, const Set* counts,
+                              bool by_state, double logprob[]) {
+    unsigned int i;
+    bool scaled = lid->nb_ptc_encoding == NB_PTC_I16 || lid->nb_ptc_encoding == NB_PTC_I8;
+
+    /* Initialize using prior, or for integers, whose sums are exact, scale
+     * each class once at the end
+     */
+    for (i = 0; i < subset->num_langs; ++i) {
+        logprob[i] = scaled ? 0 : subset->nb_pc[i];
+    }
+
+    /* Compute posterior for each class */
+    if (by_state) {
+        accumulate_state_ptc(lid, subset, counts, logprob);
+    } else {
+        accumulate_nb_ptc(lid, subset, counts, logprob);
+    }
+
+    if (scaled) {
+        for (i = 0; i < subset->num_langs; ++i) {
+            logprob[i] = subset->nb_pc[i] + subset->nb_ptc_scale[i] * logprob[i];
+        }
+    }
+}
+
+static void fv_to_logprob(const LanguageIdentifier* lid, const LanguageSubset* subset, Set* fv, double logprob[]) {
+    counts_to_logprob(lid, subset, fv, false, logprob);
+}
+
+/* Posterior of each class given the states counted in ctx->sv, through
+ * ctx->fv unless the subset has state posteriors
+ */
+static void sv_to_logprob(const LanguageIdentifier* lid, const LanguageSubset* subset, LanguageIdentifierContext* ctx,
+                          double logprob[]) {
+    if (subset->state_ptc != NULL) {
+        counts_to_logprob(lid, subset, ctx->sv, true, logprob);
+    } else {
+        sv_to_fv(lid, ctx->sv, ctx->fv);
+        fv_to_logprob(lid, subset, ctx->fv, logprob);
+    }
+}
+
+static void logprob_to_prob(const Kernels* kernels, double logprob[], unsigned int size) {
+    /*  python reference: pd = 1 / np.exp(pd[None,:] - pd[:,None]).sum(1)
+    this is basically softmax:
+        x = pd[i]
+        new_pd[i] = 1 / sum_{y in pd} e^(y - x) = e^x / sum_{y in pd} e^y = softmax(x)
+    */
+
+    unsigned int i;
+    double sum;
+    double max_logprob = kernels->max(logprob, size);
+
+    /* no class can be scored */
+    if (max_logprob == -INFINITY) {
+        for (i = 0; i < size; ++i) {
+            logprob[i] = 0;
+        }
+        return;
+    }
+
+    sum = kernels->exp_sum(logprob, max_logprob, size);
+    kernels->divide(logprob, sum, size);
+
+    return;
+}
+
+static unsigned int prob_to_pred_idx(const double prob[], unsigned int size) {
+    unsigned int i, m = 0;
+
+    for (i = 1; i < size; ++i) {
+        if (prob[m] < prob[i]) {
+            m = i;
+        }
+    }
+
+    return m;
+}
+
+static void count_document(LanguageIdentifierCounters* counters, unsigned int text_len, unsigned int sv_members,
+                           unsigned int counts_members) {
+    atomic_fetch_add_explicit(&counters->calls, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters->bytes, text_len, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters->sv_members[histogram_bucket(sv_members)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters->fv_members[histogram_bucket(counts_members)], 1, memory_order_relaxed);
+}
+
+/* A document served by the result cache only counts in calls, bytes and cache_hits */
+static void count_cache_hit(LanguageIdentifierCounters* counters, unsigned int text_len) {
+    if (!atomic_load_explicit(&counters->enabled, memory_order_relaxed)) {
+        return;
+    }
+    atomic_fetch_add_explicit(&counters->calls, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters->bytes, text_len, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters->cache_hits, 1, memory_order_relaxed);
+}
+
+static void count_stage_cycles(LanguageIdentifierCounters* counters, unsigned int stage, uint64_t cycles) {
+    atomic_fetch_add_explicit(&counters->stage_cycles[stage], cycles, memory_order_relaxed);
+}
+
+/* Probabilities of the languages of the subset for text, counted in the
+ * stats of the identifier when they are enabled
+ */
+static void text_to_prob(const LanguageIdentifier* lid, const LanguageSubset* subset, LanguageIdentifierContext* ctx,
+                         const char* text, unsigned int text_len, double prob[]) {
+    LanguageIdentifierCounters* counters = lid->counters;
+    uint64_t t0, t1, t2, t3, t4;
+
+    Set* counts = subset->state_ptc != NULL ? ctx->sv : ctx->fv;
+
+    if (!atomic_load_explicit(&counters->enabled, memory_order_relaxed)) {
+        clear(ctx->sv);
+        text_to_sv(lid, 0, text, text_len, ctx->sv);
+        sv_to_logprob(lid, subset, ctx, prob);
+        logprob_to_prob(lid->kernels, prob, subset->num_langs);
+        return;
+    }
+
+    t0 = read_cycles();
+    clear(ctx->sv);
+    text_to_sv(lid, 0, text, text_len, ctx->sv);
+    t1 = read_cycles();
+    if (subset->state_ptc == NULL) {
+        sv_to_fv(lid, ctx->sv, ctx->fv);
+    }
+    t2 = read_cycles();
+    counts_to_logprob(lid, subset, counts, subset->state_ptc != NULL, prob);
+    t3 = read_cycles();
+    logprob_to_prob(lid->kernels, prob, subset->num_langs);
+    t4 = read_cycles();
+
+    count_document(counters, text_len, ctx->sv->members, counts->members);
+    count_stage_cycles(counters, 0, t1 - t0);
+    count_stage_cycles(counters, 1, t2 - t1);
+    count_stage_cycles(counters, 2, t3 - t2);
+    count_stage_cycles(counters, 3, t4 - t3);
+}
+
+/* text_to_prob through the result cache of the identifier, if any */
+static void cached_text_to_prob(const LanguageIdentifier* lid, const LanguageSubset* subset,
+                                LanguageIdentifierContext* ctx, const char* text, unsigned int text_len,
+                                double prob[]) {
+    if (lid->cache == NULL || text_len > RESULT_CACHE_MAX_KEY_LEN) {
+        text_to_prob(lid, subset, ctx, text, text_len, prob);
+        return;
+    }
+
+    if (result_cache_get(lid->cache, subset->generation, text, text_len, prob, subset->num_langs)) {
+        count_cache_hit(lid->counters, text_len);
+    } else {
+        text_to_prob(lid, subset, ctx, text, text_len, prob);
+        result_cache_put(lid->cache, subset->generation, text, text_len, prob, subset->num_langs);
+    }
+}
+
+/* Most likely language of the subset given the probabilities of its languages */
+static LanguageConfidence prob_to_pred(const LanguageIdentifier* lid, const LanguageSubset* subset,
+                                       const double prob[]) {
+    unsigned int pred_idx;
+    LanguageConfidence pred;
+
+    /* no language to pick from */
+    if (subset->num_langs == 0) {
+        pred.language = (*lid->nb_classes)[0];
+        pred.index = 0;
+        pred.confidence = 0;
+        return pred;
+    }
+
+    pred_idx = prob_to_pred_idx(prob, subset->num_langs);
+
+    pred.language = (*lid->nb_classes)[subset->langs[pred_idx]];
+    pred.index = subset->langs[pred_idx];
+    pred.confidence = prob[pred_idx];
+
+    return pred;
+}
+
+/* Most likely language of the subset given the states counted in ctx->sv */
+static LanguageConfidence sv_to_pred(const LanguageIdentifier* lid, const LanguageSubset* subset,
+                                     LanguageIdentifierContext* ctx) {
+    double* lp = ctx->prob;
+
+    if (subset->num_langs > 0) {
+        sv_to_logprob(lid, subset, ctx, lp);
+        logprob_to_prob(lid->kernels, lp, subset->num_langs);
+    }
+    return prob_to_pred(lid, subset, lp);
+}
+
+static LanguageConfidence classify_subset(const LanguageIdentifier* lid, const LanguageSubset* subset,
+                                          LanguageIdentifierContext* ctx, const char* text, unsigned int text_len) {
+    double* lp = ctx->prob;
+
+    if (subset->num_langs > 0) {
+        cached_text_to_prob(lid, subset, ctx, text, text_len, lp);
+    }
+    return prob_to_pred(lid, subset, lp);
+}
+
+LanguageConfidence classify_r(const LanguageIdentifier* lid, LanguageIdentifierContext* ctx, const char* text,
+                              unsigned int text_len) {
+    return classify_subset(lid, context_subset(lid, ctx), ctx, text, text_len);
+}
+
+LanguageConfidence classify(LanguageIdentifier* lid, const char* text, unsigned int text_len) {
+    return classify_r(lid, lid->context, text, text_len);
+}
+
+static int compare_language_confidence(const void* first, const void* second) {
+    LanguageConfidence* first_lc = (LanguageConfidence*)first;
+    LanguageConfidence* second_ls = (LanguageConfidence*)second;
+
+    return (first_lc->confidence < second_ls->confidence) - (first_lc->confidence > second_ls->confidence);
+}
+
+/* Writes the k most likely languages of at least min_confidence to out in
+ * descending order given the probabilities of the languages of the subset,
+ * returns how many there are.
+ */
+static unsigned int prob_to_rank(const LanguageIdentifier* lid, const LanguageSubset* subset, const double prob[],
+                                 unsigned int k, double min_confidence, LanguageConfidence* out) {
+    unsigned int i, j, n = 0;
+
+    if (subset->num_langs > 0 && k > 0) {
+        if (k >= subset->num_langs) {
+            for (i = 0; i < subset->num_langs; ++i) {
+                if (prob[i] >= min_confidence) {
+                    out[n].language = (*lid->nb_classes)[subset->langs[i]];
+                    out[n].index = subset->langs[i];
+                    out[n++].confidence = prob[i];
+                }
+            }
+
+            // sort in descending order
+            qsort(out, n, sizeof(LanguageConfidence), compare_language_confidence);
+        } else {
+            /* partial selection: keep the best k seen so far sorted in out */
+            for (i = 0; i < subset->num_langs; ++i) {
+                if (prob[i] < min_confidence || (n == k && prob[i] <= out[n - 1].confidence)) {
+                    continue;
+                }
+                for (j = n < k ? n++ : n - 1; j > 0 && out[j - 1].confidence < prob[i]; --j) {
+                    out[j] = out[j - 1];
+                }
+                out[j].language = (*lid->nb_classes)[subset->langs[i]];
+                out[j].index = subset->langs[i];
+                out[j].confidence = prob[i];
+            }
+        }
+    }
+
+    /* languages left out by set_languages come last */
+    for (i = subset->num_langs; i < lid->num_langs && n < k && min_confidence <= 0; ++i) {
+        out[n].language = (*lid->nb_classes)[subset->langs[i]];
+        out[n].index = subset->langs[i];
+        out[n++].confidence = 0;
+    }
+
+    return n;
+}
+
+static unsigned int rank_subset(const LanguageIdentifier* lid, const LanguageSubset* subset,
+                                LanguageIdentifierContext* ctx, const char* text, unsigned int text_len,
+                                unsigned int k, double min_confidence, LanguageConfidence* out) {
+    double* lp = ctx->prob;
+
+    if (subset->num_langs > 0 && k > 0) {
+        cached_text_to_prob(lid, subset, ctx, text, text_len, lp);
+    }
+    return prob_to_rank(lid, subset, lp, k, min_confidence, out);
+}
+
+void rank_r(const LanguageIdentifier* lid, LanguageIdentifierContext* ctx, const char* text, unsigned int text_len,
+            LanguageConfidence* out) {
+    rank_subset(lid, context_subset(lid, ctx), ctx, text, text_len, lid->num_langs, 0, out);
+}
+
+unsigned int rank_top_r(const LanguageIdentifier* lid, LanguageIdentifierContext* ctx, const char* text,
+                        unsigned int text_len, unsigned int k, double min_confidence, LanguageConfidence* out) {
+    return rank_subset(lid, context_subset(lid, ctx), ctx, text, text_len, k, min_confidence, out);
+}
+
+LanguageIdentifierCascade* alloc_cascade(const LanguageIdentifier* first, const LanguageIdentifier* second,
+                                         double min_confidence, double min_margin) {
+    LanguageIdentifierCascade* cascade;
+
+    if ((cascade = (LanguageIdentifierCascade*)malloc(sizeof(LanguageIdentifierCascade))) == NULL ||
+        (cascade->first_to_second = (unsigned int*)malloc(sizeof(unsigned int) * (first->num_langs + 1))) == NULL) {
+        fprintf(stderr, "Memory allocation failed for cascade\n");
+        free(cascade);
+        return NULL;
+    }
+    cascade->first = first;
+    cascade->second = second;
+    cascade->min_confidence = min_confidence;
+    cascade->min_margin = min_margin;
+
+    /* the label sets of the two models may differ in content and order */
+    for (unsigned int i = 0; i < first->num_langs; ++i) {
+        cascade->first_to_second[i] = CASCADE_NO_LANGUAGE;
+        for (unsigned int j = 0; j < second->num_langs; ++j) {
+            if (strcmp((*first->nb_classes)[i], (*second->nb_classes)[j]) == 0) {
+                cascade->first_to_second[i] = j;
+                break;
+            }
+        }
+    }
+    return cascade;
+}
+
+void free_cascade(LanguageIdentifierCascade* cascade) {
+    if (cascade != NULL) {
+        free(cascade->first_to_second);
+        free(cascade);
+    }
+}
+
+LanguageConfidence classify_cascade_r(const LanguageIdentifierCascade* cascade, LanguageIdentifierContext* first_ctx,
+                                      LanguageIdentifierContext* second_ctx, const char* text, unsigned int text_len,
+                                      unsigned int* stage) {
+    const LanguageIdentifier* second = cascade->second;
+    LanguageConfidence* top = first_ctx->ranking;
+    LanguageConfidence pred;
+    unsigned int n = rank_top_r(cascade->first, first_ctx, text, text_len, 2, 0, top);
+    unsigned int index = n > 0 ? cascade->first_to_second[top[0].index] : CASCADE_NO_LANGUAGE;
+
+    /* the second subset, so that the language is checked against the same languages it would classify with */
+    const LanguageSubset* subset = context_subset(second, second_ctx);
+
+    if (index != CASCADE_NO_LANGUAGE &&
+        (top[0].confidence >= cascade->min_confidence ||
+         top[0].confidence - (n > 1 ? top[1].confidence : 0) >= cascade->min_margin)) {
+        for (unsigned int i = 0; i < subset->num_langs; ++i) {
+            if (subset->langs[i] == index) {
+                pred.language = (*second->nb_classes)[index];
+                pred.index = index;
+                pred.confidence = top[0].confidence;
+                *stage = 0;
+                return pred;
+            }
+        }
+    }
+
+    pred = classify_subset(second, subset, second_ctx, text, text_len);
+    *stage = 1;
+    return pred;
+}
+
+void rank(LanguageIdentifier* lid, const char* text, unsigned int text_len, LanguageConfidence* out) {
+    rank_r(lid, lid->context, text, text_len, out);
+}
+
+unsigned int segment_windows(unsigned int text_len, unsigned int window, unsigned int stride, unsigned int starts[],
+                             unsigned int ends[]) {
+    unsigned int n = 0, start = 0;
+
+    if (text_len == 0 || window == 0 || stride == 0) {
+        return 0;
+    }
+    if (window >= text_len) {
+        window = text_len;
+    }
+
+    for (;;) {
+        if (starts != NULL) {
+            starts[n] = start;
+            ends[n] = start + window;
+        }
+        ++n;
+        if (text_len - window - start == 0) {
+            break;
+        }
+        /* one last window ends at the end of the text when the next one would run past it */
+        if (text_len - window - start < stride) {
+            if (starts != NULL) {
+                starts[n] = text_len - window;
+                ends[n] = text_len;
+            }
+            ++n;
+            break;
+        }
+        start += stride;
+    }
+    return n;
+}
+
+static inline unsigned int next_state(const LanguageIdentifier* lid, unsigned int s, unsigned char c) {
+    size_t t = (size_t)s * lid->tk_num_classes + lid->tk_byte_class[c];
+
+    return lid->tk_state_size == sizeof(uint16_t) ? ((const uint16_t*)lid->tk_transitions)[t]
+                                                   : ((const uint32_t*)lid->tk_transitions)[t];
+}
+
+/* Add the posteriors of the states counted in ctx->sv to logprob, through
+ * ctx->fv unless the subset has state posteriors, integer rows unscaled.
+ * Counts are signed, wrapping around below zero, and those that cancel out
+ * cost nothing.
+ */
+static void accumulate_signed_sv(const LanguageIdentifier* lid, const LanguageSubset* subset,
+                                 LanguageIdentifierContext* ctx, double logprob[]) {
+    const Set *sv = ctx->sv, *fv = ctx->fv;
+    unsigned int i, row;
+
+    if (subset->state_ptc != NULL) {
+        for (i = 0; i < sv->members; ++i) {
+            if (sv->counts[i] != 0 && (row = lid->tk_state_row[sv->dense[i]]) != STATE_ROW_NONE) {
+                lid->kernels->accumulate_f64(logprob, subset->state_ptc + (size_t)row * subset->num_langs,
+                                             (int32_t)sv->counts[i], subset->num_langs);
+            }
+        }
+        return;
+    }
+
+    sv_to_fv(lid, ctx->sv, ctx->fv);
+    for (i = 0; i < fv->members; ++i) {
+        if (fv->counts[i] != 0) {
+            accumulate_feature(lid, subset, fv->dense[i], (int32_t)fv->counts[i], logprob);
+        }
+    }
+}
+
+/*
+ * The tokenizer walks the text once from its start. A window tokenized on
+ * its own from state 0 enters the same states as that walk from the first
+ * position where the two meet, a few bytes in as the DFA only remembers the
+ * last few bytes, so a window is scored as the states of the walk over it,
+ * with those of its first few bytes swapped for its own. The bounds of the
+ * windows cut the text into pieces, each scored once when the first window
+ * holding it gets to it, and kept until the last one is done with it. The
+ * sum of the pieces of the window, running, slides along with the windows:
+ * pieces entering them are added and pieces leaving them subtracted. Float
+ * sums are also summed over from scratch once more pieces slid than the
+ * window holds, which bounds their rounding error to about that of
+ * classifying the window; integer ones are exact.
+ */
+#define SEGMENT_MIN_PIECES 64
+
+int segment_r(const LanguageIdentifier* lid, LanguageIdentifierContext* ctx, const char* text, unsigned int text_len,
+              const unsigned int starts[], const unsigned int ends[], unsigned int num_windows,
+              LanguageConfidence* out) {
+    const LanguageSubset* subset;
+    unsigned int *states, *piece_end, i, j, k, s, w, start, end, cut;
+    unsigned int capacity = SEGMENT_MIN_PIECES, head = 0, tail = 0, pos = 0, next_start = 0, next_end = 0, slid = 0;
+    unsigned int num_langs = lid->num_langs;
+    double *running, *piece_lp, *lp = ctx->prob;
+    bool scaled = lid->nb_ptc_encoding == NB_PTC_I16 || lid->nb_ptc_encoding == NB_PTC_I8;
+    int rc = -1;
+
+    if (num_windows == 0) {
+        return 0;
+    }
+
+    states = (unsigned int*)malloc(sizeof(unsigned int) * (text_len + 1));
+    running = (double*)malloc(sizeof(double) * (num_langs + 1));
+    piece_end = (unsigned int*)malloc(sizeof(unsigned int) * capacity);
+    piece_lp = (double*)malloc(sizeof(double) * capacity * num_langs + 1);
+    subset = context_subset(lid, ctx);
+    if (states == NULL || running == NULL || piece_end == NULL || piece_lp == NULL) {
+        goto done;
+    }
+
+    for (i = 0, s = 0; i < text_len; ++i) {
+        states[i] = s = next_state(lid, s, (unsigned char)text[i]);
+    }
+    num_langs = subset->num_langs;
+
+    for (w = 0; w < num_windows; ++w) {
+        if (num_langs == 0) {
+            out[w] = prob_to_pred(lid, subset, lp);
+            continue;
+        }
+        start = starts[w];
+        end = ends[w];
+
+        /* pieces before the window */
+        for (; head < tail && piece_end[head] <= start; ++head, ++slid) {
+            for (j = 0; j < num_langs; ++j) {
+                running[j] -= piece_lp[(size_t)head * num_langs + j];
+            }
+        }
+        if (head == tail) {
+            for (j = 0; j < num_langs; ++j) {
+                running[j] = 0;
+            }
+            head = tail = slid = 0;
+            pos = pos > start ? pos : start;
+        }
+
+        /* pieces up to its end, cut at the bounds of the windows after it */
+        while (pos < end) {
+            for (; next_start < num_windows && starts[next_start] <= pos; ++next_start) {
+            }
+            for (; next_end < num_windows && ends[next_end] <= pos; ++next_end) {
+            }
+            cut = end;
+            if (next_start < num_windows && starts[next_start] < cut) {
+                cut = starts[next_start];
+            }
+            if (next_end < num_windows && ends[next_end] < cut) {
+                cut = ends[next_end];
+            }
+
+            if (tail == capacity) {
+                if (head > 0) {
+                    memmove(piece_end, piece_end + head, sizeof(unsigned int) * (tail - head));
+                    memmove(piece_lp, piece_lp + (size_t)head * num_langs, sizeof(double) * (tail - head) * num_langs);
+                    tail -= head;
+                    head = 0;
+                } else {
+                    unsigned int* grown_end = (unsigned int*)realloc(piece_end, sizeof(unsigned int) * 2 * capacity);
+                    if (grown_end != NULL) {
+                        piece_end = grown_end;
+                    }
+                    double* grown_lp = (double*)realloc(piece_lp, sizeof(double) * 2 * capacity * lid->num_langs + 1);
+                    if (grown_lp != NULL) {
+                        piece_lp = grown_lp;
+                    }
+                    if (grown_end == NULL || grown_lp == NULL) {
+                        goto done;
+                    }
+                    capacity *= 2;
+                }
+            }
+
+            double* piece = piece_lp + (size_t)tail * num_langs;
+            for (j = 0; j < num_langs; ++j) {
+                piece[j] = 0;
+            }
+            clear(ctx->sv);
+            for (i = pos; i < cut; ++i) {
+                increment(ctx->sv, states[i]);
+            }
+            accumulate_signed_sv(lid, subset, ctx, piece);
+            for (j = 0; j < num_langs; ++j) {
+                running[j] += piece[j];
+            }
+            piece_end[tail++] = cut;
+            pos = cut;
+            ++slid;
+        }
+
+        if (!scaled && slid > tail - head) {
+            for (j = 0; j < num_langs; ++j) {
+                running[j] = 0;
+            }
+            for (k = head; k < tail; ++k) {
+                for (j = 0; j < num_langs; ++j) {
+                    running[j] += piece_lp[(size_t)k * num_langs + j];
+                }
+            }
+            slid = 0;
+        }
+
+        /* states of the window up to where it meets the walk, in place of those of the walk */
+        clear(ctx->sv);
+        for (i = start, s = 0; i < end; ++i) {
+            s = next_state(lid, s, (unsigned char)text[i]);
+            if (s == states[i]) {
+                break;
+            }
+            increment(ctx->sv, s);
+            add(ctx->sv, states[i], UINT_MAX);
+        }
+        for (j = 0; j < num_langs; ++j) {
+            lp[j] = 0;
+        }
+        accumulate_signed_sv(lid, subset, ctx, lp);
+
+        for (j = 0; j < num_langs; ++j) {
+            lp[j] = scaled ? subset->nb_pc[j] + subset->nb_ptc_scale[j] * (running[j] + lp[j])
+                           : subset->nb_pc[j] + (running[j] + lp[j]);
+        }
+        logprob_to_prob(lid->kernels, lp, num_langs);
+        out[w] = prob_to_pred(lid, subset, lp);
     }
+    rc = 0;
 
-    off_t model_len = lseek(fd, 0, SEEK_END);
-    model_buf = mmap(NULL, model_len, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (model_buf == MAP_FAILED) {
-        fprintf(stderr, "Failed to map the model file: %s\n", model_path);
-        close(fd);
+done:
+    free(states);
+    free(running);
+    free(piece_end);
+    free(piece_lp);
+    return rc;
+}
+
+LanguageIdentifierStream* alloc_stream(const LanguageIdentifier* lid) {
+    LanguageIdentifierStream* stream;
+
+    if ((stream = (LanguageIdentifierStream*)malloc(sizeof(LanguageIdentifierStream))) == NULL) {
         return NULL;
     }
-
-    msg = langid__language_identifier__unpack(NULL, model_len, model_buf);
-    if (msg == NULL) {
-        fprintf(stderr, "Error unpacking model from: %s\n", model_path);
-        munmap(model_buf, model_len);
-        close(fd);
+    if ((stream->ctx = alloc_context(lid)) == NULL) {
+        free(stream);
         return NULL;
     }
+    stream->lid = lid;
+    stream->subset = NULL;
+    stream_begin(stream, NULL);
 
-    lid = (LanguageIdentifier*)malloc(sizeof(LanguageIdentifier));
-    if (lid == NULL) {
-        fprintf(stderr, "Memory allocation failed for LanguageIdentifier\n");
-        langid__language_identifier__free_unpacked(msg, NULL);
-        munmap(model_buf, model_len);
-        close(fd);
-        return NULL;
+    return stream;
+}
+
+void free_stream(LanguageIdentifierStream* stream) {
+    if (stream == NULL) {
+        return;
+    }
+    if (stream->subset != NULL) {
+        release_subset(stream->subset);
     }
+    free_context(stream->ctx);
+    free(stream);
+}
 
-    lid->sv = alloc_set(msg->num_states);
-    lid->fv = alloc_set(msg->num_feats);
+void stream_begin(LanguageIdentifierStream* stream, const StreamStopPolicy* policy) {
+    /* the document is scored against the languages set when it began */
+    if (stream->subset != NULL) {
+        release_subset(stream->subset);
+    }
+    stream->subset = acquire_subset(stream->lid);
 
-    lid->num_feats = msg->num_feats;
-    lid->num_langs = msg->num_langs;
-    lid->num_states = msg->num_states;
+    clear(stream->ctx->sv);
+    stream->state = 0;
+    stream->num_bytes = 0;
+    stream->done = false;
 
-    lid->tk_nextmove = (unsigned(*)[][256])msg->tk_nextmove;
-    lid->tk_output_c = (unsigned(*)[])msg->tk_output_c;
-    lid->tk_output_s = (unsigned(*)[])msg->tk_output_s;
-    lid->tk_output = (unsigned(*)[])msg->tk_output;
+    stream->stop = policy != NULL;
+    if (policy != NULL) {
+        stream->policy = *policy;
+        stream->next_check = policy->min_bytes;
+    }
+}
 
-    lid->nb_pc = (double(*)[])msg->nb_pc;
-    lid->nb_ptc = (double(*)[])msg->nb_ptc;
-    lid->nb_classes = (char*(*)[])msg->nb_classes;
+/* Whether the prefix seen so far is conclusive enough for the policy */
+static bool stream_should_stop(LanguageIdentifierStream* stream) {
+    const LanguageIdentifier* lid = stream->lid;
+    const LanguageSubset* subset = stream->subset;
+    unsigned int i;
+    double first = 0, second = 0;
 
-    lid->protobuf_model = msg;
+    if (subset->num_langs == 0) {
+        return false;
+    }
 
-    lid->nb_classes_mask = malloc(sizeof(bool) * msg->num_langs);
+    double* lp = stream->ctx->prob;
 
-    if (lid->nb_classes_mask == NULL) {
-        fprintf(stderr, "Memory allocation failed for language_mask\n");
-        free(lid);
-        langid__language_identifier__free_unpacked(msg, NULL);
-        munmap(model_buf, model_len);
-        close(fd);
-        return NULL;
-    } else {
-        for (size_t i = 0; i < msg->num_langs; ++i) {
-            lid->nb_classes_mask[i] = true;
+    sv_to_logprob(lid, subset, stream->ctx, lp);
+    logprob_to_prob(lid->kernels, lp, subset->num_langs);
+
+    for (i = 0; i < subset->num_langs; ++i) {
+        if (lp[i] > first) {
+            second = first;
+            first = lp[i];
+        } else if (lp[i] > second) {
+            second = lp[i];
         }
     }
-    return lid;
+
+    return first >= stream->policy.min_confidence || first - second >= stream->policy.min_margin;
 }
 
-void destroy_identifier(LanguageIdentifier* lid) {
-    if (lid->protobuf_model != NULL) {
-        langid__language_identifier__free_unpacked(lid->protobuf_model, NULL);
+bool stream_feed(LanguageIdentifierStream* stream, const char* chunk, unsigned int chunk_len) {
+    if (stream->done) {
+        return true;
     }
-    free(lid->nb_classes_mask);
-    free_set(lid->sv);
-    free_set(lid->fv);
-    free(lid);
+
+    stream->state = text_to_sv(stream->lid, stream->state, chunk, chunk_len, stream->ctx->sv);
+    stream->num_bytes += chunk_len;
+
+    if (stream->stop && stream->num_bytes >= stream->next_check) {
+        stream->done = stream_should_stop(stream);
+        stream->next_check = stream->num_bytes + stream->policy.check_interval;
+    }
+
+    return stream->done;
+}
+
+LanguageConfidence stream_result(LanguageIdentifierStream* stream) {
+    return sv_to_pred(stream->lid, stream->subset, stream->ctx);
 }
 
-/* 
- * Convert a text stream into a feature vector. The feature vector counts
- * how many times each sequence is seen.
+/* Shared state of a batch. Documents are handed out in chunks through
+ * an atomic cursor; the job is freed by whoever drops the last reference,
+ * as pool workers may only get to it after the caller has returned.
  */
-static void text_to_fv(LanguageIdentifier* lid, const char* text, unsigned int text_len, Set* sv, Set* fv) {
-    unsigned int i, j, m, s = 0;
+typedef struct {
+    const LanguageIdentifier* lid;
+    const LanguageSubset* subset;
+    unsigned int num_texts;
+    unsigned int chunk_size;
+    bool ranking;
+    bool blocked;
 
-    clear(sv);
-    clear(fv);
+    /* texts[i] of text_lens[i] bytes or, without texts, bytes offsets[i] to
+     * offsets[i + 1] of data, offsets being offset_size bytes each
+     */
+    const char* const* texts;
+    const unsigned int* text_lens;
+    const char* data;
+    const void* offsets;
+    size_t offset_size;
+
+    /* results, in out or else in the columns languages, confidences and,
+     * unless NULL, probs
+     */
+    LanguageConfidence* out;
+    int16_t* languages;
+    float* confidences;
+    float* probs;
+
+    atomic_uint next;
 
-    for (i = 0; i < text_len; ++i) {
-        s = (*lid->tk_nextmove)[s][(unsigned char)text[i]];
-        add(sv, s, 1);
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    unsigned int done;
+    unsigned int refs;
+} BatchJob;
+
+static void release_batch_job(BatchJob* job) {
+    pthread_mutex_lock(&job->lock);
+    unsigned int refs = --job->refs;
+    pthread_mutex_unlock(&job->lock);
+
+    if (refs == 0) {
+        pthread_cond_destroy(&job->finished);
+        pthread_mutex_destroy(&job->lock);
+        free(job);
     }
+}
 
-    /* convert the SV into the FV */
-    for (i = 0; i < sv->members; ++i) {
-        m = sv->dense[i];
-        for (j = 0; j < (*lid->tk_output_c)[m]; ++j) {
-            add(fv, (*lid->tk_output)[(*lid->tk_output_s)[m] + j], sv->counts[i]);
+/* Blocked batches score the documents of a thread BATCH_BLOCK_DOCS at a
+ * time: the rows of nb_ptc (or of the state posteriors) used by a block
+ * are gathered into a sparse [row][document] matrix, which is multiplied
+ * against the table BATCH_TILE_LANGS columns at a time. Each row is then
+ * read once per block instead of once per document, while the tile of the
+ * posteriors of the block, 24KB at most, stays in L1. Rows are added in
+ * the order they first appear in the block rather than in the order of
+ * each document, so results are unchanged for integer nb_ptc encodings
+ * and within rounding otherwise.
+ */
+#define BATCH_BLOCK_DOCS 32
+#define BATCH_BLOCK_ENTRIES 16384
+#define BATCH_TILE_LANGS 96
+
+typedef struct {
+    /* rows used by the block, counting the documents using each */
+    Set* rows;
+
+    /* (row, document, count) entries of the documents, in turn */
+    unsigned int num_entries;
+    unsigned int* entry_row;
+    unsigned int* entry_doc;
+    unsigned int* entry_count;
+
+    /* the same entries grouped by row */
+    unsigned int* row_doc;
+    unsigned int* row_count;
+
+    /* index in the batch and [num_langs] posteriors of each document */
+    unsigned int num_docs;
+    unsigned int doc_index[BATCH_BLOCK_DOCS];
+    double* logprob;
+} BatchBlock;
+
+static void free_batch_block(BatchBlock* block) {
+    if (block == NULL) {
+        return;
+    }
+    if (block->rows != NULL) {
+        free_set(block->rows);
+    }
+    free(block->entry_row);
+    free(block->entry_doc);
+    free(block->entry_count);
+    free(block->row_doc);
+    free(block->row_count);
+    free(block->logprob);
+    free(block);
+}
+
+static BatchBlock* alloc_batch_block(const LanguageIdentifier* lid) {
+    BatchBlock* block;
+
+    if ((block = (BatchBlock*)calloc(1, sizeof(BatchBlock))) == NULL) {
+        return NULL;
+    }
+    /* rows are features, or states with state posteriors */
+    block->rows = alloc_set(lid->num_feats > lid->num_states ? lid->num_feats : lid->num_states);
+    block->entry_row = (unsigned int*)malloc(sizeof(unsigned int) * BATCH_BLOCK_ENTRIES);
+    block->entry_doc = (unsigned int*)malloc(sizeof(unsigned int) * BATCH_BLOCK_ENTRIES);
+    block->entry_count = (unsigned int*)malloc(sizeof(unsigned int) * BATCH_BLOCK_ENTRIES);
+    block->row_doc = (unsigned int*)malloc(sizeof(unsigned int) * BATCH_BLOCK_ENTRIES);
+    block->row_count = (unsigned int*)malloc(sizeof(unsigned int) * BATCH_BLOCK_ENTRIES);
+    block->logprob = (double*)malloc(sizeof(double) * ((size_t)BATCH_BLOCK_DOCS * lid->num_langs + 1));
+
+    if (block->entry_row == NULL || block->entry_doc == NULL || block->entry_count == NULL ||
+        block->row_doc == NULL || block->row_count == NULL || block->logprob == NULL) {
+        free_batch_block(block);
+        return NULL;
+    }
+    return block;
+}
+
+/* Appends the rows of counts to the block as document index i of the batch */
+static void block_add(const LanguageIdentifier* lid, BatchBlock* block, const Set* counts, bool by_state,
+                      unsigned int i) {
+    unsigned int m, row, doc = block->num_docs++;
+
+    block->doc_index[doc] = i;
+    for (m = 0; m < counts->members; ++m) {
+        row = by_state ? lid->tk_state_row[counts->dense[m]] : counts->dense[m];
+        if (row == STATE_ROW_NONE) {
+            continue;
         }
+        add(block->rows, row, 1);
+        block->entry_row[block->num_entries] = row;
+        block->entry_doc[block->num_entries] = doc;
+        block->entry_count[block->num_entries++] = counts->counts[m];
     }
+}
 
-    return;
+/* Columns first to first + n of a row as doubles, integer rows unscaled,
+ * widened into buf unless the table already holds doubles
+ */
+static const double* row_tile(const LanguageIdentifier* lid, const LanguageSubset* subset, bool by_state, size_t row,
+                              unsigned int first, unsigned int n, double buf[]) {
+    const Kernels* kernels = lid->kernels;
+    size_t offset = row * subset->num_langs + first;
+
+    if (by_state) {
+        return subset->state_ptc + offset;
+    }
+    if (lid->nb_ptc_encoding == NB_PTC_F64) {
+        return (const double*)subset->nb_ptc + offset;
+    }
+
+    /* 0 + 1 * x is exact */
+    memset(buf, 0, sizeof(double) * n);
+    switch (lid->nb_ptc_encoding) {
+    case NB_PTC_F64:
+        break;
+    case NB_PTC_F32:
+        kernels->accumulate_f32(buf, (const float*)subset->nb_ptc + offset, 1, n);
+        break;
+    case NB_PTC_I16:
+        kernels->accumulate_i16(buf, (const int16_t*)subset->nb_ptc + offset, 1, n);
+        break;
+    case NB_PTC_I8:
+        kernels->accumulate_i8(buf, (const int8_t*)subset->nb_ptc + offset, 1, n);
+        break;
+    }
+    return buf;
 }
 
-static void fv_to_logprob(LanguageIdentifier* lid, Set* fv, double logprob[]) {
-    unsigned int i, j, m;
-    double* nb_ptc_p;
+/* Posteriors of every document of the block, the blocked counts_to_logprob */
+static void block_to_logprob(const LanguageIdentifier* lid, const LanguageSubset* subset, BatchBlock* block,
+                             bool by_state) {
+    Set* rows = block->rows;
+    unsigned int i, d, e, r, first, n, start, end, k = subset->num_langs;
+    bool scaled = lid->nb_ptc_encoding == NB_PTC_I16 || lid->nb_ptc_encoding == NB_PTC_I8;
+    double tile[2 * BATCH_TILE_LANGS];
 
-    /* Initialize using prior taking into account supported language mask */
-    for (i = 0; i < lid->num_langs; ++i) {
-        if (lid->nb_classes_mask[i]) {
-            logprob[i] = (*lid->nb_pc)[i];
-        } else {
-            logprob[i] = -INFINITY;
+    for (d = 0; d < block->num_docs; ++d) {
+        for (i = 0; i < k; ++i) {
+            block->logprob[(size_t)d * k + i] = scaled ? 0 : subset->nb_pc[i];
         }
     }
 
-    /* Compute posterior for each class */
-    for (i = 0; i < fv->members; ++i) {
-        m = fv->dense[i];
-        /* NUM_FEATS * NUM_LANGS */
-        nb_ptc_p = &(*lid->nb_ptc)[m * lid->num_langs];
-        for (j = 0; j < lid->num_langs; ++j) {
-            logprob[j] += fv->counts[i] * (*nb_ptc_p);
-            nb_ptc_p += 1;
+    /* rows->counts turns from the number of entries of each row into where they start, then end */
+    for (r = 0, start = 0; r < rows->members; ++r) {
+        end = start + rows->counts[r];
+        rows->counts[r] = start;
+        start = end;
+    }
+    for (e = 0; e < block->num_entries; ++e) {
+        unsigned int at = rows->counts[rows->sparse[block->entry_row[e]]]++;
+        block->row_doc[at] = block->entry_doc[e];
+        block->row_count[at] = block->entry_count[e];
+    }
+
+    /* the last tile takes the columns left over, so that no tile is narrower than a vector */
+    for (first = 0; first < k; first += n) {
+        n = k - first < 2 * BATCH_TILE_LANGS ? k - first : BATCH_TILE_LANGS;
+        for (r = 0, start = 0; r < rows->members; start = rows->counts[r++]) {
+            const double* row = row_tile(lid, subset, by_state, rows->dense[r], first, n, tile);
+            lid->kernels->accumulate_docs(block->logprob + first, k, block->row_doc + start, block->row_count + start,
+                                          rows->counts[r] - start, row, n);
         }
     }
 
-    return;
+    if (scaled) {
+        for (d = 0; d < block->num_docs; ++d) {
+            for (i = 0; i < k; ++i) {
+                block->logprob[(size_t)d * k + i] =
+                    subset->nb_pc[i] + subset->nb_ptc_scale[i] * block->logprob[(size_t)d * k + i];
+            }
+        }
+    }
 }
 
-static void logprob_to_prob(double logprob[], unsigned int size) {
-    /*  python reference: pd = 1 / np.exp(pd[None,:] - pd[:,None]).sum(1)
-    this is basically softmax:
-        x = pd[i]
-        new_pd[i] = 1 / sum_{y in pd} e^(y - x) = e^x / sum_{y in pd} e^y = softmax(x)
-    */
+/* Text of document i of the batch */
+static inline const char* batch_text(const BatchJob* job, unsigned int i, unsigned int* text_len) {
+    size_t start, end;
 
-    unsigned int i;
-    double sum = 0.0;
-    double max_logprob = -INFINITY;
+    if (job->texts != NULL) {
+        *text_len = job->text_lens[i];
+        return job->texts[i];
+    }
+    if (job->offset_size == sizeof(int32_t)) {
+        start = ((const int32_t*)job->offsets)[i];
+        end = ((const int32_t*)job->offsets)[i + 1];
+    } else {
+        start = ((const int64_t*)job->offsets)[i];
+        end = ((const int64_t*)job->offsets)[i + 1];
+    }
+    *text_len = end - start;
+    return job->data + start;
+}
+
+/* Writes the result of document i of the batch given its probabilities */
+static void batch_output(BatchJob* job, unsigned int i, const double prob[]) {
+    const LanguageIdentifier* lid = job->lid;
+    const LanguageSubset* subset = job->subset;
+    unsigned int j, pred_idx;
 
-    for (i = 0; i < size; ++i) {
-        if (logprob[i] > max_logprob) {
-            max_logprob = logprob[i];
+    if (job->out == NULL) {
+        /* as prob_to_pred, the first language when there is none to pick from */
+        pred_idx = subset->num_langs > 0 ? prob_to_pred_idx(prob, subset->num_langs) : 0;
+        job->languages[i] = subset->num_langs > 0 ? subset->langs[pred_idx] : 0;
+        job->confidences[i] = subset->num_langs > 0 ? prob[pred_idx] : 0;
+        if (job->probs != NULL) {
+            float* row = job->probs + (size_t)i * lid->num_langs;
+            memset(row, 0, sizeof(float) * lid->num_langs);
+            for (j = 0; j < subset->num_langs; ++j) {
+                row[subset->langs[j]] = prob[j];
+            }
         }
+    } else if (job->ranking) {
+        prob_to_rank(lid, job->subset, prob, lid->num_langs, 0, &job->out[(size_t)i * lid->num_langs]);
+    } else {
+        job->out[i] = prob_to_pred(lid, job->subset, prob);
     }
+}
 
-    for (i = 0; i < size; ++i) {
-        if (logprob[i] == -INFINITY) {
-            logprob[i] = 0;
-        } else {
-            logprob[i] = exp(logprob[i] - max_logprob);
-        }
-        sum += logprob[i];
+/* batch_output for probabilities just computed, keeping them in the result cache, if any */
+static void batch_result(BatchJob* job, unsigned int i, const double prob[]) {
+    const LanguageIdentifier* lid = job->lid;
+    unsigned int text_len;
+    const char* text = batch_text(job, i, &text_len);
+
+    if (lid->cache != NULL && text_len <= RESULT_CACHE_MAX_KEY_LEN) {
+        result_cache_put(lid->cache, job->subset->generation, text, text_len, prob, job->subset->num_langs);
     }
+    batch_output(job, i, prob);
+}
 
-    if (sum == 0) {
+/* Scores the documents gathered in the block and empties it */
+static void score_block(BatchJob* job, BatchBlock* block) {
+    const LanguageIdentifier* lid = job->lid;
+    const LanguageSubset* subset = job->subset;
+    LanguageIdentifierCounters* counters = lid->counters;
+    bool stats = atomic_load_explicit(&counters->enabled, memory_order_relaxed);
+    unsigned int d, k = subset->num_langs;
+    uint64_t t0, t1, t2;
+
+    if (block->num_docs == 0) {
         return;
     }
 
-    for (i = 0; i < size; ++i) {
-        logprob[i] /= sum;
+    t0 = stats ? read_cycles() : 0;
+    block_to_logprob(lid, subset, block, subset->state_ptc != NULL);
+    t1 = stats ? read_cycles() : 0;
+    for (d = 0; d < block->num_docs; ++d) {
+        logprob_to_prob(lid->kernels, block->logprob + (size_t)d * k, k);
+    }
+    t2 = stats ? read_cycles() : 0;
+    if (stats) {
+        count_stage_cycles(counters, 2, t1 - t0);
+        count_stage_cycles(counters, 3, t2 - t1);
+    }
+
+    for (d = 0; d < block->num_docs; ++d) {
+        batch_result(job, block->doc_index[d], block->logprob + (size_t)d * k);
     }
 
-    return;
+    clear(block->rows);
+    block->num_entries = 0;
+    block->num_docs = 0;
 }
 
-static unsigned int prob_to_pred_idx(double prob[], unsigned int size) {
-    unsigned int i, m = 0;
+/* texts of a batch tokenized together, see texts_to_sv */
+#define BATCH_TOKENIZER_LANES 8
+#define BATCH_TOKENIZER_PREFETCH false
 
-    for (i = 1; i < size; ++i) {
-        if (prob[m] < prob[i]) {
-            m = i;
+/* Scratch state of a thread working through a batch */
+typedef struct {
+    LanguageIdentifierContext* ctx;
+    /* states counted in each of the texts tokenized together */
+    Set* lane_sv[BATCH_TOKENIZER_LANES];
+    /* NULL unless the batch is blocked */
+    BatchBlock* block;
+} BatchScratch;
+
+static void free_batch_scratch(BatchScratch* scratch) {
+    unsigned int l;
+
+    if (scratch == NULL) {
+        return;
+    }
+    for (l = 0; l < BATCH_TOKENIZER_LANES; ++l) {
+        if (scratch->lane_sv[l] != NULL) {
+            free_set(scratch->lane_sv[l]);
         }
     }
+    free_batch_block(scratch->block);
+    free_context(scratch->ctx);
+    free(scratch);
+}
 
-    return m;
+static BatchScratch* alloc_batch_scratch(const LanguageIdentifier* lid, bool blocked) {
+    BatchScratch* scratch;
+    unsigned int l;
+
+    if ((scratch = (BatchScratch*)calloc(1, sizeof(BatchScratch))) == NULL) {
+        return NULL;
+    }
+    for (l = 0; l < BATCH_TOKENIZER_LANES; ++l) {
+        scratch->lane_sv[l] = alloc_set(lid->num_states);
+    }
+    if ((scratch->ctx = alloc_context(lid)) == NULL || (blocked && (scratch->block = alloc_batch_block(lid)) == NULL)) {
+        free_batch_scratch(scratch);
+        return NULL;
+    }
+    return scratch;
 }
 
-LanguageConfidence classify(LanguageIdentifier* lid, const char* text, unsigned int text_len) {
-    double lp[lid->num_langs];
-    unsigned int pred_idx;
-    LanguageConfidence pred;
+/* Scores document i of the batch given the states counted in sv, or adds
+ * it to the block of a blocked batch, with the stats of the stages after
+ * the tokenizer when stats is set
+ */
+static void score_batch_document(BatchJob* job, BatchScratch* scratch, unsigned int i, unsigned int text_len,
+                                 const Set* sv, bool stats) {
+    const LanguageIdentifier* lid = job->lid;
+    const LanguageSubset* subset = job->subset;
+    LanguageIdentifierCounters* counters = lid->counters;
+    BatchBlock* block = scratch->block;
+    bool by_state = subset->state_ptc != NULL;
+    const Set* counts = by_state ? sv : scratch->ctx->fv;
+    double* lp = scratch->ctx->prob;
+    uint64_t t1, t2, t3, t4;
+
+    t1 = stats ? read_cycles() : 0;
+    if (!by_state) {
+        sv_to_fv(lid, sv, scratch->ctx->fv);
+    }
+    t2 = stats ? read_cycles() : 0;
+    if (stats) {
+        count_document(counters, text_len, sv->members, counts->members);
+        count_stage_cycles(counters, 1, t2 - t1);
+    }
+
+    /* a document too long to share a block has nothing to gain from one */
+    if (block != NULL && counts->members <= BATCH_BLOCK_ENTRIES) {
+        if (block->num_docs == BATCH_BLOCK_DOCS || block->num_entries + counts->members > BATCH_BLOCK_ENTRIES) {
+            score_block(job, block);
+        }
+        block_add(lid, block, counts, by_state, i);
+        return;
+    }
 
-    text_to_fv(lid, text, text_len, lid->sv, lid->fv);
-    fv_to_logprob(lid, lid->fv, lp);
-    logprob_to_prob(lp, lid->num_langs);
+    counts_to_logprob(lid, subset, counts, by_state, lp);
+    t3 = stats ? read_cycles() : 0;
+    logprob_to_prob(lid->kernels, lp, subset->num_langs);
+    t4 = stats ? read_cycles() : 0;
+    if (stats) {
+        count_stage_cycles(counters, 2, t3 - t2);
+        count_stage_cycles(counters, 3, t4 - t3);
+    }
+    batch_result(job, i, lp);
+}
 
-    pred_idx = prob_to_pred_idx(lp, lid->num_langs);
+/* Documents start to end of the batch, the subset having languages. Those
+ * not in the result cache are tokenized BATCH_TOKENIZER_LANES at a time
+ * with texts_to_sv, the tokenizer cycles of each group counting once in
+ * the stats, then scored in turn.
+ */
+static void run_batch_chunk(BatchJob* job, BatchScratch* scratch, unsigned int start, unsigned int end) {
+    const LanguageIdentifier* lid = job->lid;
+    const LanguageSubset* subset = job->subset;
+    LanguageIdentifierCounters* counters = lid->counters;
+    const char* texts[BATCH_TOKENIZER_LANES];
+    unsigned int text_lens[BATCH_TOKENIZER_LANES], index[BATCH_TOKENIZER_LANES];
+    double* lp = scratch->ctx->prob;
+    unsigned int i = start, l, num_lanes;
+    uint64_t t0, t1;
+    bool stats;
 
-    pred.language = (*lid->nb_classes)[pred_idx];
-    pred.confidence = lp[pred_idx];
+    while (i < end) {
+        for (num_lanes = 0; num_lanes < BATCH_TOKENIZER_LANES && i < end; ++i) {
+            texts[num_lanes] = batch_text(job, i, &text_lens[num_lanes]);
+            if (lid->cache != NULL && text_lens[num_lanes] <= RESULT_CACHE_MAX_KEY_LEN &&
+                result_cache_get(lid->cache, subset->generation, texts[num_lanes], text_lens[num_lanes], lp,
+                                 subset->num_langs)) {
+                count_cache_hit(counters, text_lens[num_lanes]);
+                batch_output(job, i, lp);
+                continue;
+            }
+            index[num_lanes++] = i;
+        }
 
-    return pred;
+        stats = atomic_load_explicit(&counters->enabled, memory_order_relaxed);
+        t0 = stats ? read_cycles() : 0;
+        texts_to_sv(lid, texts, text_lens, num_lanes, scratch->lane_sv, BATCH_TOKENIZER_PREFETCH);
+        t1 = stats ? read_cycles() : 0;
+        if (stats) {
+            count_stage_cycles(counters, 0, t1 - t0);
+        }
+
+        for (l = 0; l < num_lanes; ++l) {
+            score_batch_document(job, scratch, index[l], text_lens[l], scratch->lane_sv[l], stats);
+        }
+    }
+
+    if (scratch->block != NULL) {
+        score_block(job, scratch->block);
+    }
 }
 
-static int compare_language_confidence(const void* first, const void* second) {
-    LanguageConfidence* first_lc = (LanguageConfidence*)first;
-    LanguageConfidence* second_ls = (LanguageConfidence*)second;
+static void run_batch_job(BatchJob* job, BatchScratch* scratch) {
+    unsigned int start, end, i;
+    double none[1];
 
-    return (first_lc->confidence < second_ls->confidence) - (first_lc->confidence > second_ls->confidence);
+    while ((start = atomic_fetch_add(&job->next, job->chunk_size)) < job->num_texts) {
+        end = start + job->chunk_size < job->num_texts ? start + job->chunk_size : job->num_texts;
+
+        if (job->subset->num_langs > 0) {
+            run_batch_chunk(job, scratch, start, end);
+        } else {
+            /* no language to score */
+            for (i = start; i < end; ++i) {
+                batch_output(job, i, none);
+            }
+        }
+
+        pthread_mutex_lock(&job->lock);
+        job->done += end - start;
+        if (job->done == job->num_texts) {
+            pthread_cond_signal(&job->finished);
+        }
+        pthread_mutex_unlock(&job->lock);
+    }
 }
 
-void rank(LanguageIdentifier* lid, const char* text, unsigned int text_len, LanguageConfidence* out) {
-    double lp[lid->num_langs];
+static void batch_worker(void* arg) {
+    BatchJob* job = (BatchJob*)arg;
+    BatchScratch* scratch;
+
+    /* the caller works through the batch too, so a helper that cannot
+     * get scratch state may simply leave the chunks to the others
+     */
+    if (atomic_load(&job->next) < job->num_texts && (scratch = alloc_batch_scratch(job->lid, job->blocked)) != NULL) {
+        run_batch_job(job, scratch);
+        free_batch_scratch(scratch);
+    }
+    release_batch_job(job);
+}
+
+/* Runs the batch of spec, whose lid, num_texts, ranking, blocked, input and
+ * output are set
+ */
+static int run_batch(const BatchJob* spec, unsigned int num_threads) {
+    const LanguageIdentifier* lid = spec->lid;
+    unsigned int num_texts = spec->num_texts;
+    BatchScratch* scratch;
+    LanguageSubset* subset;
+    ThreadPool* pool = NULL;
+    BatchJob* job;
     unsigned int i;
 
-    text_to_fv(lid, text, text_len, lid->sv, lid->fv);
-    fv_to_logprob(lid, lid->fv, lp);
-    logprob_to_prob(lp, lid->num_langs);
+    if (num_texts == 0) {
+        return 0;
+    }
+    if ((scratch = alloc_batch_scratch(lid, spec->blocked)) == NULL) {
+        return -1;
+    }
+
+    if (num_threads == 0) {
+        num_threads = num_cpus();
+    }
+    if (num_threads > num_texts) {
+        num_threads = num_texts;
+    }
+    if (num_threads > 1 && (pool = get_default_threadpool()) != NULL && num_threads > threadpool_size(pool) + 1) {
+        num_threads = threadpool_size(pool) + 1;
+    }
 
-    for (i = 0; i < lid->num_langs; ++i) {
-        out[i].language = (*lid->nb_classes)[i];
-        out[i].confidence = lp[i];
+    if ((job = (BatchJob*)malloc(sizeof(BatchJob))) == NULL) {
+        free_batch_scratch(scratch);
+        return -1;
+    }
+    /* the whole batch is scored against the languages set when it started */
+    subset = acquire_subset(lid);
+    *job = *spec;
+    job->subset = subset;
+    /* several chunks per thread so that uneven document lengths even out */
+    job->chunk_size = num_texts / (num_threads * 8);
+    job->chunk_size = job->chunk_size < 1 ? 1 : job->chunk_size > 256 ? 256 : job->chunk_size;
+    atomic_init(&job->next, 0);
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->finished, NULL);
+    job->done = 0;
+    job->refs = 1;
+
+    for (i = 1; pool != NULL && i < num_threads; ++i) {
+        pthread_mutex_lock(&job->lock);
+        job->refs++;
+        pthread_mutex_unlock(&job->lock);
+
+        if (threadpool_submit(pool, batch_worker, job) != 0) {
+            release_batch_job(job);
+            break;
+        }
+    }
+
+    run_batch_job(job, scratch);
+    free_batch_scratch(scratch);
+
+    pthread_mutex_lock(&job->lock);
+    while (job->done < job->num_texts) {
+        pthread_cond_wait(&job->finished, &job->lock);
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    release_batch_job(job);
+    release_subset(subset);
+    return 0;
+}
+
+int classify_batch(const LanguageIdentifier* lid, const char* const texts[], const unsigned int text_lens[],
+                   unsigned int num_texts, LanguageConfidence* out, unsigned int num_threads) {
+    BatchJob spec = {.lid = lid, .num_texts = num_texts, .texts = texts, .text_lens = text_lens, .out = out};
+    return run_batch(&spec, num_threads);
+}
+
+int rank_batch(const LanguageIdentifier* lid, const char* const texts[], const unsigned int text_lens[],
+               unsigned int num_texts, LanguageConfidence* out, unsigned int num_threads) {
+    BatchJob spec = {
+        .lid = lid, .num_texts = num_texts, .ranking = true, .texts = texts, .text_lens = text_lens, .out = out};
+    return run_batch(&spec, num_threads);
+}
+
+int classify_batch_blocked(const LanguageIdentifier* lid, const char* const texts[], const unsigned int text_lens[],
+                           unsigned int num_texts, LanguageConfidence* out, unsigned int num_threads) {
+    BatchJob spec = {
+        .lid = lid, .num_texts = num_texts, .blocked = true, .texts = texts, .text_lens = text_lens, .out = out};
+    return run_batch(&spec, num_threads);
+}
+
+int rank_batch_blocked(const LanguageIdentifier* lid, const char* const texts[], const unsigned int text_lens[],
+                       unsigned int num_texts, LanguageConfidence* out, unsigned int num_threads) {
+    BatchJob spec = {.lid = lid,
+                     .num_texts = num_texts,
+                     .ranking = true,
+                     .blocked = true,
+                     .texts = texts,
+                     .text_lens = text_lens,
+                     .out = out};
+    return run_batch(&spec, num_threads);
+}
+
+int classify_column(const LanguageIdentifier* lid, const char* data, const void* offsets, size_t offset_size,
+                    unsigned int num_texts, int16_t* languages, float* confidences, float* probs,
+                    unsigned int num_threads, bool blocked) {
+    BatchJob spec = {.lid = lid,
+                     .num_texts = num_texts,
+                     .blocked = blocked,
+                     .data = data,
+                     .offsets = offsets,
+                     .offset_size = offset_size,
+                     .languages = languages,
+                     .confidences = confidences,
+                     .probs = probs};
+
+    if (offset_size != sizeof(int32_t) && offset_size != sizeof(int64_t)) {
+        fprintf(stderr, "Offsets of %zu bytes are not supported\n", offset_size);
+        return -1;
+    }
+    return run_batch(&spec, num_threads);
+}
+
+int enable_cache(LanguageIdentifier* lid, size_t capacity) {
+    ResultCache* cache = NULL;
+
+    if (capacity > 0 && (cache = alloc_result_cache(capacity, lid->num_langs)) == NULL) {
+        fprintf(stderr, "Memory allocation failed for result cache\n");
+        return -1;
+    }
+    free_result_cache(lid->cache);
+    lid->cache = cache;
+    return 0;
+}
+
+bool get_cache_stats(const LanguageIdentifier* lid, ResultCacheStats* stats) {
+    if (lid->cache == NULL) {
+        return false;
+    }
+    result_cache_stats(lid->cache, stats);
+    return true;
+}
+
+static int swap_subset(LanguageIdentifier* lid, const bool mask[]) {
+    LanguageSubset *subset, *old_subset;
+
+    if ((subset = alloc_subset(lid, mask)) == NULL) {
+        return -1;
     }
 
-    // sort in descending order
-    qsort(out, lid->num_langs, sizeof(LanguageConfidence), compare_language_confidence);
+    pthread_mutex_lock(&lid->subset_lock);
+    old_subset = atomic_load_explicit(&lid->subset, memory_order_relaxed);
+    atomic_store_explicit(&lid->subset, subset, memory_order_release);
+    pthread_mutex_unlock(&lid->subset_lock);
+
+    /* contexts and calls still scoring against the old subset free it when done */
+    release_subset(old_subset);
+
+    memcpy(lid->nb_classes_mask, mask, sizeof(bool) * lid->num_langs);
+    return 0;
+}
+
+int set_state_posteriors(LanguageIdentifier* lid, bool enabled) {
+    bool mask[lid->num_langs], was_enabled = lid->state_posteriors;
+    unsigned int s;
+
+    if (enabled && lid->tk_state_row == NULL) {
+        if ((lid->tk_state_row = (uint32_t*)malloc(sizeof(uint32_t) * lid->num_states)) == NULL) {
+            fprintf(stderr, "Memory allocation failed for state posteriors\n");
+            return -1;
+        }
+        /* the table of a subset only has rows for states with output */
+        for (s = 0; s < lid->num_states; ++s) {
+            lid->tk_state_row[s] = (*lid->tk_output_c)[s] > 0 ? lid->num_state_rows++ : STATE_ROW_NONE;
+        }
+    }
+
+    lid->state_posteriors = enabled;
+    memcpy(mask, lid->nb_classes_mask, sizeof(bool) * lid->num_langs);
+    if (swap_subset(lid, mask) != 0) {
+        lid->state_posteriors = was_enabled;
+        return -1;
+    }
+    return 0;
 }
 
 int set_languages(LanguageIdentifier* lid, const char* langs[], unsigned int num_langs) {
+    bool mask[lid->num_langs];
+
     if (langs == NULL) {
         for (size_t i = 0; i < lid->num_langs; ++i) {
-            lid->nb_classes_mask[i] = true;
+            mask[i] = true;
         }
-        return 0;
+        return swap_subset(lid, mask);
     }
 
-    size_t lang_to_nb_classes_index[num_langs];
+    size_t lang_to_nb_classes_index[num_langs + 1];
 
     for (size_t i = 0; i < num_langs; ++i) {
         const char* lang = langs[i];
@@ -273,12 +2392,12 @@ int set_languages(LanguageIdentifier* lid, const char* langs[], unsigned int num
     }
 
     for (size_t i = 0; i < lid->num_langs; ++i) {
-        lid->nb_classes_mask[i] = false;
+        mask[i] = false;
     }
 
     for (size_t i = 0; i < num_langs; ++i) {
-        lid->nb_classes_mask[lang_to_nb_classes_index[i]] = true;
+        mask[lang_to_nb_classes_index[i]] = true;
     }
 
-    return 0;
+    return swap_subset(lid, mask);
 }
@@ -1,49 +1,345 @@
 #ifndef _LANGID_H
 #define _LANGID_H
 
+#include "kernels.h"
 #include "langid.pb-c.h"
+#include "resultcache.h"
 #include "sparseset.h"
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 
-/* Structure containing all the state required to
- * implement a language identifier
+/* A language, index in nb_classes of the identifier, and its confidence */
+typedef struct {
+    const char* language;
+    double confidence;
+    unsigned int index;
+} LanguageConfidence;
+
+/* Classifier tables restricted to the languages picked by set_languages */
+typedef struct LanguageSubset LanguageSubset;
+
+/* Per-call scratch state. A context is only ever used by one call at a
+ * time, so each thread classifying with a shared identifier needs its own.
+ */
+typedef struct {
+    /* sparsesets for counting states and features. these are
+     * kept in a context as the clear operation on them
+     * is much less costly than allocating them from scratch
+     */
+    Set *sv, *fv;
+
+    /* [num_langs + 1] probabilities of the languages of a call, and
+     * [num_langs] entries for callers of rank_r with nowhere else to put
+     * them, so that classifying allocates nothing
+     */
+    double* prob;
+    LanguageConfidence* ranking;
+
+    /* reference to the subset of the identifier last classified with, kept
+     * until set_languages replaces it so that calls share no writes
+     */
+    LanguageSubset* subset;
+} LanguageIdentifierContext;
+
+/* Storage of the nb_ptc table. Integer encodings hold nb_ptc / nb_ptc_scale
+ * rounded to the nearest integer, with one scale per language.
+ */
+typedef enum {
+    NB_PTC_F64 = 0,
+    NB_PTC_F32 = 1,
+    NB_PTC_I16 = 2,
+    NB_PTC_I8 = 3,
+} NbPtcEncoding;
+
+/* Counters of the documents classified by an identifier, see get_stats */
+typedef struct LanguageIdentifierCounters LanguageIdentifierCounters;
+
+/* Structure containing the model required to implement a language
+ * identifier. The model tables are never written after load_identifier,
+ * so an identifier can be shared between threads as long as each of them
+ * classifies through its own LanguageIdentifierContext.
  */
 typedef struct {
     unsigned int num_feats;
     unsigned int num_langs;
     unsigned int num_states;
 
-    unsigned (*tk_nextmove)[][256];
+    /* Tokenizer DFA over byte equivalence classes: bytes that lead to the
+     * same state from every state share a class, and the transition from
+     * state s through byte b is tk_transitions[s * tk_num_classes + tk_byte_class[b]].
+     * States are stored on tk_state_size bytes, 2 whenever num_states fits.
+     */
+    unsigned int tk_num_classes;
+    uint8_t tk_byte_class[256];
+    unsigned int tk_state_size;
+    const void* tk_transitions;
+    void* tk_transitions_buf; /* heap table built at load time, if any */
+
     unsigned (*tk_output_c)[];
     unsigned (*tk_output_s)[];
     unsigned (*tk_output)[];
 
+    /* with state posteriors, subsets sum the nb_ptc rows of the outputs of
+     * each state once, so that scoring goes straight from state counts.
+     * tk_state_row[s] is the row of state s, STATE_ROW_NONE without output.
+     */
+    bool state_posteriors;
+    unsigned int num_state_rows;
+    uint32_t* tk_state_row;
+
     double (*nb_pc)[];
-    double (*nb_ptc)[];
+
+    /* [num_feats][num_langs] array of nb_ptc_encoding elements */
+    NbPtcEncoding nb_ptc_encoding;
+    const void* nb_ptc;
+    double (*nb_ptc_scale)[];
 
     char* (*nb_classes)[];
     bool* nb_classes_mask;
 
+    /* languages scored by classify and rank, published by set_languages
+     * under subset_lock while readers hold a reference to the old one.
+     * Contexts only take the lock when it differs from their own subset
+     */
+    _Atomic(LanguageSubset*) subset;
+    pthread_mutex_t subset_lock;
+
+    /* disabled unless set_stats_enabled */
+    LanguageIdentifierCounters* counters;
+
+    /* results of short texts, NULL unless enable_cache */
+    ResultCache* cache;
+
+    /* vector kernels picked for the cpu at load time */
+    const Kernels* kernels;
+
     Langid__LanguageIdentifier* protobuf_model;
 
-    /* sparsesets for counting states and features. these are
-     * part of LanguageIdentifier as the clear operation on them
-     * is much less costly than allocating them from scratch
-     */
-    Set *sv, *fv;
+    /* read-only mapping of a flat model file the tables point into */
+    void* model_map;
+    size_t model_map_len;
+
+    /* context used by the non-reentrant classify and rank */
+    LanguageIdentifierContext* context;
 
 } LanguageIdentifier;
 
+#define STATE_ROW_NONE UINT32_MAX
+
+
+/* Snapshot of the counters of an identifier. Every classify or rank call
+ * made while they are enabled counts its document: its length, how many
+ * distinct states and features it goes through, in histograms where bucket
+ * 0 counts 0 and bucket i > 0 counts [2^(i-1), 2^i), and the cycles spent
+ * in each stage of the pipeline (nanoseconds on cpus without a cycle
+ * counter), cycles_per_second telling how to turn them into time.
+ * A document served by the result cache counts in calls, bytes and
+ * cache_hits only, as it goes through none of the stages.
+ */
+#define STATS_HISTOGRAM_BUCKETS 16
+#define STATS_NUM_STAGES 4
+
 typedef struct {
-    const char* language;
-    double confidence;
-} LanguageConfidence;
+    bool enabled;
+    unsigned long long calls;
+    unsigned long long bytes;
+    unsigned long long cache_hits;
+    unsigned long long sv_members[STATS_HISTOGRAM_BUCKETS];
+    unsigned long long fv_members[STATS_HISTOGRAM_BUCKETS];
+    unsigned long long stage_cycles[STATS_NUM_STAGES];
+    double cycles_per_second;
+} LanguageIdentifierStats;
 
+/* text_to_sv, sv_to_fv, fv_to_logprob and logprob_to_prob */
+extern const char* const stats_stage_names[STATS_NUM_STAGES];
+
+/* When a stream may stop reading its document: once min_bytes have been
+ * fed, the prefix is scored every check_interval bytes (at the end of the
+ * chunk that crosses it), and the stream stops as soon as the top language
+ * reaches min_confidence or leads the second one by min_margin. A
+ * threshold above 1 disables it.
+ */
+typedef struct {
+    size_t min_bytes;
+    size_t check_interval;
+    double min_confidence;
+    double min_margin;
+} StreamStopPolicy;
+
+/* Incremental classification of a document fed in chunks: the tokenizer
+ * state and the state counts carry over from one chunk to the next, so the
+ * result is the same as classifying the concatenated chunks at once.
+ */
+typedef struct {
+    const LanguageIdentifier* lid;
+    LanguageSubset* subset;
+    LanguageIdentifierContext* ctx;
+
+    unsigned int state;
+    size_t num_bytes;
+
+    bool stop;
+    StreamStopPolicy policy;
+    size_t next_check;
+    bool done;
+} LanguageIdentifierStream;
+
+/* Two identifiers tried in turn, a cheap one first, see classify_cascade_r.
+ * first_to_second maps the index of each language of the first model to
+ * its index in the second one, CASCADE_NO_LANGUAGE for those it lacks.
+ */
+typedef struct {
+    const LanguageIdentifier* first;
+    const LanguageIdentifier* second;
+    unsigned int* first_to_second;
+    double min_confidence;
+    double min_margin;
+} LanguageIdentifierCascade;
+
+#define CASCADE_NO_LANGUAGE UINT32_MAX
+
+/* identifier of the model linked into the library, see defaultmodel.h,
+ * loaded without any I/O. NULL if the library was built without one.
+ */
 extern LanguageIdentifier* get_default_identifier(void);
 extern LanguageIdentifier* load_identifier(const char*);
 extern void destroy_identifier(LanguageIdentifier*);
 
+/* read in every page of a model file mapped by load_identifier, which are
+ * otherwise faulted in by the first documents classified. Nothing to do for
+ * the other models, held in memory already.
+ */
+extern void prefault_identifier(const LanguageIdentifier*);
+
+extern LanguageIdentifierContext* alloc_context(const LanguageIdentifier*);
+extern void free_context(LanguageIdentifierContext*);
+
+/* drop the reference a context keeps to the languages it last classified
+ * with, so that those replaced by set_languages are freed while it sits
+ * idle. Not to be called while the context is in use.
+ */
+extern void release_context_subset(LanguageIdentifierContext*);
+
 extern LanguageConfidence classify(LanguageIdentifier*, const char*, unsigned int);
 extern void rank(LanguageIdentifier*, const char*, unsigned int, LanguageConfidence*);
+
+/* reentrant versions of classify and rank: any number of threads may call
+ * these concurrently on the same identifier, each with its own context.
+ * A set_languages running meanwhile applies to the calls started after it.
+ */
+extern LanguageConfidence classify_r(const LanguageIdentifier*, LanguageIdentifierContext*, const char*, unsigned int);
+extern void rank_r(const LanguageIdentifier*, LanguageIdentifierContext*, const char*, unsigned int,
+                   LanguageConfidence*);
+
+/* the first entries of rank_r: at most k languages with a confidence of at
+ * least min_confidence, without sorting the others. Returns how many were
+ * written to out.
+ */
+extern unsigned int rank_top_r(const LanguageIdentifier*, LanguageIdentifierContext*, const char*, unsigned int,
+                               unsigned int, double, LanguageConfidence*);
+
+/* a cascade classifies with the first identifier, and keeps its result
+ * when the top language reaches min_confidence or leads the next one by
+ * min_margin (a threshold above 1 disables it) and is set on the second
+ * identifier as well, or classifies with the second identifier otherwise.
+ * Either way the language is that of the second model, and stage tells
+ * which of them the result comes from, 0 or 1. The identifiers must outlive
+ * the cascade, and each of them needs a context of its own.
+ */
+extern LanguageIdentifierCascade* alloc_cascade(const LanguageIdentifier*, const LanguageIdentifier*, double, double);
+extern void free_cascade(LanguageIdentifierCascade*);
+extern LanguageConfidence classify_cascade_r(const LanguageIdentifierCascade*, LanguageIdentifierContext*,
+                                             LanguageIdentifierContext*, const char*, unsigned int, unsigned int*);
+
+/* windows of window positions of a text of text_len ones, one starting
+ * every stride positions and one more ending at the end of the text when the
+ * last of those falls short of it, or a single one for a text of at most
+ * window positions. Writes their bounds to starts and ends unless NULL and
+ * returns how many there are, none for an empty text or when window or
+ * stride is 0. Call it with NULL bounds first to size the arrays.
+ */
+extern unsigned int segment_windows(unsigned int, unsigned int, unsigned int, unsigned int[], unsigned int[]);
+
+/* classify_r of every window [starts[i], ends[i]) of a text, both bounds
+ * non-decreasing, walking the tokenizer over the text once and sliding the
+ * posteriors along with the windows. Results are those of classify_r for
+ * integer nb_ptc encodings and within rounding otherwise, without the
+ * result cache or the stats. Returns -1 if the scratch state could not be
+ * allocated.
+ */
+extern int segment_r(const LanguageIdentifier*, LanguageIdentifierContext*, const char*, unsigned int,
+                     const unsigned int[], const unsigned int[], unsigned int, LanguageConfidence*);
+
+/* classify or rank num_texts documents spread over num_threads threads
+ * (0 for one per cpu), the calling thread included. Results are written in
+ * input order: rank_batch writes num_langs entries per document.
+ * Returns -1 if the scratch state could not be allocated.
+ */
+extern int classify_batch(const LanguageIdentifier*, const char* const[], const unsigned int[], unsigned int,
+                          LanguageConfidence*, unsigned int);
+extern int rank_batch(const LanguageIdentifier*, const char* const[], const unsigned int[], unsigned int,
+                      LanguageConfidence*, unsigned int);
+
+/* Experimental: classify_batch and rank_batch scoring the documents of
+ * each thread in blocks, whose nb_ptc rows are read once for all of their
+ * documents instead of once per document. Slower than classify_batch and
+ * rank_batch in every configuration measured so far, see lib/bench.c.
+ * Results are unchanged for integer nb_ptc encodings and within rounding
+ * otherwise.
+ */
+extern int classify_batch_blocked(const LanguageIdentifier*, const char* const[], const unsigned int[], unsigned int,
+                                  LanguageConfidence*, unsigned int);
+extern int rank_batch_blocked(const LanguageIdentifier*, const char* const[], const unsigned int[], unsigned int,
+                              LanguageConfidence*, unsigned int);
+
+/* classify_batch, optionally blocked, over num_texts texts stored as in an
+ * Arrow string column: text i is bytes offsets[i] to offsets[i + 1] of data,
+ * offsets being non-decreasing integers of offset_size (4 or 8) bytes. The
+ * index in nb_classes of the language of each text goes to languages and
+ * its confidence to confidences, and unless probs is NULL, its probability
+ * for each of the num_langs languages to a row of probs, 0 for those not
+ * set. Returns -1 for another offset_size or if the scratch state could not
+ * be allocated.
+ */
+extern int classify_column(const LanguageIdentifier*, const char*, const void*, size_t, unsigned int, int16_t*, float*,
+                           float*, unsigned int, bool);
+
+/* a stream is used by one thread at a time. stream_begin starts a new
+ * document, with an optional policy to stop early; stream_feed returns
+ * true once the policy is met, after which further chunks are ignored.
+ */
+extern LanguageIdentifierStream* alloc_stream(const LanguageIdentifier*);
+extern void free_stream(LanguageIdentifierStream*);
+extern void stream_begin(LanguageIdentifierStream*, const StreamStopPolicy*);
+extern bool stream_feed(LanguageIdentifierStream*, const char*, unsigned int);
+extern LanguageConfidence stream_result(LanguageIdentifierStream*);
+
+/* counting costs a few atomic additions per document while enabled,
+ * nothing but a flag check otherwise
+ */
+extern void set_stats_enabled(LanguageIdentifier*, bool);
+extern void get_stats(const LanguageIdentifier*, LanguageIdentifierStats*);
+extern void reset_stats(LanguageIdentifier*);
+
+/* keep the results of up to capacity texts of at most
+ * RESULT_CACHE_MAX_KEY_LEN bytes, per set of languages, or drop the cache
+ * for a capacity of 0. Must not run while other threads use the
+ * identifier. get_cache_stats returns false without a cache.
+ */
+extern int enable_cache(LanguageIdentifier*, size_t);
+extern bool get_cache_stats(const LanguageIdentifier*, ResultCacheStats*);
+
+/* score from precomputed per-state posteriors, num_state_rows * num_langs
+ * doubles, rather than from the features of each document. Results are
+ * unchanged for integer nb_ptc encodings and within rounding otherwise.
+ * Like set_languages it may run while classifying.
+ */
+extern int set_state_posteriors(LanguageIdentifier*, bool);
+
+/* restrict classify and rank to the given languages, or to all of them for
+ * NULL. Calls to set_languages must not overlap each other.
+ */
 extern int set_languages(LanguageIdentifier*, const char*[], unsigned int);
 #endif
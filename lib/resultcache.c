@@ -0,0 +1,208 @@
+/* Bounded, thread-safe cache of classification results for short texts,
+ * so that repeated inputs skip the tokenizer and the classifier.
+ */
+#include "resultcache.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WAYS 4
+#define NUM_LOCKS 64
+
+/* header of an entry, followed by its value and then its key */
+typedef struct {
+    uint64_t hash;
+    uint64_t tag;
+    uint64_t last_used; /* 0 for an empty entry */
+    uint32_t key_len;
+    uint32_t value_len;
+} Entry;
+
+struct ResultCache {
+    size_t num_sets; /* a power of two */
+    size_t entry_size;
+    unsigned int value_len;
+
+    char* entries;    /* WAYS entries of entry_size bytes per set */
+    uint64_t* clocks; /* access counter of each set, for the LRU order */
+    pthread_mutex_t locks[NUM_LOCKS];
+
+    atomic_ullong hits;
+    atomic_ullong misses;
+    atomic_size_t size;
+};
+
+static inline uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t mix(uint64_t h, uint64_t w) {
+    w *= 0x87c37b91114253d5ULL;
+    w = rotl(w, 31);
+    w *= 0x4cf5ad432745937fULL;
+    return rotl(h ^ w, 27) * 5 + 0x52dce729;
+}
+
+/* 64-bit hash of a short byte string, 8 bytes at a time */
+static uint64_t hash_key(const char* key, unsigned int key_len) {
+    uint64_t h = key_len * 0x9e3779b97f4a7c15ULL, w;
+    unsigned int i;
+
+    for (i = 0; i + 8 <= key_len; i += 8) {
+        memcpy(&w, key + i, 8);
+        h = mix(h, w);
+    }
+    if (i < key_len) {
+        w = 0;
+        memcpy(&w, key + i, key_len - i);
+        h = mix(h, w);
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline Entry* get_entry(ResultCache* cache, size_t set, unsigned int way) {
+    return (Entry*)(cache->entries + (set * WAYS + way) * cache->entry_size);
+}
+
+static inline double* entry_value(Entry* entry) {
+    return (double*)(entry + 1);
+}
+
+static inline char* entry_key(Entry* entry) {
+    return (char*)(entry_value(entry) + entry->value_len);
+}
+
+ResultCache* alloc_result_cache(size_t capacity, unsigned int value_len) {
+    ResultCache* cache;
+    size_t num_sets = 1;
+
+    while (num_sets * WAYS < capacity) {
+        num_sets *= 2;
+    }
+
+    if ((cache = (ResultCache*)malloc(sizeof(ResultCache))) == NULL) {
+        return NULL;
+    }
+    cache->num_sets = num_sets;
+    cache->value_len = value_len;
+    cache->entry_size = (sizeof(Entry) + sizeof(double) * value_len + RESULT_CACHE_MAX_KEY_LEN + 7) / 8 * 8;
+    cache->entries = (char*)calloc(num_sets * WAYS, cache->entry_size);
+    cache->clocks = (uint64_t*)calloc(num_sets, sizeof(uint64_t));
+    if (cache->entries == NULL || cache->clocks == NULL) {
+        free(cache->entries);
+        free(cache->clocks);
+        free(cache);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < NUM_LOCKS; ++i) {
+        pthread_mutex_init(&cache->locks[i], NULL);
+    }
+    atomic_init(&cache->hits, 0);
+    atomic_init(&cache->misses, 0);
+    atomic_init(&cache->size, 0);
+
+    return cache;
+}
+
+void free_result_cache(ResultCache* cache) {
+    if (cache == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < NUM_LOCKS; ++i) {
+        pthread_mutex_destroy(&cache->locks[i]);
+    }
+    free(cache->entries);
+    free(cache->clocks);
+    free(cache);
+}
+
+static inline bool entry_matches(Entry* entry, uint64_t hash, uint64_t tag, const char* key, unsigned int key_len,
+                                 unsigned int value_len) {
+    return entry->last_used != 0 && entry->hash == hash && entry->tag == tag && entry->key_len == key_len &&
+           entry->value_len == value_len && memcmp(entry_key(entry), key, key_len) == 0;
+}
+
+bool result_cache_get(ResultCache* cache, uint64_t tag, const char* key, unsigned int key_len, double* value,
+                      unsigned int value_len) {
+    uint64_t hash;
+    size_t set;
+    bool found = false;
+
+    if (key_len > RESULT_CACHE_MAX_KEY_LEN || value_len > cache->value_len) {
+        return false;
+    }
+
+    hash = hash_key(key, key_len);
+    set = hash & (cache->num_sets - 1);
+
+    pthread_mutex_lock(&cache->locks[set % NUM_LOCKS]);
+    for (unsigned int way = 0; way < WAYS; ++way) {
+        Entry* entry = get_entry(cache, set, way);
+        if (entry_matches(entry, hash, tag, key, key_len, value_len)) {
+            memcpy(value, entry_value(entry), sizeof(double) * value_len);
+            entry->last_used = ++cache->clocks[set];
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache->locks[set % NUM_LOCKS]);
+
+    atomic_fetch_add_explicit(found ? &cache->hits : &cache->misses, 1, memory_order_relaxed);
+    return found;
+}
+
+void result_cache_put(ResultCache* cache, uint64_t tag, const char* key, unsigned int key_len, const double* value,
+                      unsigned int value_len) {
+    uint64_t hash;
+    size_t set;
+    Entry* victim = NULL;
+
+    if (key_len > RESULT_CACHE_MAX_KEY_LEN || value_len > cache->value_len) {
+        return;
+    }
+
+    hash = hash_key(key, key_len);
+    set = hash & (cache->num_sets - 1);
+
+    pthread_mutex_lock(&cache->locks[set % NUM_LOCKS]);
+    /* the entry itself if another thread added it meanwhile, else an empty
+     * or the least recently used one
+     */
+    for (unsigned int way = 0; way < WAYS; ++way) {
+        Entry* entry = get_entry(cache, set, way);
+        if (entry_matches(entry, hash, tag, key, key_len, value_len)) {
+            victim = entry;
+            break;
+        }
+        if (victim == NULL || entry->last_used < victim->last_used) {
+            victim = entry;
+        }
+    }
+
+    if (victim->last_used == 0) {
+        atomic_fetch_add_explicit(&cache->size, 1, memory_order_relaxed);
+    }
+    victim->hash = hash;
+    victim->tag = tag;
+    victim->key_len = key_len;
+    victim->value_len = value_len;
+    memcpy(entry_value(victim), value, sizeof(double) * value_len);
+    memcpy(entry_key(victim), key, key_len);
+    victim->last_used = ++cache->clocks[set];
+    pthread_mutex_unlock(&cache->locks[set % NUM_LOCKS]);
+}
+
+void result_cache_stats(ResultCache* cache, ResultCacheStats* stats) {
+    stats->hits = atomic_load_explicit(&cache->hits, memory_order_relaxed);
+    stats->misses = atomic_load_explicit(&cache->misses, memory_order_relaxed);
+    stats->size = atomic_load_explicit(&cache->size, memory_order_relaxed);
+    stats->capacity = cache->num_sets * WAYS;
+}
@@ -0,0 +1,36 @@
+#ifndef _RESULTCACHE_H
+#define _RESULTCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A bounded cache of vectors of doubles keyed by a short byte string and a
+ * tag. Entries live in 4-way sets picked by a hash of the key, each set
+ * evicting its least recently used entry. Sets are guarded by striped
+ * locks, so any number of threads may use the cache at once.
+ */
+typedef struct ResultCache ResultCache;
+
+/* longer keys are never cached */
+#define RESULT_CACHE_MAX_KEY_LEN 256
+
+typedef struct {
+    unsigned long long hits;
+    unsigned long long misses;
+    size_t size;
+    size_t capacity;
+} ResultCacheStats;
+
+/* room for at least capacity vectors of up to value_len doubles */
+extern ResultCache* alloc_result_cache(size_t capacity, unsigned int value_len);
+extern void free_result_cache(ResultCache* cache);
+
+/* copies the vector of key and tag to value, returns false on a miss */
+extern bool result_cache_get(ResultCache* cache, uint64_t tag, const char* key, unsigned int key_len, double* value,
+                             unsigned int value_len);
+extern void result_cache_put(ResultCache* cache, uint64_t tag, const char* key, unsigned int key_len,
+                             const double* value, unsigned int value_len);
+extern void result_cache_stats(ResultCache* cache, ResultCacheStats* stats);
+
+#endif
@@ -14,4 +14,17 @@ extern void free_set(Set* s);
 extern void clear(Set* s);
 extern void add(Set* s, unsigned key, unsigned val);
 
+/* add(s, key, 1), inline for the loops of the tokenizer */
+static inline void increment(Set* s, unsigned key) {
+    unsigned index = s->sparse[key];
+    if (index < s->members && s->dense[index] == key) {
+        s->counts[index]++;
+    } else {
+        index = s->members++;
+        s->sparse[key] = index;
+        s->dense[index] = key;
+        s->counts[index] = 1;
+    }
+}
+
 #endif
@@ -0,0 +1,150 @@
+/* Minimal pthreads worker pool used to spread batches of documents
+ * over several cores.
+ */
+#include "threadpool.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct Task {
+    ThreadPoolTask run;
+    void* arg;
+    struct Task* next;
+} Task;
+
+struct ThreadPool {
+    pthread_mutex_t lock;
+    pthread_cond_t has_tasks;
+    Task *head, *tail;
+    bool shutdown;
+
+    unsigned int num_threads;
+    pthread_t* threads;
+};
+
+static ThreadPool* default_pool = NULL;
+static pthread_mutex_t default_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool atfork_registered = false;
+
+static void* worker(void* arg) {
+    ThreadPool* pool = (ThreadPool*)arg;
+    Task* task;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->head == NULL && !pool->shutdown) {
+            pthread_cond_wait(&pool->has_tasks, &pool->lock);
+        }
+        if (pool->head == NULL) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        task = pool->head;
+        pool->head = task->next;
+        if (pool->head == NULL) {
+            pool->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        task->run(task->arg);
+        free(task);
+    }
+}
+
+ThreadPool* alloc_threadpool(unsigned int num_threads) {
+    ThreadPool* pool;
+
+    if ((pool = (ThreadPool*)malloc(sizeof(ThreadPool))) == NULL) {
+        return NULL;
+    }
+    if ((pool->threads = (pthread_t*)malloc(num_threads * sizeof(pthread_t))) == NULL) {
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->has_tasks, NULL);
+    pool->head = pool->tail = NULL;
+    pool->shutdown = false;
+
+    for (pool->num_threads = 0; pool->num_threads < num_threads; ++pool->num_threads) {
+        if (pthread_create(&pool->threads[pool->num_threads], NULL, worker, pool) != 0) {
+            break;
+        }
+    }
+
+    if (pool->num_threads == 0) {
+        free_threadpool(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/* Stops the workers once the queue has been drained */
+void free_threadpool(ThreadPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->has_tasks);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (unsigned int i = 0; i < pool->num_threads; ++i) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->has_tasks);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+int threadpool_submit(ThreadPool* pool, ThreadPoolTask run, void* arg) {
+    Task* task;
+
+    if ((task = (Task*)malloc(sizeof(Task))) == NULL) {
+        return -1;
+    }
+    task->run = run;
+    task->arg = arg;
+    task->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail == NULL) {
+        pool->head = task;
+    } else {
+        pool->tail->next = task;
+    }
+    pool->tail = task;
+    pthread_cond_signal(&pool->has_tasks);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+unsigned int threadpool_size(const ThreadPool* pool) { return pool->num_threads; }
+
+unsigned int num_cpus(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (unsigned int)n : 1;
+}
+
+/* worker threads do not survive fork: a child must build its own pool
+ * instead of queueing tasks nobody will ever run
+ */
+static void reset_default_threadpool(void) {
+    default_pool = NULL;
+    pthread_mutex_init(&default_pool_lock, NULL);
+}
+
+ThreadPool* get_default_threadpool(void) {
+    pthread_mutex_lock(&default_pool_lock);
+    if (default_pool == NULL) {
+        default_pool = alloc_threadpool(num_cpus());
+        if (default_pool != NULL && !atfork_registered) {
+            pthread_atfork(NULL, NULL, reset_default_threadpool);
+            atfork_registered = true;
+        }
+    }
+    pthread_mutex_unlock(&default_pool_lock);
+    return default_pool;
+}
@@ -0,0 +1,18 @@
+#ifndef _THREADPOOL_H
+#define _THREADPOOL_H
+
+/* A fixed-size pool of worker threads consuming a FIFO queue of tasks */
+typedef struct ThreadPool ThreadPool;
+
+typedef void (*ThreadPoolTask)(void* arg);
+
+extern ThreadPool* alloc_threadpool(unsigned int num_threads);
+extern void free_threadpool(ThreadPool* pool);
+extern int threadpool_submit(ThreadPool* pool, ThreadPoolTask task, void* arg);
+extern unsigned int threadpool_size(const ThreadPool* pool);
+
+/* process-wide pool with one worker per online cpu, created on first use */
+extern ThreadPool* get_default_threadpool(void);
+extern unsigned int num_cpus(void);
+
+#endif
@@ -0,0 +1,248 @@
+"""
+Derive a smaller model from a langid.py model.
+
+The pruned model keeps a subset of the languages, the most useful features for them and only the tokenizer
+states that still make a difference, and is written in any of the formats of ldpy_to_protobuf.py:
+- features are ranked by `weight`, the spread of their log-probabilities across the kept languages,
+  or by `infogain`, the information their presence in a text carries about its language
+- features beyond the requested number are dropped from nb_ptc and from the outputs of the tokenizer
+- the tokenizer DFA is then minimized: unreachable states are dropped and states that emit the same
+  features and move to equivalent states through every byte are merged, so that states which can no
+  longer emit anything collapse together. Every text still yields the same feature counts.
+
+With --corpus, both models are loaded with langid_pyc to report how much the pruned one departs
+from the full one restricted to the same languages, and how accurate both are when the lines of the
+corpus are `language<TAB>text`.
+"""
+
+import argparse
+import array
+import os
+import tempfile
+import time
+
+import langid.langid as langid
+import numpy as np
+
+from ldpy_to_protobuf import NB_PTC_ENCODINGS, pack_model
+
+
+def feature_scores(nb_ptc, nb_pc, method):
+    """
+    Score the features (== rows of `nb_ptc`) for the languages (== columns) of `nb_ptc`, higher is more useful.
+    - weight: max - min of the log-probabilities of the feature over the languages
+    - infogain: H(C) - H(C | feature present or not), with P(t|C) and P(C) taken from the model
+    """
+    if method == "weight":
+        return nb_ptc.max(axis=1) - nb_ptc.min(axis=1)
+
+    def entropy(p):
+        p = p / np.maximum(p.sum(axis=-1, keepdims=True), np.finfo(float).tiny)
+        return -(p * np.log(np.where(p > 0, p, 1))).sum(axis=-1)
+
+    p_c = np.exp(nb_pc - nb_pc.max())
+    p_c /= p_c.sum()
+    p_tc = np.exp(nb_ptc)
+    joint_present = p_tc * p_c
+    joint_absent = (1 - p_tc) * p_c
+    p_t = joint_present.sum(axis=1)
+    return entropy(p_c) - p_t * entropy(joint_present) - (1 - p_t) * entropy(joint_absent)
+
+
+def minimize_tokenizer(nextmove, outputs):
+    """
+    Minimize the DFA of `nextmove`, a [num_states][256] array, whose states emit `outputs`, a tuple of
+    features per state, by Moore's partition refinement over the states reachable from state 0.
+    Returns the [num_classes][256] transitions and the outputs of the minimized DFA, whose start state is 0.
+    """
+    num_states = nextmove.shape[0]
+    reachable = np.zeros(num_states, dtype=bool)
+    reachable[0] = True
+    frontier = np.array([0])
+    while frontier.size:
+        targets = np.unique(nextmove[frontier])
+        frontier = targets[~reachable[targets]]
+        reachable[frontier] = True
+
+    states = np.flatnonzero(reachable)
+    index = np.full(num_states, -1)
+    index[states] = np.arange(states.size)
+    moves = index[nextmove[states]]
+
+    # states are first told apart by what they emit, then by where each byte leads
+    labels = {}
+    partition = np.array([labels.setdefault(outputs[s], len(labels)) for s in states])
+    num_classes = len(labels)
+    while True:
+        signature = np.column_stack([partition, partition[moves]])
+        _, partition = np.unique(signature, axis=0, return_inverse=True)
+        partition = partition.reshape(-1)
+        if partition.max() + 1 == num_classes:
+            break
+        num_classes = partition.max() + 1
+
+    # swap class numbers so that the class of state 0 comes first
+    renumber = np.arange(num_classes)
+    renumber[[0, partition[0]]] = renumber[[partition[0], 0]]
+    _, representatives = np.unique(partition, return_index=True)
+
+    minimized = np.empty((num_classes, 256), dtype=np.int64)
+    minimized_outputs = [()] * num_classes
+    for c, representative in enumerate(representatives):
+        minimized[renumber[c]] = renumber[partition[moves[representative]]]
+        minimized_outputs[renumber[c]] = outputs[states[representative]]
+    return minimized, minimized_outputs
+
+
+def prune(identifier, langs=None, num_features=None, method="infogain"):
+    """
+    Restrict `identifier`, a `langid.langid.LanguageIdentifier`, to `langs` and to its `num_features`
+    best features for them, and minimize its tokenizer. Returns a new `langid.langid.LanguageIdentifier`.
+    """
+    nb_classes = list(identifier.nb_classes)
+    if langs is not None:
+        unknown = set(langs) - set(nb_classes)
+        if unknown:
+            raise ValueError("unsupported languages: {}".format(", ".join(sorted(unknown))))
+        columns = [i for i, c in enumerate(nb_classes) if c in langs]
+    else:
+        columns = list(range(len(nb_classes)))
+
+    nb_ptc = identifier.nb_ptc[:, columns]
+    nb_pc = identifier.nb_pc[columns]
+
+    num_feats = nb_ptc.shape[0]
+    if num_features is not None and num_features < num_feats:
+        scores = feature_scores(nb_ptc, nb_pc, method)
+        kept = np.sort(np.argsort(-scores, kind="stable")[:num_features])
+    else:
+        kept = np.arange(num_feats)
+    feature_index = np.full(num_feats, -1)
+    feature_index[kept] = np.arange(kept.size)
+
+    num_states = len(identifier.tk_nextmove) >> 8
+    nextmove = np.asarray(identifier.tk_nextmove, dtype=np.int64).reshape(num_states, 256)
+    outputs = [
+        tuple(int(feature_index[f]) for f in identifier.tk_output.get(s, ()) if feature_index[f] >= 0)
+        for s in range(num_states)
+    ]
+    nextmove, outputs = minimize_tokenizer(nextmove, outputs)
+
+    typecode = "H" if nextmove.shape[0] <= 0x10000 else "I"
+    tk_nextmove = array.array(typecode, nextmove.ravel().tolist())
+    tk_output = {s: feats for s, feats in enumerate(outputs) if feats}
+    return langid.LanguageIdentifier(
+        nb_ptc[kept], nb_pc, kept.size, [nb_classes[i] for i in columns], tk_nextmove, tk_output
+    )
+
+
+def describe(name, identifier, model):
+    num_feats, num_langs = identifier.nb_ptc.shape
+    print(
+        "{}: {} languages, {} features, {} states, {} bytes".format(
+            name, num_langs, num_feats, len(identifier.tk_nextmove) >> 8, len(model)
+        )
+    )
+
+
+def evaluate(full_path, pruned_path, langs, corpus_path, min_seconds=0.5):
+    """Compare the pruned model with the full one, restricted to the same languages, on a corpus"""
+    from langid_pyc import LanguageIdentifier
+
+    with open(corpus_path, encoding="utf-8") as corpus:
+        lines = corpus.read().splitlines()
+    labelled = all("\t" in line for line in lines)
+    labels, texts = zip(*(line.split("\t", 1) for line in lines)) if labelled else (None, lines)
+
+    full = LanguageIdentifier.from_modelpath(full_path)
+    if labelled:
+        in_subset = [langs is None or label in langs for label in labels]
+    else:
+        # as far as the full model can tell
+        in_subset = [langs is None or full.classify(text)[0] in langs for text in texts]
+    full.set_languages(langs)
+    pruned = LanguageIdentifier.from_modelpath(pruned_path)
+
+    results = {}
+    for name, identifier in (("full", full), ("pruned", pruned)):
+        results[name] = [identifier.classify(text) for text in texts]
+        rounds = 0
+        start = time.perf_counter()
+        while time.perf_counter() - start < min_seconds:
+            for text in texts:
+                identifier.classify(text)
+            rounds += 1
+        print("{}: {:.1f} docs/s".format(name, rounds * len(texts) / (time.perf_counter() - start)))
+        if labelled:
+            correct = sum(lang == label for (lang, _), label in zip(results[name], labels))
+            print("{}: accuracy {:.4f}".format(name, correct / len(texts)))
+
+    subsets = [("all texts", [True] * len(texts))]
+    if langs is not None:
+        subsets.append(("texts in the kept languages", in_subset))
+    for subset_name, selected in subsets:
+        pairs = [(a, b) for a, b, keep in zip(results["full"], results["pruned"], selected) if keep]
+        if not pairs:
+            continue
+        agreement = sum(a[0] == b[0] for a, b in pairs)
+        print(
+            "{}: top-1 agreement with the full model {:.4f} ({} of {}), mean confidence difference {:.6f}".format(
+                subset_name,
+                agreement / len(pairs),
+                agreement,
+                len(pairs),
+                float(np.mean([abs(a[1] - b[1]) for a, b in pairs])),
+            )
+        )
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--output", "-o", required=True, help="write the pruned model to")
+    parser.add_argument(
+        "--format",
+        "-f",
+        default="protobuf",
+        choices=("protobuf", "flat"),
+        help="protobuf (.pmodel) or flat, mmap-able (.fmodel) output format",
+    )
+    parser.add_argument(
+        "--nb-ptc-encoding",
+        default="f64",
+        choices=tuple(NB_PTC_ENCODINGS),
+        help="precision of the nb_ptc table, reduced precisions are only supported by the flat format",
+    )
+    parser.add_argument("--languages", "-l", help="comma-separated languages to keep, all by default")
+    parser.add_argument("--features", "-n", type=int, help="number of features to keep, all by default")
+    parser.add_argument(
+        "--method",
+        default="infogain",
+        choices=("infogain", "weight"),
+        help="how to rank the features to keep",
+    )
+    parser.add_argument("--corpus", help="report the accuracy against the full model on the lines of this file")
+    parser.add_argument("model", help="read model from")
+    args = parser.parse_args()
+    if args.format != "flat" and args.nb_ptc_encoding != "f64":
+        parser.error("--nb-ptc-encoding requires --format flat")
+
+    identifier = langid.LanguageIdentifier.from_modelpath(args.model)
+    langs = args.languages.split(",") if args.languages else None
+    try:
+        pruned = prune(identifier, langs, args.features, args.method)
+    except ValueError as error:
+        parser.error(str(error))
+
+    model = pack_model(pruned, args.format, args.nb_ptc_encoding)
+    with open(args.output, "wb") as output:
+        output.write(model)
+
+    full_model = pack_model(identifier, args.format, args.nb_ptc_encoding)
+    describe("full", identifier, full_model)
+    describe("pruned", pruned, model)
+
+    if args.corpus:
+        with tempfile.NamedTemporaryFile(suffix=os.path.splitext(args.output)[1]) as full_file:
+            full_file.write(full_model)
+            full_file.flush()
+            evaluate(full_file.name, args.output, langs, args.corpus)
@@ -1,10 +1,21 @@
+import os
+
 from setuptools import setup, Extension
 
 
+# LANGID_EMBED_MODEL=1 links the ldpy3 model into the extension, see lib/defaultmodel.h.
+# lib/defaultmodel.c is generated by `make lib/defaultmodel.c`
+EMBED_MODEL = os.environ.get("LANGID_EMBED_MODEL") == "1"
+if EMBED_MODEL and not os.path.exists("lib/defaultmodel.c"):
+    raise SystemExit(
+        "LANGID_EMBED_MODEL=1 requires lib/defaultmodel.c, run `make lib/defaultmodel.c`"
+    )
+
+
 langid_extension = Extension(
     "_langid",
     language="c",
-    libraries=["protobuf-c"],
+    libraries=["protobuf-c", "pthread"],
     include_dirs=[
         "/opt/homebrew/include",  # Include directory for protobuf-c headers
         "lib",
@@ -12,19 +23,26 @@ langid_extension = Extension(
     library_dirs=[
         "/opt/homebrew/lib",  # Library directory for protobuf-c
     ],
+    # kernels.c relies on multiplications and additions not being fused
+    extra_compile_args=["-ffp-contract=off"],
+    define_macros=[("LANGID_DEFAULT_MODEL", None)] if EMBED_MODEL else [],
     sources=[
         "lib/_langid.c",
         "lib/liblangid.c",
         "lib/sparseset.c",
+        "lib/threadpool.c",
+        "lib/kernels.c",
+        "lib/resultcache.c",
         "lib/langid.pb-c.c",
-    ],
+    ]
+    + (["lib/defaultmodel.c"] if EMBED_MODEL else []),
 )
 
 setup(
     packages=["langid_pyc"],
     ext_modules=[langid_extension],
     package_data={
-        "langid_pyc": ["ldpy3.pmodel"],
+        "langid_pyc": ["ldpy3.fmodel"],
     },
     long_description_content_type="text/markdown",
 )
@@ -1,7 +1,15 @@
+import struct
+import subprocess
+import sys
+from pathlib import Path
+
 import langid.langid as langid_py
 import pytest
 
-from langid_pyc.default import DEFAULT_IDENTIFIER
+from langid_pyc.default import DEFAULT_MODEL_PATH, get_default_identifier
+
+
+ROOT_DIR = Path(__file__).parent.parent
 
 
 @pytest.fixture(scope="session")
@@ -15,5 +23,95 @@ def langid_py_identifier():
 
 @pytest.fixture(scope="function")
 def langid_pyc_identifier():
-    yield DEFAULT_IDENTIFIER
-    DEFAULT_IDENTIFIER.set_languages()
+    identifier = get_default_identifier()
+    yield identifier
+    identifier.set_languages()
+
+
+@pytest.fixture(scope="session")
+def reference_corpus():
+    with open(ROOT_DIR / "test" / "data" / "corpus.txt", encoding="utf-8") as corpus:
+        yield corpus.read().splitlines()
+
+
+@pytest.fixture(scope="session")
+def flat_model_path(tmp_path_factory):
+    """Convert the ldpy3 model into a flat model with the given nb_ptc encoding,
+    once per encoding"""
+    paths = {}
+
+    def convert(nb_ptc_encoding):
+        if nb_ptc_encoding in paths:
+            return paths[nb_ptc_encoding]
+        path = tmp_path_factory.mktemp("models") / "ldpy3-{}.fmodel".format(nb_ptc_encoding)
+        subprocess.run(
+            [
+                sys.executable,
+                str(ROOT_DIR / "ldpy_to_protobuf.py"),
+                "--format",
+                "flat",
+                "--nb-ptc-encoding",
+                nb_ptc_encoding,
+                "--output",
+                str(path),
+                str(ROOT_DIR / "models" / "ldpy3.model"),
+            ],
+            check=True,
+            stdout=subprocess.DEVNULL,
+        )
+        paths[nb_ptc_encoding] = path
+        return path
+
+    yield convert
+
+
+@pytest.fixture(scope="session")
+def corrupt_flat_model_path(tmp_path_factory):
+    """Copy the default flat model with every element of a section set to the given bytes"""
+
+    def corrupt(section_id, element):
+        model = bytearray(DEFAULT_MODEL_PATH.read_bytes())
+        num_sections = struct.unpack_from("<I", model, 24)[0]
+        for i in range(num_sections):
+            id_, _, offset, size = struct.unpack_from("<IIQQ", model, 40 + 24 * i)
+            if id_ == section_id:
+                model[offset : offset + size] = element * (size // len(element))
+        path = tmp_path_factory.mktemp("models") / "corrupt-{}.fmodel".format(section_id)
+        path.write_bytes(bytes(model))
+        return path
+
+    yield corrupt
+
+
+@pytest.fixture(scope="session")
+def pruned_model_path(tmp_path_factory):
+    """Prune the ldpy3 model into a flat model of the given languages and number of features,
+    once per set of arguments"""
+    paths = {}
+
+    def prune(langs, num_features=None):
+        key = (tuple(langs), num_features)
+        if key in paths:
+            return paths[key]
+        path = tmp_path_factory.mktemp("models") / "ldpy3-pruned.fmodel"
+        args = ["--languages", ",".join(langs)]
+        if num_features is not None:
+            args += ["--features", str(num_features)]
+        subprocess.run(
+            [
+                sys.executable,
+                str(ROOT_DIR / "prune_model.py"),
+                "--format",
+                "flat",
+                "--output",
+                str(path),
+                *args,
+                str(ROOT_DIR / "models" / "ldpy3.model"),
+            ],
+            check=True,
+            stdout=subprocess.DEVNULL,
+        )
+        paths[key] = path
+        return path
+
+    yield prune
@@ -1,7 +1,17 @@
+import asyncio
+import subprocess
+import sys
+from concurrent.futures import ThreadPoolExecutor
+
 import numpy as np
 import pytest
 
-from langid_pyc import LanguageIdentifier
+from langid_pyc import CascadeIdentifier, LanguageIdentifier
+from langid_pyc.identifier import HAS_DEFAULT_MODEL
+from langid_pyc.default import DEFAULT_MODEL_PATH
+
+
+PROTOBUF_MODEL_PATH = DEFAULT_MODEL_PATH.with_suffix(".pmodel")
 
 
 def test_nb_classes(langid_py_identifier, langid_pyc_identifier):
@@ -43,6 +53,42 @@ def test_rank(langid_py_identifier, langid_pyc_identifier, text):
     assert np.allclose(pyc_probs, probs)
 
 
+@pytest.mark.parametrize("k", (0, 1, 3, 10, 97, 200))
+def test_rank_top_k(langid_pyc_identifier, reference_corpus, k):
+    for text in reference_corpus:
+        assert langid_pyc_identifier.rank(text, k=k) == langid_pyc_identifier.rank(text)[:k]
+
+
+def test_rank_min_confidence(langid_pyc_identifier, reference_corpus):
+    for text in reference_corpus:
+        ranking = langid_pyc_identifier.rank(text)
+
+        assert langid_pyc_identifier.rank(text, min_confidence=1e-3) == [
+            (lang, conf) for lang, conf in ranking if conf >= 1e-3
+        ]
+        assert langid_pyc_identifier.rank(text, k=2, min_confidence=0.5) == [
+            (lang, conf) for lang, conf in ranking[:2] if conf >= 0.5
+        ]
+
+
+def test_results_share_language_strings(langid_pyc_identifier):
+    text = "this is english text"
+    model_classes = langid_pyc_identifier.model_classes
+
+    lang, _ = langid_pyc_identifier.classify(text)
+    assert lang is model_classes[model_classes.index("en")]
+    assert all(
+        lang is model_classes[model_classes.index(lang)]
+        for lang, _ in langid_pyc_identifier.rank(text)
+        + langid_pyc_identifier.classify_batch([text])
+    )
+
+
+def test_rank_raises_error_if_k_negative(langid_pyc_identifier):
+    with pytest.raises(ValueError, match="must not be negative"):
+        langid_pyc_identifier.rank("text", k=-1)
+
+
 @pytest.mark.parametrize("langs", (["en"], ["en", "fi"]))
 def test_set_languages(langid_pyc_identifier, langs):
     langid_pyc_identifier.set_languages(langs)
@@ -77,7 +123,559 @@ def test_set_languages_raises_error_if_unknown_language(langid_pyc_identifier, c
         assert capsys.readouterr().err.startswith("Unsupported language code")
 
 
+@pytest.mark.parametrize("langs", (["en", "de", "fr"], ["ru", "uk", "be", "bg", "sr"]))
+def test_set_languages_matches_langid_py(langid_py_identifier, langid_pyc_identifier, reference_corpus, langs):
+    langid_py_identifier.set_languages(langs)
+    langid_pyc_identifier.set_languages(langs)
+    try:
+        for text in reference_corpus:
+            ranking = dict(langid_py_identifier.rank(text))
+            pyc_ranking = langid_pyc_identifier.rank(text)
+
+            assert [conf for _, conf in pyc_ranking[len(langs) :]] == [0.0] * (len(pyc_ranking) - len(langs))
+            assert [conf for _, conf in pyc_ranking[: len(langs)]] == pytest.approx(
+                [ranking[lang] for lang, _ in pyc_ranking[: len(langs)]]
+            )
+            assert langid_pyc_identifier.classify(text) == pyc_ranking[0]
+    finally:
+        langid_py_identifier.set_languages()
+
+
 def test_load_model_raises_error_if_path_not_found(capsys):
     with pytest.raises(RuntimeError, match="Failed to load"):
         LanguageIdentifier.from_modelpath("unknown_path")
         assert capsys.readouterr().err.startswith("Unable to open")
+
+
+@pytest.mark.parametrize("preload", ("", "langid_pyc.preload(background=True)", "langid_pyc.preload()"))
+def test_default_identifier_loaded_on_first_use(preload):
+    # a fresh interpreter, the default identifier of this one is loaded already
+    code = "\n".join(
+        (
+            "import langid_pyc, langid_pyc.default as default",
+            "assert default._default_identifier is None",
+            preload,
+            "assert langid_pyc.classify('this is english text')[0] == 'en'",
+            "assert default.DEFAULT_IDENTIFIER is default.get_default_identifier()",
+        )
+    )
+    subprocess.run([sys.executable, "-c", code], check=True)
+
+
+def test_classify_from_multiple_threads(langid_pyc_identifier):
+    texts = [
+        "this is english text",
+        "это текст на русском",
+        "tämä on suomenkielinen teksti",
+    ] * 50
+    expected = [langid_pyc_identifier.classify(text) for text in texts]
+
+    with ThreadPoolExecutor(max_workers=4) as executor:
+        assert list(executor.map(langid_pyc_identifier.classify, texts)) == expected
+
+
+def test_swap_model_keeps_languages_and_streams(reference_corpus):
+    identifier = LanguageIdentifier.from_modelpath(DEFAULT_MODEL_PATH, cache_size=16)
+    identifier.set_languages(["en", "de", "fr"])
+    expected = [identifier.classify(text) for text in reference_corpus]
+    stream = identifier.stream_begin()
+    stream.feed("this is english")
+
+    identifier.swap_model(DEFAULT_MODEL_PATH)
+
+    assert identifier.nb_classes == ["de", "en", "fr"]
+    assert identifier.cache_info()["maxsize"] >= 16
+    assert [identifier.classify(text) for text in reference_corpus] == expected
+    # streams keep the model they started on
+    stream.feed(" text")
+    assert stream.result() == identifier.classify("this is english text")
+
+
+def test_swap_model_while_classifying(reference_corpus):
+    identifier = LanguageIdentifier.from_modelpath(DEFAULT_MODEL_PATH)
+    texts = reference_corpus * 10
+    expected = [identifier.classify(text) for text in texts]
+
+    with ThreadPoolExecutor(max_workers=4) as executor:
+        results = executor.map(identifier.classify, texts)
+        for _ in range(5):
+            identifier.swap_model(DEFAULT_MODEL_PATH)
+        assert list(results) == expected
+
+
+def test_swap_model_raises_error_if_path_not_found():
+    identifier = LanguageIdentifier.from_modelpath(DEFAULT_MODEL_PATH)
+    identifier.set_languages(["en", "ru"])
+
+    with pytest.raises(RuntimeError, match="Failed to load"):
+        identifier.swap_model("unknown_path")
+    assert identifier.nb_classes == ["en", "ru"]
+    assert identifier.classify("this is english text")[0] == "en"
+
+
+@pytest.mark.parametrize("min_confidence, stage", ((None, "second"), (0.0, "first")))
+def test_cascade_stages(langid_pyc_identifier, reference_corpus, min_confidence, stage):
+    first = LanguageIdentifier.from_modelpath(DEFAULT_MODEL_PATH)
+    cascade = CascadeIdentifier(first, langid_pyc_identifier, min_confidence=min_confidence)
+
+    assert [cascade.classify(text) for text in reference_corpus] == [
+        langid_pyc_identifier.classify(text) for text in reference_corpus
+    ]
+    assert cascade.stats()[stage] == cascade.stats()["calls"] == len(reference_corpus)
+    assert cascade.stats()["first_fraction"] == (stage == "first")
+
+
+def test_cascade_falls_back_on_languages_not_set(langid_pyc_identifier):
+    first = LanguageIdentifier.from_modelpath(DEFAULT_MODEL_PATH)
+    cascade = CascadeIdentifier(first, langid_pyc_identifier, min_confidence=0.0)
+    cascade.set_languages(["ru", "uk"])
+    # first has every language, so it is restricted too
+    assert first.nb_classes == ["ru", "uk"]
+
+    first.set_languages()
+    assert cascade.classify("this is english text")[0] in ("ru", "uk")
+    assert cascade.stats()["second"] == 1
+
+    langid_pyc_identifier.swap_model(DEFAULT_MODEL_PATH)
+    assert cascade.classify("это текст на русском")[0] == "ru"
+    assert cascade.stats()["first"] == 1
+
+
+@pytest.mark.parametrize("num_threads", (0, 1, 3))
+def test_classify_batch(langid_pyc_identifier, num_threads):
+    texts = [
+        "",
+        "this is english text",
+        "это текст на русском",
+        "tämä on suomenkielinen teksti",
+    ] * 25
+
+    assert langid_pyc_identifier.classify_batch(texts, num_threads=num_threads) == [
+        langid_pyc_identifier.classify(text) for text in texts
+    ]
+
+
+def test_rank_batch(langid_pyc_identifier):
+    texts = ["this is english text", "это текст на русском"]
+
+    assert langid_pyc_identifier.rank_batch(texts, num_threads=2) == [
+        langid_pyc_identifier.rank(text) for text in texts
+    ]
+
+
+def test_batch_uneven_lengths(langid_pyc_identifier, reference_corpus):
+    # documents tokenized together end at different points
+    texts = ["", "a"] + reference_corpus + [" ".join(reference_corpus[:20])]
+
+    assert langid_pyc_identifier.rank_batch(texts, num_threads=1) == [
+        langid_pyc_identifier.rank(text) for text in texts
+    ]
+
+
+@pytest.mark.parametrize("langs", (None, ["de", "fr", "it"]))
+def test_batch_blocked(langid_pyc_identifier, reference_corpus, langs):
+    # several blocks, sharing most of their rows
+    texts = reference_corpus * 3
+    langid_pyc_identifier.set_languages(langs)
+
+    blocked = langid_pyc_identifier.classify_batch(texts, num_threads=2, blocked=True)
+    for (lang, confidence), (expected_lang, expected_confidence) in zip(
+        blocked, langid_pyc_identifier.classify_batch(texts, num_threads=2)
+    ):
+        assert lang == expected_lang
+        assert confidence == pytest.approx(expected_confidence)
+
+    for ranking, expected in zip(
+        langid_pyc_identifier.rank_batch(texts[:5], blocked=True),
+        langid_pyc_identifier.rank_batch(texts[:5]),
+    ):
+        assert dict(ranking) == pytest.approx(dict(expected))
+
+
+@pytest.mark.parametrize("state_posteriors", (False, True))
+def test_batch_blocked_integer_encoding(flat_model_path, reference_corpus, state_posteriors):
+    identifier = LanguageIdentifier.from_modelpath(
+        flat_model_path("i16"), state_posteriors=state_posteriors
+    )
+
+    # sums of integers are exact in any order
+    assert identifier.rank_batch(reference_corpus, blocked=True) == identifier.rank_batch(
+        reference_corpus
+    )
+
+
+@pytest.mark.parametrize("offset_type", (np.int32, np.int64))
+def test_classify_column(langid_pyc_identifier, reference_corpus, offset_type):
+    encoded = [text.encode() for text in reference_corpus]
+    offsets = np.cumsum([0] + [len(text) for text in encoded]).astype(offset_type)
+    model_classes = langid_pyc_identifier.model_classes
+
+    languages, confidences, probabilities = langid_pyc_identifier.classify_column(
+        b"".join(encoded), offsets, with_probabilities=True, num_threads=2
+    )
+    for text, language, confidence, probs in zip(
+        reference_corpus, languages, confidences, probabilities
+    ):
+        expected = langid_pyc_identifier.rank(text)
+        assert model_classes[language] == expected[0][0]
+        assert confidence == pytest.approx(expected[0][1], rel=1e-6)
+        assert dict(zip(model_classes, probs)) == pytest.approx(dict(expected), abs=1e-6)
+
+    with pytest.raises(ValueError, match="do not delimit"):
+        langid_pyc_identifier.classify_column(b"".join(encoded), offsets[::-1].copy())
+
+
+def test_classify_arrow(langid_pyc_identifier, reference_corpus):
+    pa = pytest.importorskip("pyarrow")
+    texts = reference_corpus[:20]
+    model_classes = langid_pyc_identifier.model_classes
+
+    # a slice, whose offsets do not start at 0, nulls, and 64 bit offsets
+    array = pa.chunked_array(
+        [pa.array(["skipped"] + texts[:10]).slice(1), pa.array(texts[10:] + [None])]
+    )
+    languages, confidences, _ = langid_pyc_identifier.classify_arrow(array)
+    assert [model_classes[language] for language in languages[:-1]] == [
+        langid_pyc_identifier.classify(text)[0] for text in texts
+    ]
+    assert (languages[-1], confidences[-1]) == (-1, 0)
+
+    large_languages, _, _ = langid_pyc_identifier.classify_arrow(
+        pa.array(texts, type=pa.large_string())
+    )
+    assert list(large_languages) == list(languages[:-1])
+
+
+def test_classify_batch_raises_error_if_not_strings(langid_pyc_identifier):
+    with pytest.raises(TypeError, match="must be strings"):
+        langid_pyc_identifier.classify_batch(["text", b"bytes"])
+
+
+def test_async_matches_sync(langid_pyc_identifier, reference_corpus):
+    async def run():
+        classified = await asyncio.gather(
+            *(langid_pyc_identifier.classify_async(text) for text in reference_corpus)
+        )
+        ranked = await asyncio.gather(
+            *(langid_pyc_identifier.rank_async(text, 3) for text in reference_corpus)
+        )
+        return (
+            classified,
+            ranked,
+            await langid_pyc_identifier.classify_batch_async(reference_corpus),
+            await langid_pyc_identifier.rank_batch_async(reference_corpus, blocked=True),
+        )
+
+    classified, ranked, batch, ranked_batch = asyncio.run(run())
+    assert classified == batch == langid_pyc_identifier.classify_batch(reference_corpus)
+    assert ranked == [langid_pyc_identifier.rank(text, 3) for text in reference_corpus]
+    assert ranked_batch == langid_pyc_identifier.rank_batch(reference_corpus)
+
+
+def test_async_cancel_and_errors(langid_pyc_identifier, reference_corpus):
+    async def run():
+        call = asyncio.ensure_future(
+            langid_pyc_identifier.classify_async(" ".join(reference_corpus) * 100)
+        )
+        await asyncio.sleep(0)
+        call.cancel()
+        with pytest.raises(asyncio.CancelledError):
+            await call
+        # the result of the cancelled call is dropped once it arrives
+        assert await langid_pyc_identifier.classify_async(
+            b"this is english text"
+        ) == langid_pyc_identifier.classify("this is english text")
+        with pytest.raises(TypeError, match="must be strings"):
+            await langid_pyc_identifier.classify_batch_async(["text", b"bytes"])
+
+    asyncio.run(run())
+
+
+@pytest.mark.parametrize("chunk_size", (1, 7, 4096))
+def test_stream_matches_classify(langid_pyc_identifier, reference_corpus, chunk_size):
+    text = "\n".join(reference_corpus).encode()
+    stream = langid_pyc_identifier.stream_begin()
+
+    for start in range(0, len(text), chunk_size):
+        assert not stream.feed(text[start : start + chunk_size])
+
+    assert stream.num_bytes == len(text)
+    assert stream.result() == langid_pyc_identifier.classify(text.decode())
+
+
+@pytest.mark.parametrize("nb_ptc_encoding", ("f64", "i16"))
+@pytest.mark.parametrize("window, stride", ((64, 16), (100, 100), (30, 45), (10**6, 1)))
+def test_segment_matches_classify(
+    flat_model_path, reference_corpus, nb_ptc_encoding, window, stride
+):
+    identifier = LanguageIdentifier.from_modelpath(flat_model_path(nb_ptc_encoding))
+    text = " ".join(reference_corpus[:20])
+
+    for document in (text, text.encode()):
+        segments = identifier.segment(document, window, stride)
+        assert segments[0][0] == 0 and segments[-1][1] == len(document)
+        for start, end, language, confidence in segments:
+            expected = identifier.classify(document[start:end])
+            if nb_ptc_encoding == "i16":
+                # sums of integers are exact in any order
+                assert (language, confidence) == expected
+            else:
+                assert (language, confidence) == (expected[0], pytest.approx(expected[1]))
+
+
+def test_segment_merge(langid_pyc_identifier, reference_corpus):
+    text = " ".join(reference_corpus[:20])
+    segments = langid_pyc_identifier.segment(text, 60, 20)
+    spans = langid_pyc_identifier.segment(text, 60, 20, merge=True)
+
+    assert len(spans) < len(segments)
+    assert [span[0] for span in spans] == [
+        start
+        for i, (start, _, language, _) in enumerate(segments)
+        if i == 0 or segments[i - 1][2] != language
+    ]
+    assert all(first[2] != second[2] for first, second in zip(spans, spans[1:]))
+    assert langid_pyc_identifier.segment("", 60, 20) == []
+
+    with pytest.raises(ValueError, match="must be positive"):
+        langid_pyc_identifier.segment(text, 60, 0)
+
+
+def test_stream_stops_early(langid_pyc_identifier):
+    chunk = "this is english text, and it goes on and on. " * 100
+    stream = langid_pyc_identifier.stream_begin(min_bytes=10000, min_confidence=0.99)
+
+    fed = 0
+    while not stream.feed(chunk):
+        fed += 1
+
+    assert stream.done
+    assert fed < 10
+    assert 10000 <= stream.num_bytes < 20000
+    assert stream.result()[0] == "en"
+
+    # chunks after the stop are ignored
+    num_bytes = stream.num_bytes
+    assert stream.feed("это текст на русском")
+    assert stream.num_bytes == num_bytes
+
+
+def test_stats(reference_corpus):
+    identifier = LanguageIdentifier.from_modelpath(DEFAULT_MODEL_PATH)
+    identifier.classify("not counted")
+    assert identifier.stats()["calls"] == 0
+
+    identifier.enable_stats()
+    for text in reference_corpus:
+        identifier.classify(text)
+    identifier.rank_batch(reference_corpus[:3])
+
+    stats = identifier.stats()
+    texts = reference_corpus + reference_corpus[:3]
+    assert stats["enabled"]
+    assert stats["calls"] == len(texts)
+    assert stats["bytes"] == sum(len(text.encode()) for text in texts)
+    assert sum(stats["sv_members"]) == sum(stats["fv_members"]) == len(texts)
+    assert all(cycles > 0 for cycles in stats["stage_cycles"].values())
+    assert sum(stats["stage_seconds"].values()) > 0
+
+    identifier.reset_stats()
+    identifier.enable_stats(False)
+    identifier.classify("not counted")
+    stats = identifier.stats()
+    assert not stats["enabled"]
+    assert stats["calls"] == stats["bytes"] == sum(stats["sv_members"]) == 0
+
+
+def test_stats_with_cache(reference_corpus):
+    texts = [text for text in reference_corpus if len(text.encode()) <= 256][:3]
+    identifier = LanguageIdentifier.from_modelpath(DEFAULT_MODEL_PATH, cache_size=1024)
+    identifier.enable_stats()
+    for _ in range(10):
+        identifier.classify("hello world")
+    for _ in range(2):
+        identifier.classify_batch(texts)
+
+    stats = identifier.stats()
+    assert stats["calls"] == 16
+    assert stats["bytes"] == 10 * 11 + 2 * sum(len(text.encode()) for text in texts)
+    assert stats["cache_hits"] == identifier.cache_info()["hits"] == 9 + 3
+    assert sum(stats["sv_members"]) == stats["calls"] - stats["cache_hits"]
+
+
+def test_cache(langid_pyc_identifier, reference_corpus):
+    texts = [text for text in reference_corpus if len(text.encode()) <= 256][:50]
+    identifier = LanguageIdentifier.from_modelpath(DEFAULT_MODEL_PATH, cache_size=1024)
+    assert identifier.cache_info() == {
+        "hits": 0,
+        "misses": 0,
+        "currsize": 0,
+        "maxsize": 1024,
+    }
+
+    for _ in range(2):
+        assert [identifier.classify(text) for text in texts] == [
+            langid_pyc_identifier.classify(text) for text in texts
+        ]
+        assert identifier.rank(texts[0]) == langid_pyc_identifier.rank(texts[0])
+    info = identifier.cache_info()
+    assert info["misses"] == len(set(texts))
+    assert info["hits"] == 2 * len(texts) + 2 - len(set(texts))
+    assert info["currsize"] == len(set(texts))
+
+    # results for all languages must not be served for a subset
+    identifier.set_languages(["de", "fr"])
+    langid_pyc_identifier.set_languages(["de", "fr"])
+    assert [identifier.classify(text) for text in texts] == [
+        langid_pyc_identifier.classify(text) for text in texts
+    ]
+    assert identifier.cache_info()["misses"] == 2 * len(set(texts))
+
+
+@pytest.mark.parametrize("nb_ptc_encoding", ("f64", "i16"))
+def test_state_posteriors(flat_model_path, reference_corpus, nb_ptc_encoding):
+    path = flat_model_path(nb_ptc_encoding)
+    by_feature = LanguageIdentifier.from_modelpath(path)
+    by_state = LanguageIdentifier.from_modelpath(path, state_posteriors=True)
+
+    for langs in (None, ["de", "fr", "it"]):
+        by_feature.set_languages(langs)
+        by_state.set_languages(langs)
+        for text in reference_corpus:
+            if nb_ptc_encoding == "f64":
+                # the rows of a state are summed before being scaled by its count
+                lang, confidence = by_state.classify(text)
+                assert lang == by_feature.classify(text)[0]
+                assert confidence == pytest.approx(by_feature.classify(text)[1])
+            else:
+                # sums of integers are exact
+                assert by_state.classify(text) == by_feature.classify(text)
+                assert by_state.rank(text) == by_feature.rank(text)
+
+
+@pytest.mark.skipif(not HAS_DEFAULT_MODEL, reason="no model linked into the extension")
+def test_default_model_matches_model_file(reference_corpus):
+    linked = LanguageIdentifier.from_default_model()
+    from_file = LanguageIdentifier.from_modelpath(DEFAULT_MODEL_PATH)
+
+    assert linked.nb_classes == from_file.nb_classes
+    for text in reference_corpus:
+        assert linked.rank(text) == from_file.rank(text)
+
+
+def test_default_model_raises_error_if_not_linked():
+    if HAS_DEFAULT_MODEL:
+        pytest.skip("a model is linked into the extension")
+    with pytest.raises(RuntimeError):
+        LanguageIdentifier.from_default_model()
+
+
+def test_pruned_model_matches_language_subset(
+    langid_pyc_identifier, pruned_model_path, reference_corpus
+):
+    langs = ["de", "en", "fr"]
+    pruned = LanguageIdentifier.from_modelpath(pruned_model_path(langs))
+    langid_pyc_identifier.set_languages(langs)
+
+    assert pruned.nb_classes == langs
+    for text in reference_corpus:
+        lang, confidence = pruned.classify(text)
+        expected_lang, expected_confidence = langid_pyc_identifier.classify(text)
+        assert lang == expected_lang
+        assert confidence == pytest.approx(expected_confidence)
+
+
+def test_pruned_model_features(pruned_model_path):
+    pruned = LanguageIdentifier.from_modelpath(pruned_model_path(["en", "ru"], 200))
+
+    assert pruned.classify("This is a simple English sentence.")[0] == "en"
+    assert pruned.classify("Это простое русское предложение.")[0] == "ru"
+
+
+def test_cache_disabled_by_default():
+    identifier = LanguageIdentifier.from_modelpath(DEFAULT_MODEL_PATH)
+    identifier.classify("hello world")
+    assert identifier.cache_info()["maxsize"] == 0
+    assert identifier.cache_info()["hits"] == identifier.cache_info()["misses"] == 0
+
+
+@pytest.mark.skipif(not PROTOBUF_MODEL_PATH.exists(), reason="no protobuf model built")
+@pytest.mark.parametrize(
+    "text",
+    (
+        "",
+        "this is english text",
+        "это текст на русском",
+        "tämä on suomenkielinen teksti",
+    ),
+)
+def test_flat_model_matches_protobuf_model(langid_pyc_identifier, text):
+    protobuf_identifier = LanguageIdentifier.from_modelpath(PROTOBUF_MODEL_PATH)
+
+    assert protobuf_identifier.nb_classes == langid_pyc_identifier.nb_classes
+    assert protobuf_identifier.rank(text) == langid_pyc_identifier.rank(text)
+
+
+def test_load_model_raises_error_if_flat_model_truncated(tmp_path, capfd):
+    with open(DEFAULT_MODEL_PATH, "rb") as model:
+        truncated = tmp_path / "truncated.fmodel"
+        truncated.write_bytes(model.read(4096))
+
+    with pytest.raises(RuntimeError, match="Failed to load"):
+        LanguageIdentifier.from_modelpath(truncated)
+    assert capfd.readouterr().err.startswith("Malformed flat model")
+
+
+# FLAT_MODEL_TK_OUTPUT: feature ids past num_feats,
+# FLAT_MODEL_TK_TRANSITIONS: uint16 states past num_states
+@pytest.mark.parametrize(
+    "section_id, element", ((4, b"\xff\xff\xff\x7f"), (10, b"\xff\xff"))
+)
+def test_load_model_raises_error_if_flat_model_out_of_range(
+    corrupt_flat_model_path, capfd, section_id, element
+):
+    with pytest.raises(RuntimeError, match="Failed to load"):
+        LanguageIdentifier.from_modelpath(corrupt_flat_model_path(section_id, element))
+    assert capfd.readouterr().err.startswith("Malformed flat model")
+
+
+@pytest.mark.parametrize(
+    "nb_ptc_encoding, min_agreement, max_confidence_error",
+    (
+        ("f32", 1.0, 1e-6),
+        ("i16", 1.0, 1e-3),
+        ("i8", 0.95, 0.1),
+    ),
+)
+def test_quantized_model(
+    langid_pyc_identifier,
+    flat_model_path,
+    reference_corpus,
+    nb_ptc_encoding,
+    min_agreement,
+    max_confidence_error,
+):
+    quantized_identifier = LanguageIdentifier.from_modelpath(
+        flat_model_path(nb_ptc_encoding)
+    )
+
+    agreement = 0
+    for text in reference_corpus:
+        lang, prob = langid_pyc_identifier.classify(text)
+        quantized_probs = dict(quantized_identifier.rank(text))
+
+        agreement += quantized_identifier.classify(text)[0] == lang
+        assert quantized_probs[lang] == pytest.approx(prob, abs=max_confidence_error)
+
+    assert agreement / len(reference_corpus) >= min_agreement
+
+
+def test_vector_kernels_match_scalar_kernels(
+    langid_pyc_identifier, reference_corpus, monkeypatch
+):
+    monkeypatch.setenv("LANGID_KERNELS", "scalar")
+    scalar_identifier = LanguageIdentifier.from_modelpath(DEFAULT_MODEL_PATH)
+    assert scalar_identifier._backend.kernels == "scalar"
+
+    for text in reference_corpus:
+        assert scalar_identifier.rank(text) == langid_pyc_identifier.rank(text)